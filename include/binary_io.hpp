@@ -5,6 +5,8 @@
 #include <iostream>
 #include <vector>
 #include <cassert>
+#include <algorithm>
+#include <string>
 
 /**
  * LoadFromFileBinary<type in>(type out) 
@@ -132,6 +134,74 @@ std::pair<size_t, size_t> LoadFromFileBinaryDeep(std::vector<T>& data, const std
     return {N, D};
 }
 
+/**
+ * Reads a file in the format of LoadFromFileBinary (each vector preceded by its 4-byte
+ * dimension) a batch at a time, so sets larger than memory can be streamed, e.g. to
+ * MiniBatchKMeans. The vectors are converted from Tin to Tout.
+ * @param cyclic: start over at the end of the file instead of returning 0, for several epochs
+*/
+template<typename Tin, typename Tout>
+class VecsFileReader {
+public:
+    explicit VecsFileReader(const std::string& filename, bool cyclic = false)
+        : file_(filename, std::ios::binary), cyclic_(cyclic)
+    {
+        if (!file_.is_open()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            throw;
+        }
+        int D;
+        file_.read(reinterpret_cast<char*>(&D), sizeof(int));
+        D_ = D;
+        file_.seekg(0, std::ios::end);
+        N_ = (size_t)file_.tellg() / (D_ * sizeof(Tin) + 4);
+        file_.seekg(0, std::ios::beg);
+    }
+
+    size_t dim() const { return D_; }
+    size_t size() const { return N_; }
+
+    /**
+     * @param out: room for n x dim() vectors
+     * @return the number of vectors read, 0 at the end of a non-cyclic file
+    */
+    size_t Read(Tout* out, size_t n)
+    {
+        size_t row = D_ * sizeof(Tin) + 4;
+        size_t nread = 0;
+        while (nread < n) {
+            if (cursor_ == N_) {
+                if (!cyclic_ || N_ == 0) break;
+                Rewind();
+            }
+            size_t chunk = std::min(n - nread, N_ - cursor_);
+            buffer_.resize(chunk * row);
+            file_.read(buffer_.data(), chunk * row);
+            for (size_t i = 0; i < chunk; ++i) {
+                const Tin* v = reinterpret_cast<const Tin*>(buffer_.data() + i * row + 4);
+                std::copy(v, v + D_, out + (nread + i) * D_);
+            }
+            nread += chunk;
+            cursor_ += chunk;
+        }
+        return nread;
+    }
+
+    void Rewind()
+    {
+        file_.clear();
+        file_.seekg(0, std::ios::beg);
+        cursor_ = 0;
+    }
+
+private:
+    std::ifstream file_;
+    bool cyclic_;
+    size_t D_, N_;
+    size_t cursor_ = 0;
+    std::vector<char> buffer_;
+};
+
 template<typename T>
 void WriteToFileBinary(const std::vector<T>& data, std::pair<size_t, size_t> dimension, const std::string& filename) {
     std::ofstream file(filename, std::ios::binary | std::ios::trunc);
@@ -0,0 +1,105 @@
+#ifndef INCLUDE_CENTROID_GRAPH_HPP
+#define INCLUDE_CENTROID_GRAPH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "distance.hpp"
+
+// HNSW graph over the coarse centers, for the lists to probe when kc is too large for
+// the exact search (centroid_search.hpp), whose cost per query grows with kc.
+//
+// Every center gets a random level, geometric of ratio 1 / M. The centers of level l
+// and above are linked in layer l to at most M others (2M in layer 0), picked by the
+// HNSW heuristic: a neighbor is only kept if it is closer to the center than to the
+// neighbors kept before it, so that the links go in every direction. A search goes down
+// greedily from the top layer, then explores layer 0 best-first, keeping the ef closest
+// centers seen. It compares the query with O(ef log k) centers instead of k.
+//
+// Distances follow fvec_distance, like the exact search.
+
+// Buffers of the graph search. Keep one per thread: once grown, a search does not allocate
+struct GraphSearchScratch {
+    std::vector<uint32_t> visited;      // tag of the last search that reached each center
+    uint32_t tag = 0;
+    std::vector<std::pair<float, uint32_t>> candidates, results;
+    std::vector<uint32_t> neighbors;    // copy of a list of links, while the graph is built
+};
+
+class CentroidGraph {
+public:
+    CentroidGraph() = default;
+    /**
+     * @param centers:  k x d, row-major. They are read in place, and must outlive the graph
+     * @param M:        links per center and layer, 2M in layer 0
+     * @param ef_construction: centers kept by the search for the links of every center
+    */
+    CentroidGraph(const float* centers, size_t k, size_t d, MetricType metric,
+                  size_t M = 16, size_t ef_construction = 200, int seed = 123);
+
+    size_t k() const { return k_; }
+    size_t d() const { return d_; }
+    MetricType metric() const { return metric_; }
+
+    /**
+     * The w closest centers of x, closest first (w is capped at k), among the ef
+     * (at least w) closest the search comes across.
+     * @param labels:   w ids
+     * @param dists:    w distances, can be nullptr
+    */
+    template<typename T>
+    void Search(const T* x, size_t w, size_t ef, uint32_t* labels, float* dists,
+                GraphSearchScratch& scratch) const;
+
+    void Write(const std::string& path) const;
+    // centers: the k x d centers the graph was built on, read in place
+    void Load(const std::string& path, const float* centers);
+
+private:
+    template<typename T>
+    float Distance(const T* x, uint32_t c) const {
+        return fvec_distance(metric_, x, centers_ + c * d_, d_);
+    }
+    // Links of c in layer l: the count, then up to M0_ (l = 0) or M_ ids
+    uint32_t* Links(uint32_t c, int l) {
+        return l == 0 ? links0_.data() + c * (M0_ + 1) : upper_[c].data() + (l - 1) * (M_ + 1);
+    }
+    const uint32_t* Links(uint32_t c, int l) const {
+        return l == 0 ? links0_.data() + c * (M0_ + 1) : upper_[c].data() + (l - 1) * (M_ + 1);
+    }
+
+    // Links of c in layer l, the count first. While the graph is built, a copy taken
+    // under the lock of c, in scratch.neighbors
+    const uint32_t* ReadLinks(uint32_t c, int l, GraphSearchScratch& scratch, std::mutex* locks) const;
+    // Moves from cur to its closest neighbor in layer l as long as one is closer to x
+    template<typename T>
+    void Greedy(const T* x, int l, uint32_t& cur, float& dcur, GraphSearchScratch& scratch,
+                std::mutex* locks) const;
+    // Best-first search of layer l from cur. The ef closest centers are left in
+    // scratch.results, a max-heap of (distance, id)
+    template<typename T>
+    void SearchLayer(const T* x, int l, uint32_t cur, float dcur, size_t ef,
+                     GraphSearchScratch& scratch, std::mutex* locks) const;
+    // Keeps at most m of the candidates (distance to c, id), closest first, by the heuristic
+    void SelectNeighbors(std::vector<std::pair<float, uint32_t>>& candidates, size_t m) const;
+    void Insert(uint32_t c, size_t ef_construction, GraphSearchScratch& scratch, std::mutex* locks);
+    // Links c to n in layer l, pruning the links of c if it has too many
+    void AddLink(uint32_t c, uint32_t n, int l, std::mutex* locks);
+
+    const float* centers_ = nullptr;
+    size_t k_ = 0;
+    size_t d_ = 0;
+    MetricType metric_ = METRIC_L2;
+    size_t M_ = 0, M0_ = 0;
+    int max_level_ = -1;
+    uint32_t entry_ = 0;                        // a center of max_level_, where searches start
+    std::vector<int> levels_;
+    std::vector<uint32_t> links0_;              // layer 0, k x (M0_ + 1)
+    std::vector<std::vector<uint32_t>> upper_;  // layers 1 .. levels_[c] of c, M_ + 1 each
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef INCLUDE_CENTROID_SEARCH_HPP
+#define INCLUDE_CENTROID_SEARCH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "distance.hpp"
+#include "util.hpp"
+
+// Blocked nearest-center search, used for k-means assignment, PQ encoding and the
+// coarse search of the IVF indexes, and the full distance tables of PQ queries.
+//
+// It is a small matrix multiplication: ||x - c||^2 = ||x||^2 - 2 <x, c> + ||c||^2,
+// where the center norms are computed once and the inner products of a tile of vectors
+// with all the centers come from fvec_inner_product_panel_16. The centers are packed
+// once into panels of 16, stored dimension-major, so the kernel accumulates 16 centers
+// per SIMD lane group without any horizontal sum, and up to 8 vectors share every load
+// of a panel. The vector tile stays in L1 and a group of panels in L2 while every
+// vector of the tile is compared with it.
+//
+// Distances follow fvec_distance: squared L2 (clamped at 0), or the negated
+// inner product for similarity metrics.
+// Large batches are split over OpenMP threads; inside a parallel region
+// (e.g. one call per query) the search runs on the calling thread.
+
+// k centers of dimension d packed for the blocked search, with their squared norms.
+// Build it once per set of centers: packing costs as much as searching one vector.
+class CenterPanels {
+public:
+    CenterPanels() = default;
+    // centers: k x d, row-major
+    CenterPanels(const float* centers, size_t k, size_t d);
+
+    size_t k() const { return k_; }
+    size_t d() const { return d_; }
+    size_t npanel() const { return (k_ + 15) / 16; }
+    // Centers 16p .. 16p+15, panel[j * 16 + c]. The last panel is padded with zeros
+    const float* panel(size_t p) const { return panels_.data() + p * d_ * 16; }
+    // ||c||^2, padded like the panels
+    const float* norms() const { return norms_.data(); }
+
+private:
+    size_t k_ = 0;
+    size_t d_ = 0;
+    AlignedVector<float> panels_;   // every panel starts on a cache line
+    AlignedVector<float> norms_;
+};
+
+/**
+ * Closest center of each vector.
+ * @param x:        n vectors of dimension centers.d(), row i starts at x + i * stride
+ * @param labels:   n ids in [0, k)
+ * @param dists:    n distances, can be nullptr
+*/
+template<typename T>
+void NearestCenters(
+    const T* x, size_t n, size_t stride,
+    const CenterPanels& centers,
+    uint32_t* labels, float* dists,
+    MetricType metric = METRIC_L2
+);
+
+/**
+ * The w closest centers of each vector, closest first (w is capped at k).
+ * @param labels:   n x w ids
+ * @param dists:    n x w distances, can be nullptr
+*/
+template<typename T>
+void TopWCenters(
+    const T* x, size_t n, size_t stride,
+    const CenterPanels& centers,
+    size_t w, uint32_t* labels, float* dists,
+    MetricType metric = METRIC_L2
+);
+
+/**
+ * Distances of each vector to all the centers, as one product with the panels.
+ * @param dists:    row i, the k distances of vector i, starts at dists + i * ldd
+*/
+template<typename T>
+void CenterDistances(
+    const T* x, size_t n, size_t stride,
+    const CenterPanels& centers,
+    float* dists, size_t ldd,
+    MetricType metric = METRIC_L2
+);
+
+// Buffers of MultiSequence, and of the search of the cells of an inverted multi-index
+// (Quantizer::search_cells). Once grown, a search does not allocate
+struct MultiSequenceScratch {
+    std::vector<uint32_t> labels;   // the L closest centers of each half
+    std::vector<float> dists;
+    std::vector<uint32_t> pairs;
+    std::vector<uint32_t> traversed;
+    std::vector<std::pair<float, uint32_t>> heap;
+};
+
+/**
+ * The w pairs (r0, r1) of the smallest d0[r0] + d1[r1], smallest first, by the
+ * multi-sequence algorithm: a pair only enters the queue once the pairs before it
+ * in its row and column are out, so at most w + L are looked at.
+ * @param d0, d1:   L distances each, sorted increasingly
+ * @param pairs:    w pairs, r0 * L + r1 (w is capped at L * L)
+ * @param dists:    w sums, can be nullptr
+*/
+void MultiSequence(
+    const float* d0, const float* d1, size_t L,
+    size_t w, uint32_t* pairs, float* dists,
+    MultiSequenceScratch& scratch
+);
+
+#endif
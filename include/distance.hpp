@@ -6,7 +6,7 @@
 // https://software.intel.com/sites/landingpage/IntrinsicsGuide/#expand=590,27,2
 #ifdef _MSC_VER
 
-#  include <immintrin.h> 
+#  include <immintrin.h>
 
 
 #else
@@ -15,7 +15,11 @@
 
 #endif
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 // These fast L2 squared distance codes (SSE and AVX) are from the Faiss library:
 // https://github.com/facebookresearch/faiss/blob/master/utils.cpp
@@ -23,66 +27,223 @@
 // Based on them, AVX512 implementation is also prepared.
 // But it doesn't seem drastically fast. Only slightly faster than AVX:
 // (runtime) REF >> SSE >= AVX ~ AVX512
+//
+// Every variant is compiled into libtoy regardless of the -march it is built with.
+// The best one for the host is bound once, when the library is loaded, by checking
+// CPUID (see distance.cpp). So a single build runs on any SSE4.2 machine and still
+// uses AVX512 where it is available.
+// The environment variable TOY_SIMD ("sse", "avx", "avx2", "avx512", "avx512_vnni")
+// caps the chosen level, which is handy to compare the kernels on one machine.
+//
+// The uint8 kernels have AVX2 and AVX512BW versions, and use VNNI (vpdpwssd) when
+// the CPU has it. The uint8 x float kernel is vectorized from SSE4.1 up.
+//
+// The 4-bit PQ fast-scan kernel looks its uint8 tables up in registers with pshufb,
+// one sub-space per SSSE3 step, 2 per AVX2 step and 4 per AVX512BW step.
+// The 8-bit PQ block kernel gathers its float tables, 8 codes per AVX2 vgatherdps
+// and 16 per AVX512 one; SSE has no gather and loops over the codes.
+// Its uint8 / uint16 table versions gather 32-bit words and mask the entry out.
 
 
 
 // From Faiss.
 // Reference implementation
 float fvec_L2sqr_ref(const float *x, const float *y, size_t d);
-float fvec_L2sqr(const uint8_t *x, const uint8_t *y, size_t d);
-float fvec_L2sqr(const uint8_t *x, const float *y, size_t d);
-
-
-// ========================= Reading functions ============================
-
-// Reading function for SSE, AVX, and AVX512
-// This function is from Faiss
-// reads 0 <= d < 4 floats as __m128
-static inline __m128 masked_read (int d, const float *x);
-
-#if defined(__AVX__)
-
-// Reading function for AVX and AVX512
-// This function is from Faiss
-// reads 0 <= d < 8 floats as __m256
-static inline __m256 masked_read_8 (int d, const float *x);
-
-#endif // __AVX__
-
-#if defined(__AVX512F__) 
-// Reading function for AVX512
-// reads 0 <= d < 16 floats as __m512
-static inline __m512 masked_read_16 (int d, const float *x);
-
-#endif // __AVX512F__
+float fvec_inner_product_ref(const float *x, const float *y, size_t d);
+
+
+// ========================= Metrics ============================
+
+// Metric used by an index to compare vectors.
+// METRIC_COSINE is the inner product of L2-normalized vectors; it is only
+// available for float data, since uint8 vectors cannot be normalized in place.
+enum MetricType {
+    METRIC_L2 = 0,
+    METRIC_INNER_PRODUCT = 1,
+    METRIC_COSINE = 2,
+};
+
+// Inner product and cosine are similarities: the larger, the closer.
+inline bool IsSimilarity(MetricType metric) { return metric != METRIC_L2; }
+
+
+// ========================= Runtime dispatch ============================
+
+// Table of the kernels used by the library.
+// It is statically initialized with the portable versions, so that a call made
+// before the dispatcher has run (e.g. from another static initializer) is still valid.
+struct SimdKernels {
+    float (*L2sqr)(const float *x, const float *y, size_t d);
+    float (*L2sqr_u8)(const uint8_t *x, const uint8_t *y, size_t d);
+    float (*L2sqr_u8f32)(const uint8_t *x, const float *y, size_t d);
+    float (*inner_product)(const float *x, const float *y, size_t d);
+    float (*inner_product_u8)(const uint8_t *x, const uint8_t *y, size_t d);
+    float (*inner_product_u8f32)(const uint8_t *x, const float *y, size_t d);
+    void (*inner_product_panel_16)(const float *x, size_t ldx, size_t nx,
+        const float *panel, size_t d, float *out);
+    void (*pq4_accumulate)(const uint8_t *blocks, size_t nblock,
+        const uint8_t *lut, size_t M, uint16_t *out);
+    void (*pq8_accumulate)(const uint8_t *blocks, size_t nblock,
+        const float *table, size_t M, size_t ksub, float *out);
+    void (*pq8_accumulate_u8)(const uint8_t *blocks, size_t nblock,
+        const uint8_t *table, size_t M, size_t ksub, uint32_t *out);
+    void (*pq8_accumulate_u16)(const uint8_t *blocks, size_t nblock,
+        const uint16_t *table, size_t M, size_t ksub, uint32_t *out);
+};
+
+extern SimdKernels g_simd_kernels;
+
+// Name of the kernel family chosen at load time:
+// "avx512_vnni", "avx512", "avx2", "avx" or "sse".
+extern const std::string g_simd_architecture;
+
+// Rebinds g_simd_kernels to the best variants for the host, capped at the level
+// named cap (same names as TOY_SIMD; nullptr for no cap), and returns the name of
+// the bound family. g_simd_architecture keeps the name chosen at load time.
+// Not thread-safe: only call it while no kernel runs, e.g. from a test.
+std::string BindSimdKernels(const char* cap);
 
 
 
 // ========================= Distance functions ============================
 
-#if defined(__AVX512F__)  
-static const std::string g_simd_architecture = "avx512";
-
-// AVX512 implementation by Yusuke
-float fvec_L2sqr (const float *x, const float *y, size_t d);
-
-#elif defined (__AVX__)  
-static const std::string g_simd_architecture = "avx";
-
-// This function is from Faiss
-// AVX implementation
-float fvec_L2sqr (const float *x, const float *y, size_t d);
-
-#else 
-static const std::string g_simd_architecture = "sse";
-
-
-// This function is from Faiss
-// SSE implementation. Unroot!
-float fvec_L2sqr(const float *x, const float *y, size_t d);
-
-
-#endif
+inline float fvec_L2sqr(const float *x, const float *y, size_t d)
+{
+    return g_simd_kernels.L2sqr(x, y, d);
+}
+
+inline float fvec_L2sqr(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    return g_simd_kernels.L2sqr_u8(x, y, d);
+}
+
+inline float fvec_L2sqr(const uint8_t *x, const float *y, size_t d)
+{
+    return g_simd_kernels.L2sqr_u8f32(x, y, d);
+}
+
+inline float fvec_inner_product(const float *x, const float *y, size_t d)
+{
+    return g_simd_kernels.inner_product(x, y, d);
+}
+
+inline float fvec_inner_product(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    return g_simd_kernels.inner_product_u8(x, y, d);
+}
+
+inline float fvec_inner_product(const uint8_t *x, const float *y, size_t d)
+{
+    return g_simd_kernels.inner_product_u8f32(x, y, d);
+}
+
+// Inner products of nx <= 8 vectors (vector r at x + r * ldx, d floats) with a panel of
+// 16 vectors stored dimension-major (panel[j * 16 + c] is dimension j of vector c):
+// out[r * 16 + c] = <x_r, panel_c>
+inline void fvec_inner_product_panel_16(const float *x, size_t ldx, size_t nx,
+    const float *panel, size_t d, float *out)
+{
+    g_simd_kernels.inner_product_panel_16(x, ldx, nx, panel, d, out);
+}
+
+// ========================= 4-bit PQ fast scan ============================
+
+// Codes of 4-bit PQ (16 centers per sub-space) are scanned 32 at a time.
+// A block holds the M codes of 32 vectors, sub-space after sub-space:
+// byte j of sub-space m (block[m * 16 + j]) is the code of vector j in its low
+// nibble and the code of vector j + 16 in its high nibble.
+constexpr size_t PQ4_BLOCK_SIZE = 32;
+// M is padded to a multiple of this (with all-zero codes and tables),
+// the number of sub-spaces of one AVX512 step
+constexpr size_t PQ4_M_ALIGN = 4;
+
+// Sums of the uint8 lookup tables lut (M x 16) over the codes of nblock blocks:
+// out[b * 32 + v] = sum_m lut[m * 16 + code_m(v)] of vector v of block b.
+// M must be a multiple of PQ4_M_ALIGN; sums saturate nothing, so M <= 256.
+inline void pq4_accumulate(const uint8_t *blocks, size_t nblock,
+    const uint8_t *lut, size_t M, uint16_t *out)
+{
+    g_simd_kernels.pq4_accumulate(blocks, nblock, lut, M, out);
+}
+
+// Code of vector v < 32 in sub-space m of a block, and its update
+inline uint8_t pq4_get_code(const uint8_t *block, size_t m, size_t v)
+{
+    return (block[m * 16 + v % 16] >> (v / 16 * 4)) & 0x0f;
+}
+
+inline void pq4_set_code(uint8_t *block, size_t m, size_t v, uint8_t code)
+{
+    const int shift = v / 16 * 4;
+    uint8_t &byte = block[m * 16 + v % 16];
+    byte = (byte & ~(0x0f << shift)) | (code << shift);
+}
+
+// ========================= 8-bit PQ blocks ============================
+
+// Codes of 8-bit PQ laid out by blocks of 16 vectors, transposed:
+// block[m * 16 + v] is the code of vector v in sub-space m.
+constexpr size_t PQ8_BLOCK_SIZE = 16;
+
+inline uint8_t pq8_get_code(const uint8_t *block, size_t m, size_t v)
+{
+    return block[m * PQ8_BLOCK_SIZE + v];
+}
+
+inline void pq8_set_code(uint8_t *block, size_t m, size_t v, uint8_t code)
+{
+    block[m * PQ8_BLOCK_SIZE + v] = code;
+}
+
+// Sums of the float table (M x ksub) over the codes of nblock blocks:
+// out[b * 16 + v] = sum_m table[m * ksub + code_m(v)] of vector v of block b
+inline void pq8_accumulate(const uint8_t *blocks, size_t nblock,
+    const float *table, size_t M, size_t ksub, float *out)
+{
+    g_simd_kernels.pq8_accumulate(blocks, nblock, table, M, ksub, out);
+}
+
+// Same with quantized tables, summed in uint32. The entries are read with 32-bit
+// gathers, so the table must stay readable up to 4 bytes past its last entry
+inline void pq8_accumulate(const uint8_t *blocks, size_t nblock,
+    const uint8_t *table, size_t M, size_t ksub, uint32_t *out)
+{
+    g_simd_kernels.pq8_accumulate_u8(blocks, nblock, table, M, ksub, out);
+}
+
+inline void pq8_accumulate(const uint8_t *blocks, size_t nblock,
+    const uint16_t *table, size_t M, size_t ksub, uint32_t *out)
+{
+    g_simd_kernels.pq8_accumulate_u16(blocks, nblock, table, M, ksub, out);
+}
+
+// Distance between x and y under `metric`, oriented so that smaller is closer:
+// the squared L2 distance, or the negated inner product for similarities.
+// The indexes rank with it and flip the sign back when they return results,
+// so callers of an IP / cosine index get similarities ordered max first.
+template<typename Tx, typename Ty>
+inline float fvec_distance(MetricType metric, const Tx *x, const Ty *y, size_t d)
+{
+    return metric == METRIC_L2 ? fvec_L2sqr(x, y, d) : -fvec_inner_product(x, y, d);
+}
+
+// Scales x to unit L2 norm. A zero vector is left as is.
+void fvec_normalize_L2(float *x, size_t d);
+
+// Copy of the n vectors of x (dimension d), normalized for METRIC_COSINE.
+// Integer vectors are copied as is: the indexes reject METRIC_COSINE for them.
+template<typename T>
+std::vector<T> NormalizedCopy(const T *x, size_t n, size_t d)
+{
+    std::vector<T> normalized(x, x + n * d);
+    if constexpr (std::is_same<T, float>::value) {
+        #pragma omp parallel for
+        for (size_t i = 0; i < n; ++i) {
+            fvec_normalize_L2(normalized.data() + i * d, d);
+        }
+    }
+    return normalized;
+}
 
 // namespace Anonymous
 
@@ -0,0 +1,85 @@
+#ifndef INCLUDE_EARLY_STOP_HPP
+#define INCLUDE_EARLY_STOP_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+#include "topk.hpp"
+
+
+namespace toy {
+
+// Why a search stopped probing lists
+enum StopReason {
+    STOP_NPROBE = 0,        // all the nprobe lists were scanned
+    STOP_DISTANCE = 1,      // the next list was too far from the k-th best (distance_ratio)
+    STOP_BUDGET = 2,        // max_candidates entries were scanned
+    STOP_CONVERGED = 3,     // the k-th best did not improve over the last patience lists
+};
+
+/**
+ * Adaptive probing. The lists are still scanned nearest first, nprobe at most, but the
+ * search stops before the next one as soon as one of the tests set (non-zero) holds, so
+ * that easy queries end after a few lists and hard ones go on to nprobe.
+ * The first list is always scanned. Distances follow fvec_distance
+ * @param distance_ratio: the coarse distance d of the next list is past the k-th best dk:
+ *        d > dk + (distance_ratio - 1) |dk|, i.e. d > distance_ratio * dk for METRIC_L2
+ * @param max_candidates: that many entries were scanned
+ * @param patience: the k-th best did not improve over the last patience lists
+ */
+struct EarlyStop {
+    float distance_ratio = 0;
+    size_t max_candidates = 0;
+    size_t patience = 0;
+};
+
+struct SearchStats {
+    size_t nlist = 0;           // lists scanned
+    size_t ncandidates = 0;     // entries scanned
+    StopReason reason = STOP_NPROBE;
+};
+
+// The tests of an EarlyStop over the lists of one search, which pushes its entries to topk
+class ProbeMonitor {
+public:
+    ProbeMonitor(const EarlyStop& stop, const TopK& topk) : stop_(stop), topk_(topk) {}
+
+    // Whether to stop before the next list, at coarse distance coarse, with ncandidates
+    // entries scanned so far. Called before every list
+    bool Stop(float coarse, size_t ncandidates) {
+        if (nlist_ > 0) {
+            const float kth = topk_.threshold();
+            const bool full = kth != std::numeric_limits<float>::infinity();
+            nstill_ = !full || kth < last_kth_ ? 0 : nstill_ + 1;
+            last_kth_ = kth;
+
+            if (stop_.max_candidates > 0 && ncandidates >= stop_.max_candidates) {
+                reason_ = STOP_BUDGET;
+            } else if (stop_.distance_ratio > 0 && full
+                       && coarse > kth + (stop_.distance_ratio - 1) * std::abs(kth)) {
+                reason_ = STOP_DISTANCE;
+            } else if (stop_.patience > 0 && nstill_ >= stop_.patience) {
+                reason_ = STOP_CONVERGED;
+            }
+            if (reason_ != STOP_NPROBE) return true;
+        }
+        ++nlist_;
+        return false;
+    }
+
+    size_t nlist() const { return nlist_; }
+    StopReason reason() const { return reason_; }
+
+private:
+    const EarlyStop& stop_;
+    const TopK& topk_;
+    size_t nlist_ = 0;
+    size_t nstill_ = 0;         // lists in a row that left the k-th best as it was
+    float last_kth_ = std::numeric_limits<float>::infinity();
+    StopReason reason_ = STOP_NPROBE;
+};
+
+} // namespace toy
+
+#endif
@@ -6,9 +6,14 @@
 #include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <memory>
 #include "util.hpp"
 #include "quantizer.hpp"
 #include "distance.hpp"
+#include "inverted_lists.hpp"
+#include "search_context.hpp"
+#include "early_stop.hpp"
+#include "centroid_graph.hpp"
 #include <omp.h>
 
 
@@ -20,15 +25,27 @@ namespace toy {
  * @param D_ the number of dimensions
  * @param L_ the expected number of candidates involed when searching is performed
  * @param kc the number of coarse quantizer's (nlist) centers. Default: 100
- * @param mc the number of subspace for coarse quantizer. mc must be 1
- * @param dc the dimensions of subspace for coarse quantize and product quantizer. dc must be D_.  dp = D_ / mp
+ * @param mc the number of subspace for coarse quantizer: 1, or 2 for an inverted multi-index, whose
+ *        kc^2 lists are the cells of the centers of the two halves of the vectors, kc each
+ *        (mc = 2 cannot be used with BuildCoarseGraph)
+ * @param dc the dimensions of subspace for coarse quantize and product quantizer. dc = D_ / mc.  dp = D_ / mp
  * @param db_path path to the DB files
  * @param db_prefix the prefix of DB files
+ * @param metric METRIC_L2 (default), METRIC_INNER_PRODUCT or METRIC_COSINE (float data only).
+ *        With a similarity metric, results hold similarities ordered from the largest
+ * @param spill the number of lists a vector is stored in, at most. Default: 1. With more, a vector
+ *        near the border of its list is also stored in the next nearest ones, so that fewer lists
+ *        are probed for the same recall, for more memory. Search returns every id once
+ * @param spill_ratio a vector spills to a list whose distance is within spill_ratio of the nearest
+ *        one (see Quantizer::spill_cells). Default: 1.2
  */
 struct IVFConfig {
 	size_t N_, D_, L_, kc, mc, dc;
     std::string index_path;
     std::string db_path;
+    MetricType metric;
+    size_t spill;
+    float spill_ratio;
     
     explicit IVFConfig(
         size_t N, size_t D, 
@@ -36,7 +53,10 @@ struct IVFConfig {
         size_t kc, 
         size_t mc, 
         size_t dc, 
-        std::string index_path, std::string db_path
+        std::string index_path, std::string db_path,
+        MetricType metric = METRIC_L2,
+        size_t spill = 1,
+        float spill_ratio = 1.2f
     );
 };
 
@@ -45,10 +65,64 @@ public:
     IndexIVF(const IVFConfig& cfg, size_t nq, bool verbose);
 
     void Populate(const std::vector<T>& rawdata);
+    /**
+     * Appends n vectors to the lists they are assigned to, without rebuilding the index
+     * @param vecs: n x D_
+     * @param ids:  n ids returned by the search for these vectors.
+     *              If nullptr, they get the next row numbers, following Populate
+    */
+    void Add(size_t n, const T* vecs, const idx_t* ids = nullptr);
+    /**
+     * Removes the vectors of the n ids. Their entries are only marked dead and skipped
+     * by the search until Compact drops them. Searches may run meanwhile
+     * @return the number of entries removed: with spill, a vector can have several
+    */
+    size_t Remove(size_t n, const idx_t* ids);
+    /**
+     * Drops the dead entries once more than max_dead_fraction of all the entries are
+     * dead (e.g. INVLISTS_MAX_DEAD_FRACTION). The compacted lists are made on the side
+     * while searches go on, and swapped in once the searches under way are done
+    */
+    void Compact(float max_dead_fraction = 0);
     void LoadCqCodebook(std::string cq_codebook_path);
     void Train(const std::vector<T>& rawdata, int seed, size_t nsamples);
+    // Trains the coarse quantizer with mini-batch k-means on a stream of vectors
+    // (e.g. a VecsFileReader), holding only batch_size vectors at a time.
+    // nbatch * batch_size vectors are read at most
+    void Train(const BatchReader<T>& reader, int seed, size_t batch_size, size_t nbatch);
     void LoadIndex(std::string index_path);
     void WriteIndex(std::string index_path);
+    /**
+     * Builds an HNSW graph over the coarse centers (see centroid_graph.hpp). From then on,
+     * the lists to probe are found by walking the graph, approximately, instead of comparing
+     * the query with all the kc centers. It is written with the index, and dropped when
+     * the coarse centers change
+     * @param M: links per center and layer
+    */
+    void BuildCoarseGraph(size_t M = 16, size_t ef_construction = 200);
+    // Centers the graph search keeps, at least nprobe. Larger finds the nearest lists more often
+    void SetCoarseEfSearch(size_t ef) { cq_ef_search_ = ef; }
+
+    /**
+     * The topk nearest entries to query in its nprobe nearest lists. Once ctx has served
+     * a few queries, no heap allocation is made: keep one context per thread
+     * @param query: D_ values
+     * @param nnid, dist: topk entries, nearest first. Past the entries found (fewer distinct
+     *                   ids may be scanned), id -1 and the worst distance: +inf, or -inf for a similarity
+     * @param stop: the tests that end the probing before nprobe lists. By default, none
+     * @param stats: the lists and entries scanned, and why the search stopped. Can be nullptr
+     * @return the number of entries scanned
+    */
+    size_t Search(const T* query, size_t topk, size_t nprobe, idx_t* nnid, float* dist,
+        SearchContext& ctx, const EarlyStop& stop = EarlyStop(), SearchStats* stats = nullptr) const;
+
+    /**
+     * Makes QueryBaseline probe adaptively, with the tests of stop. If stop.max_candidates
+     * is 0, the budget is the L of the query
+    */
+    void SetEarlyStop(const EarlyStop& stop) { early_stop_ = stop; adaptive_ = true; }
+    // How the searches of QueryBaseline ended, by query id (the first nq)
+    const std::vector<SearchStats>& QueryStats() const { return query_stats_; }
 
     // IVF baseline
     void
@@ -65,23 +139,41 @@ public:
     
 private:
     void InsertIvf(const std::vector<T>& rawdata);
-
-    const T* GetSingleCode(size_t list_no, size_t offset) const;
+    // The entries of n vectors: their lists and their ids, ids[i] or first_id + i for
+    // vector i, one per list it spills to. With spill_ > 1, rows[e]: the vector of entry e
+    void AssignEntries(const T* vecs, size_t n, const idx_t* ids, idx_t first_id,
+        std::vector<uint32_t>& assign, std::vector<idx_t>& entry_ids, std::vector<size_t>& rows) const;
+    // The nprobe lists nearest to query into ctx.lists, their distances into ctx.list_dists:
+    // from cq_graph_ if there is one
+    void SearchLists(const T* query, size_t nprobe, SearchContext& ctx) const;
+
+    const T* GetSingleCode(const typename InvertedLists<T>::ListRef& list, size_t offset) const;
     // Given a long (N * M) codes, pick up n-th code
     // template<typename T>
     const std::vector<T> NthRawVector(const std::vector<T>& long_code, size_t n) const;
     // Member variables
     size_t N_, D_, L_, nq, kc, mc, dc;
+    size_t nlist_;      // kc, or the kc^2 cells of the multi-index
+    MetricType metric_;
+    size_t spill_;
+    float spill_ratio_;
+    idx_t next_id_;     // id of the next vector added without one
     bool verbose_, write_trainset_, is_trained_;
 
+    // The centers are read in place from the quantizer (Quantizer::centroid)
     std::unique_ptr<Quantizer::Quantizer<T>> cq_;
+    // HNSW graph over the centers of cq_, if built, and the ef of its search
+    std::unique_ptr<CentroidGraph> cq_graph_;
+    size_t cq_ef_search_;
 
-    std::vector<std::vector<float>> centers_cq_;
     std::vector<int> labels_cq_;
 
+    bool adaptive_;
+    EarlyStop early_stop_;
+    std::vector<SearchStats> query_stats_;
 
-    std::vector<std::vector<T>> db_codes_; // binary codes, size nlist
-    std::vector<std::vector<int>> posting_lists_;  // (NumList, any)
+    InvertedLists<T> invlists_;    // raw vectors and ids of the nlist_ lists
+    std::unique_ptr<ListsGuard> guard_ = std::make_unique<ListsGuard>();   // see ListsGuard
 };
 
 
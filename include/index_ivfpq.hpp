@@ -7,18 +7,42 @@
 #include <cassert>
 #include <unordered_set>
 #include <fstream>
+#include <memory>
 
 #include "util.hpp"
 #include "quantizer.hpp"
 #include "kmeans.hpp"
 #include "binary_io.hpp"
 #include "distance.hpp"
+#include "inverted_lists.hpp"
+#include "search_context.hpp"
+#include "early_stop.hpp"
+#include "centroid_graph.hpp"
 
 #include <omp.h>
 
 
 namespace toy {
 
+// Layout of the 8-bit PQ codes in the lists
+enum CodeLayout {
+    // Code after code; ADist reads one code at a time
+    CODE_LAYOUT_ROW_MAJOR = 0,
+    // Stored by blocks of PQ8_BLOCK_SIZE codes instead, transposed (see pq8_accumulate),
+    // scanned 16 codes at a time with gathers
+    CODE_LAYOUT_BLOCK_16 = 1,
+};
+
+// Type of the distance tables the 8-bit PQ codes are scanned with
+enum TableType {
+    TABLE_FLOAT = 0,
+    // Tables quantized to uint8 / uint16 and summed in integers, over the codes stored
+    // by blocks as with CODE_LAYOUT_BLOCK_16. The best candidates are then rescored with
+    // the float tables
+    TABLE_UINT8 = 1,
+    TABLE_UINT16 = 2,
+};
+
 /**
  * Configuration structure
  * @param N_ the number of data
@@ -26,16 +50,38 @@ namespace toy {
  * @param W_ the number of bucket involed when searching is performed
  * @param L_ the expected number of candidates involed when searching is performed
  * @param kc, kp the number of coarse quantizer (nlist) and product quantizer's centers (1 << nbits). Default: 100, 256
- * @param mc, mp the number of subspace for coarse quantizer and product quantizer. mc must be 1
- * @param dc, dp the dimensions of subspace for coarse quantize and product quantizer. dc must be D_.  dp = D_ / mp
+ *        kp = 16 stores 4-bit codes, two per byte, and scans them with the fast-scan kernels
+ *        (pq4_accumulate) on uint8 tables, then rescores the best candidates with float tables
+ * @param mc, mp the number of subspace for coarse quantizer and product quantizer. mc is 1, or 2 for an
+ *        inverted multi-index, whose kc^2 lists are the cells of the centers of the two halves of the
+ *        vectors, kc each (mc = 2 cannot be used with BuildCoarseGraph, and needs mp % 2 == 0 by residual)
+ * @param dc, dp the dimensions of subspace for coarse quantize and product quantizer. dc = D_ / mc.  dp = D_ / mp
  * @param db_path path to the DB files
  * @param db_prefix the prefix of DB files
+ * @param metric METRIC_L2 (default), METRIC_INNER_PRODUCT or METRIC_COSINE (float data only).
+ *        With a similarity metric, results hold similarities ordered from the largest
+ * @param layout CODE_LAYOUT_ROW_MAJOR (default) or CODE_LAYOUT_BLOCK_16. Ignored for kp = 16,
+ *        and CODE_LAYOUT_BLOCK_16 with a quantized table
+ * @param table TABLE_FLOAT (default), TABLE_UINT8 or TABLE_UINT16. Ignored for kp = 16
+ * @param by_residual encode the vectors relative to their coarse centroid (float data only).
+ *        Indexes written with it have to be loaded with it
+ * @param spill the number of lists a vector is stored in, at most. Default: 1. With more, a vector
+ *        near the border of its list is also stored in the next nearest ones, so that fewer lists
+ *        are probed for the same recall, for more memory. Search returns every id once
+ * @param spill_ratio a vector spills to a list whose distance is within spill_ratio of the nearest
+ *        one (see Quantizer::spill_cells). Default: 1.2
  */
 class IVFPQConfig {
 public:
 	size_t N_, D_, L_, kc, kp, mc, mp, dc, dp;
     std::string index_path;
     std::string db_path;
+    MetricType metric;
+    CodeLayout layout;
+    TableType table;
+    bool by_residual;
+    size_t spill;
+    float spill_ratio;
 
     explicit IVFPQConfig(
         size_t N, size_t D, 
@@ -43,29 +89,41 @@ public:
         size_t kc, size_t kp, 
         size_t mc, size_t mp, 
         size_t dc, size_t dp,
-        std::string index_path, std::string db_path
+        std::string index_path, std::string db_path,
+        MetricType metric = METRIC_L2,
+        CodeLayout layout = CODE_LAYOUT_ROW_MAJOR,
+        TableType table = TABLE_FLOAT,
+        bool by_residual = false,
+        size_t spill = 1,
+        float spill_ratio = 1.2f
     );
 };
 
-struct DistanceTable {
-    // Helper structure. This is identical to vec<vec<float>> dt(M, vec<float>(Ks))
-    DistanceTable() {}
-    DistanceTable(size_t M, size_t Ks) : kp(Ks), data_(M * Ks) {}
-    void set_value(size_t m, size_t ks, float val) {
-        data_[m * kp + ks] = val;
-    }
-    float get_value(size_t m, size_t ks) const {
-        return data_[m * kp + ks];
-    }
-    size_t kp;
-    std::vector<float> data_;
-};
-
 template <typename T> class IndexIVFPQ {
 public:
     IndexIVFPQ(const IVFPQConfig& cfg, size_t nq, bool verbose);
 
     void Populate(const std::vector<T>& rawdata);
+    /**
+     * Encodes n vectors and appends them to the lists they are assigned to,
+     * without rebuilding the index
+     * @param vecs: n x D_
+     * @param ids:  n ids returned by the search for these vectors.
+     *              If nullptr, they get the next row numbers, following Populate
+    */
+    void Add(size_t n, const T* vecs, const idx_t* ids = nullptr);
+    /**
+     * Removes the vectors of the n ids. Their entries are only marked dead and skipped
+     * by the search until Compact drops them. Searches may run meanwhile
+     * @return the number of entries removed: with spill, a vector can have several
+    */
+    size_t Remove(size_t n, const idx_t* ids);
+    /**
+     * Drops the dead entries once more than max_dead_fraction of all the entries are
+     * dead (e.g. INVLISTS_MAX_DEAD_FRACTION). The compacted lists are made on the side
+     * while searches go on, and swapped in once the searches under way are done
+    */
+    void Compact(float max_dead_fraction = 0);
     void LoadFromBook(const std::vector<uint32_t>& book, std::string cluster_path);
     void LoadPqCodebook(std::string pq_codebook_path);
     void LoadCqCodebook(std::string cq_codebook_path);
@@ -73,6 +131,16 @@ public:
     void LoadIndex(std::string index_path);
     void WriteIndex(std::string index_path);
     void Finalize();
+    /**
+     * Builds an HNSW graph over the coarse centers (see centroid_graph.hpp). From then on,
+     * the lists to probe are found by walking the graph, approximately, instead of comparing
+     * the query with all the kc centers. It is written with the index, and dropped when
+     * the coarse centers change
+     * @param M: links per center and layer
+    */
+    void BuildCoarseGraph(size_t M = 16, size_t ef_construction = 200);
+    // Centers the graph search keeps, at least nprobe. Larger finds the nearest lists more often
+    void SetCoarseEfSearch(size_t ef) { cq_ef_search_ = ef; }
 
     
     void
@@ -88,11 +156,50 @@ public:
         int k, 
         const std::vector<std::vector<T>>& queries, 
         const std::vector<std::vector<uint32_t>>& topw,
-        std::vector<std::vector<uint32_t>>& topk_id,
+        std::vector<std::vector<idx_t>>& topk_id,
+        std::vector<std::vector<float>>& topk_dist,
+        int num_threads
+    );
+
+    /**
+     * Same results as TopKId, for large batches: the queries are grouped by the lists they
+     * probe, and every list is scanned once for all its queries while it is in cache,
+     * instead of once per query from memory. The per-query top k are merged at the end.
+     * The tables of a query, quantized ones included, are made once, and by residual the
+     * terms of a list once for all its queries
+    */
+    void
+    TopKIdListMajor(
+        int k,
+        const std::vector<std::vector<T>>& queries,
+        const std::vector<std::vector<uint32_t>>& topw,
+        std::vector<std::vector<idx_t>>& topk_id,
         std::vector<std::vector<float>>& topk_dist,
         int num_threads
     );
 
+    /**
+     * The topk nearest entries to query in its nprobe nearest lists. Once ctx has served
+     * a few queries, no heap allocation is made: keep one context per thread
+     * @param query: D_ values
+     * @param nnid, dist: topk entries, nearest first. Past the entries found (fewer distinct
+     *                   ids may be scanned), id -1 and the worst distance: +inf, or -inf for a similarity
+     * @param stop: the tests that end the probing before nprobe lists. By default, none
+     * @param stats: the lists and entries scanned, and why the search stopped. Can be nullptr
+     * @return the number of entries scanned
+    */
+    size_t Search(const T* query, size_t topk, size_t nprobe, idx_t* nnid, float* dist,
+        SearchContext& ctx, const EarlyStop& stop = EarlyStop(), SearchStats* stats = nullptr) const;
+
+    /**
+     * Makes QueryBaseline and TopKId probe adaptively, with the tests of stop: TopKId may
+     * scan only the first lists of topw[n]. If stop.max_candidates is 0, the budget of
+     * QueryBaseline is the L of the query. TopKIdListMajor still scans all the lists
+    */
+    void SetEarlyStop(const EarlyStop& stop) { early_stop_ = stop; adaptive_ = true; }
+    // How the searches of QueryBaseline, or of the last TopKId, ended, by query id
+    const std::vector<SearchStats>& QueryStats() const { return query_stats_; }
+
     // IVFPQ baseline
     void QueryBaseline(
         const std::vector<T>& query,
@@ -131,31 +238,130 @@ private:
     void WriteClusterId();
 
     void InsertIvf(const std::vector<T>& rawdata);
-    DistanceTable DTable(const std::vector<T>& vec) const;
+    // The entries of n vectors: their lists and their ids, ids[i] or first_id + i for
+    // vector i, one per list it spills to. With spill_ > 1, rows[e]: the vector of entry e
+    void AssignEntries(const T* vecs, size_t n, const idx_t* ids, idx_t first_id,
+        std::vector<uint32_t>& assign, std::vector<idx_t>& entry_ids, std::vector<size_t>& rows) const;
+    // The nprobe lists nearest to query into ctx.lists, their distances into ctx.list_dists:
+    // from cq_graph_ if there is one
+    void SearchLists(const T* query, size_t nprobe, SearchContext& ctx) const;
+    void DTable(const T* vec, DistanceTable& dtable) const;
+    // Tables of the n vectors of vecs (n x D_), made together from the PQ codebooks
+    std::vector<DistanceTable> DTables(const T* vecs, size_t n) const;
     float ADist(const DistanceTable& dtable, const std::vector<uint8_t>& code) const;
-    float ADist(const DistanceTable& dtable, size_t list_no, size_t offset) const;
+    using ListRef = InvertedLists<uint8_t>::ListRef;
+    // The offset-th entry of list
+    float ADist(const DistanceTable& dtable, const ListRef& list, size_t offset) const;
+
+    // PQ codes of n vectors assigned to the lists assign, code_size_ bytes each
+    std::vector<uint8_t> EncodePq(const T* vecs, const uint32_t* assign, size_t n) const;
+    // PQ codes of the spilled entries of AssignEntries: entry e is row rows[e] of vecs in list assign[e]
+    std::vector<uint8_t> EncodeEntries(const T* vecs, size_t n, const uint32_t* assign,
+        const std::vector<size_t>& rows) const;
+    // vecs minus the centroids of their lists
+    std::vector<T> Residuals(const T* vecs, const uint32_t* assign, size_t n) const;
+    // precomputed_ from the codebooks, with residuals and METRIC_L2
+    void PrecomputeTable();
+    // Distance of query to the center of list_no (fvec_distance), by coarse sub-space
+    float CoarseDistance(const T* query, size_t list_no) const;
+    /**
+     * Table of the codes of list_no, from the query table dtable, and the coarse distance
+     * to add to it. Without residuals, dtable itself and 0. With residuals and METRIC_L2,
+     * dtable plus the terms of the list, in list_table
+    */
+    const DistanceTable& ListTable(const T* query, const DistanceTable& dtable, size_t list_no,
+        DistanceTable& list_table, float& coarse) const;
+    // Quantized copy of dtable, mp x kp: distance ~= bias + delta * sum of the entries,
+    // within mp / 2 steps delta
+    template <typename Q>
+    void QuantizeTable(const DistanceTable& dtable, Q* table, float& bias, float& delta) const;
+    // uint8 tables of dtable, mp_fs_ x 16, for the fast scan
+    void FastScanLut(const DistanceTable& dtable, uint8_t* lut, float& bias, float& delta) const;
+    // Quantized tables of n queries, made once for TopKIdListMajor. Table i starts at
+    // i * stride in lut (fast scan, TABLE_UINT8) or table16 (TABLE_UINT16)
+    struct QuantizedTables {
+        AlignedVector<uint8_t> lut;
+        std::vector<uint16_t> table16;
+        size_t stride = 0;
+        std::vector<float> bias, delta;
+    };
+    // None with float tables
+    QuantizedTables QuantizeTables(const std::vector<DistanceTable>& dtables) const;
+    // The terms of list_no by residual with METRIC_L2, which ListTable adds to a query table
+    void ListTerms(size_t list_no, DistanceTable& terms) const;
+    // acc[idx]: table sum of the idx-th entry of list, for at least its size entries
+    void FastScanList(const ListRef& list, const uint8_t* lut, std::vector<uint16_t>& acc) const;
+    // CODE_LAYOUT_BLOCK_16. dis[idx]: distance of the idx-th entry of list
+    void BlockScanList(const ListRef& list, const DistanceTable& dtable, std::vector<float>& dis) const;
+    // Quantized 8-bit tables, padded for pq8_accumulate. acc[idx]: table sum of the
+    // idx-th entry of list, for at least its size entries
+    template <typename Q>
+    void QuantizedScanList(const ListRef& list, const Q* table, std::vector<uint32_t>& acc) const;
+    /**
+     * Scans the n lists for the nearest entries to query, pushed into topk
+     * (along with those it already holds), with the buffers of ctx
+     * @param dtable: the table of query (DTable)
+     * @param monitor, list_dists: if set, asked before every list whether to stop, with
+     *        the coarse distances of the lists
+     * @return the number of entries scanned
+    */
+    size_t ScanLists(const T* query, const DistanceTable& dtable, const uint32_t* lists,
+        size_t n, TopK& topk, SearchContext& ctx, ProbeMonitor* monitor = nullptr,
+        const float* list_dists = nullptr) const;
+    /**
+     * Scans list_no, looked up once, for n queries of TopKIdListMajor: query q of the
+     * (list_no, q) pairs into heaps[q]. The results of ScanLists for each query
+     * @param batch, dtables, qtables: the queries and their tables
+     * @return the number of entries scanned, over the n queries
+    */
+    size_t ScanListQueries(size_t list_no, const std::pair<uint32_t, uint32_t>* pairs, size_t n,
+        const T* batch, const std::vector<DistanceTable>& dtables, const QuantizedTables& qtables,
+        std::vector<TopK>& heaps, SearchContext& ctx) const;
 
     // Given a long (N * M) codes, pick up n-th code
     const T* NthRawVector(const T* long_code_ptr, size_t n) const;
 
     // Member variables
     size_t N_, D_, L_, nq, kc, kp, mc, mp, dc, dp;
+    size_t nlist_;      // kc, or the kc^2 cells of the multi-index
+    MetricType metric_;
+    bool by_residual_;
+    size_t spill_;
+    float spill_ratio_;
+    idx_t next_id_;     // id of the next vector added without one
     bool verbose_, is_trained_;
 
     std::string write_trainset_path_, write_cluster_vector_path_, write_cluster_id_path_;
     int write_trainset_type_;
 
+    // The centers are read in place from the quantizers (Quantizer::centroid)
     std::unique_ptr<Quantizer::Quantizer<T>> cq_, pq_;
+    // HNSW graph over the centers of cq_, if built, and the ef of its search
+    std::unique_ptr<CentroidGraph> cq_graph_;
+    size_t cq_ef_search_;
 
-    std::vector<std::vector<float>> centers_cq_;
     std::vector<int> labels_cq_;
-
-    std::vector<std::vector<std::vector<float>>> centers_pq_;
     std::vector<std::vector<int>> labels_pq_;
 
-
-    std::vector<std::vector<uint8_t>> db_codes_; // binary codes, size nlist
-    std::vector<std::vector<uint32_t>> posting_lists_;  // (NumList, any)
+    bool adaptive_;
+    EarlyStop early_stop_;
+    std::vector<SearchStats> query_stats_;
+
+
+    InvertedLists<uint8_t> invlists_;  // PQ codes and ids of the nlist_ lists
+    std::unique_ptr<ListsGuard> guard_ = std::make_unique<ListsGuard>();   // see ListsGuard
+
+    bool fast_scan_;        // kp == 16
+    bool block16_;          // CODE_LAYOUT_BLOCK_16, 8-bit codes
+    TableType table_;       // TABLE_FLOAT for 4-bit codes, which have their own tables
+    size_t code_size_;      // bytes of a code in invlists_: mp, or (mp + 1) / 2 for 4-bit codes
+    size_t mp_fs_;          // mp rounded up to PQ4_M_ALIGN
+    // The codes of the lists by blocks of PQ4_BLOCK_SIZE for the fast scan, of
+    // PQ8_BLOCK_SIZE for CODE_LAYOUT_BLOCK_16, otherwise row-major
+    ListLayout list_layout_;
+    // By residual, METRIC_L2: ||r||^2 + 2 <c, r> of every coarse center c and code r, by coarse
+    // sub-space: mc x kc x (mp / mc) x kp. The terms of a list are those of its centers
+    std::vector<float> precomputed_;
 };
 
 
@@ -0,0 +1,198 @@
+#ifndef INCLUDE_INVERTED_LISTS_HPP
+#define INCLUDE_INVERTED_LISTS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include "util.hpp"
+#include "distance.hpp"
+
+namespace toy {
+
+// Id of an indexed vector: the row number given by Populate, or a user id given to Add
+using idx_t = int64_t;
+
+// The lists are worth compacting once this fraction of their entries is dead
+constexpr float INVLISTS_MAX_DEAD_FRACTION = 0.2f;
+// Add sorts the new entries by list in chunks of this many, one task each
+constexpr size_t INVLISTS_ADD_CHUNK = 1 << 16;
+
+// How the codes of a list lie in the arena
+enum ListLayout {
+    // Code after code
+    LIST_LAYOUT_ROW_MAJOR = 0,
+    // 8-bit PQ codes by blocks of PQ8_BLOCK_SIZE, transposed (see pq8_accumulate)
+    LIST_LAYOUT_PQ8_BLOCKS = 1,
+    // 4-bit PQ codes by blocks of PQ4_BLOCK_SIZE, interleaved (see pq4_accumulate)
+    LIST_LAYOUT_PQ4_BLOCKS = 2,
+};
+
+/**
+ * Inverted lists in CSR form: the codes of all the lists in one arena, list after list,
+ * their ids in a second arena, and a record for every list given room: its id, its first
+ * slot and its size. Record r owns the slots offsets[r] .. offsets[r + 1] - 1 and holds
+ * entries in the first sizes[r] of them, so scanning a list is a linear walk over both
+ * arenas. The records are sorted by list id and the other lists are empty, so that the
+ * bookkeeping follows the lists in use and not nlist, which may be the 2^28 cells of a
+ * multi-index. A list is looked up once (list), then its entries are read through the
+ * ListRef.
+ * Build lays the lists out without gaps. Add appends in place while every list has room;
+ * otherwise the arena is laid out again, once, with some room left after every list.
+ * Remove only sets the tombstone bit of a slot and scans skip these entries, so it
+ * runs alongside them. Compacted later lays out a copy without them, on the side.
+ * Everything is a flat array, so the layout can be written to disk and mapped back as is.
+ * With a blocked layout, the codes are stored only in the blocks the scan kernels read:
+ * the room of every list is a whole number of blocks, so a list starts on a block and
+ * its blocks are scanned in place. The codes go in and out (Add, Build, read_code) code
+ * after code, as with the row-major layout.
+ * @param C: element type of a code. An entry has code_size of them
+ *           (mp uint8_t for a PQ code, D values for a raw vector)
+*/
+/**
+ * Lets an index compact its lists while it serves searches. Searches hold `lists`
+ * shared; Remove and Compact hold `update`, so that no entry is marked while the
+ * compacted copy is made, and Compact holds `lists` exclusively only to swap the
+ * copy in. An index keeps it by pointer, to stay movable
+*/
+struct ListsGuard {
+    std::shared_mutex lists;
+    std::mutex update;
+};
+
+template <typename C>
+class InvertedLists {
+public:
+    InvertedLists() = default;
+    /**
+     * @param layout: a blocked one for uint8_t PQ codes only
+     * @param M:      sub-spaces of the PQ codes of a blocked layout. code_size is then
+     *                M, or (M + 1) / 2 for 4-bit codes two per byte, low nibble first
+    */
+    InvertedLists(size_t nlist, size_t code_size, ListLayout layout = LIST_LAYOUT_ROW_MAJOR, size_t M = 0);
+
+    /**
+     * Appends n entries. Two passes over them, by chunks of INVLISTS_ADD_CHUNK: every
+     * chunk sorts its entries by list and counts them in the lists it touches, a prefix
+     * sum gives every (list, chunk) pair its slots after the current end of the list,
+     * then every chunk copies its entries there. No lock is taken, and within a list the
+     * new entries keep their order, whatever the number of threads.
+     * @param assign:   n list ids
+     * @param codes:    n x code_size
+     * @param ids:      n ids, given by the index
+    */
+    void Add(const uint32_t* assign, size_t n, const C* codes, const idx_t* ids);
+    // Replaces the content with n entries, without room left. See Add
+    void Build(const uint32_t* assign, size_t n, const C* codes, const idx_t* ids);
+    /**
+     * Marks the entries of the n ids as dead. They are still scanned over, until the
+     * lists are compacted. Scans may run meanwhile: they see an entry either live or dead
+     * @return the number of entries marked
+    */
+    size_t Remove(const idx_t* ids, size_t n);
+    /**
+     * Copy of the lists without their dead entries, the live ones in the same order,
+     * laid out with some room after every list. The records of the lists left empty
+     * are dropped. This is only read, so scans may run meanwhile, but Remove may not:
+     * its marks would miss the copy
+    */
+    InvertedLists Compacted() const;
+
+    // A list as looked up by list(): its slots, dead entries included. Empty for a list
+    // without a record
+    struct ListRef {
+        size_t first = 0;       // first slot
+        size_t size = 0;
+        size_t ndead = 0;
+    };
+
+    size_t nlist() const { return nlist_; }
+    size_t code_size() const { return code_size_; }
+    ListLayout layout() const { return layout_; }
+    // Entries of a block, 1 for LIST_LAYOUT_ROW_MAJOR, and its elements
+    size_t block_size() const { return block_size_; }
+    size_t block_code_size() const { return block_code_size_; }
+    // The number of live entries of all the lists
+    size_t size() const { return nstored_ - ndead(); }
+    // The number of dead entries not compacted yet. Remove counts them atomically
+    size_t ndead() const {
+        return std::atomic_ref<size_t>(const_cast<size_t&>(ndead_)).load(std::memory_order_relaxed);
+    }
+    // The lists with a record, in increasing order. The other lists are empty
+    const std::vector<uint32_t>& lists() const { return lists_; }
+    // Binary search among the records
+    ListRef list(size_t list_no) const {
+        auto it = std::lower_bound(lists_.begin(), lists_.end(), list_no);
+        if (it == lists_.end() || *it != list_no) return {};
+        size_t r = it - lists_.begin();
+        return {offsets_[r], sizes_[r], ndead_at(r)};
+    }
+    // Slots of the list to scan, dead entries included
+    size_t list_size(size_t list_no) const { return list(list_no).size; }
+    size_t list_ndead(size_t list_no) const { return list(list_no).ndead; }
+    // Lists share the words of the bitmap, which Remove sets atomically: read them so too
+    bool is_dead(const ListRef& list, size_t offset) const {
+        size_t slot = list.first + offset;
+        uint64_t word = std::atomic_ref<uint64_t>(const_cast<uint64_t&>(dead_[slot >> 6])).load(std::memory_order_relaxed);
+        return (word >> (slot & 63)) & 1;
+    }
+    const idx_t* ids(const ListRef& list) const { return ids_.data() + list.first; }
+    // The first block of the list, followed by its other ones
+    const C* codes(const ListRef& list) const { return block_at(list.first); }
+    // The block of the offset-th entry of the list, which is its entry offset % block_size()
+    const C* block(const ListRef& list, size_t offset) const { return block_at(list.first + offset); }
+    // LIST_LAYOUT_ROW_MAJOR only
+    const C* code(const ListRef& list, size_t offset) const { return codes(list) + offset * code_size_; }
+    // Copies the code of the offset-th entry of the list, code_size elements, whatever the layout
+    void read_code(const ListRef& list, size_t offset, C* code) const;
+
+private:
+    // (list, count) pairs, by increasing list
+    using Counts = std::vector<std::pair<uint32_t, size_t>>;
+    // Record of list_no, or the number of records if it has none
+    size_t Find(size_t list_no) const {
+        return std::lower_bound(lists_.begin(), lists_.end(), list_no) - lists_.begin();
+    }
+    // Dead entries of record r, which Remove may be counting meanwhile
+    size_t ndead_at(size_t r) const {
+        return std::atomic_ref<size_t>(const_cast<size_t&>(dead_counts_[r])).load(std::memory_order_relaxed);
+    }
+    // Makes room for count more entries in every list of counts
+    void Reserve(const Counts& counts);
+    // Copy in a new arena with room for the live entries and count more in every list of
+    // counts, plus a quarter of that if slack. The dead entries, and the records of the
+    // lists left without any, are dropped on the way
+    InvertedLists Relaid(const Counts& counts, bool slack) const;
+    // Slots of n entries, rounded up to whole blocks
+    size_t Room(size_t n) const { return (n + block_size_ - 1) / block_size_ * block_size_; }
+    const C* block_at(size_t slot) const { return codes_.data() + slot / block_size_ * block_code_size_; }
+    C* block_at(size_t slot) { return codes_.data() + slot / block_size_ * block_code_size_; }
+    // code (code_size elements) into slot slot of the arena
+    void WriteCode(size_t slot, const C* code);
+    // The code of slot src of the arena `from` into slot dst of this one
+    void CopyCode(const AlignedVector<C>& from, size_t src, size_t dst);
+
+    size_t nlist_ = 0;
+    size_t code_size_ = 0;
+    ListLayout layout_ = LIST_LAYOUT_ROW_MAJOR;
+    size_t M_ = 0;
+    size_t block_size_ = 1;
+    size_t block_code_size_ = 0;
+    size_t nstored_ = 0;            // entries in the lists, dead ones included
+    size_t ndead_ = 0;
+    std::vector<uint32_t> lists_;   // list of every record, increasing
+    std::vector<size_t> offsets_;   // records + 1, first slot of every record
+    std::vector<size_t> sizes_;     // records
+    std::vector<size_t> dead_counts_;   // records
+    std::vector<idx_t> ids_;        // offsets.back()
+    AlignedVector<C> codes_;        // offsets.back() / block_size blocks of block_code_size
+    std::vector<uint64_t> dead_;    // tombstones, one bit per slot
+};
+
+} // namespace toy
+
+#endif
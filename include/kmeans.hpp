@@ -8,29 +8,34 @@
 #include <random>
 #include <numeric>
 #include <cassert>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <omp.h>
 
 #include "distance.hpp"
+#include "centroid_search.hpp"
 
 // Linear search by L2 Distance computation. Return the best one (id, distance)
+// With a similarity metric, the distance is the negated inner product (see fvec_distance)
+// This is the one-vector reference; batches go through NearestCenters (centroid_search.hpp),
+// which is blocked and parallel over the vectors.
+// centers: k x d, contiguous
 template<typename T>
 std::pair<uint32_t, float> 
-NearestCenter(const T* query, const std::vector<std::vector<float>>& centers)
+NearestCenter(const T* query, const float* centers, size_t k, size_t d, MetricType metric = METRIC_L2)
 {
-    std::vector<float> dists(centers.size());
-    size_t K_ = centers.size(), Ds_ = centers[0].size();
-
-    /**
-     * @bug NO OMP here!
-    */
-    // #pragma omp parallel for
-    for (size_t i = 0; i < K_; ++i) {
-        dists[i] = fvec_L2sqr(query, centers[i].data(), Ds_);
+    std::vector<float> dists(k);
+
+    for (size_t i = 0; i < k; ++i) {
+        dists[i] = fvec_distance(metric, query, centers + i * d, d);
     }
 
     // Just pick up the closest one
     float min_dist = std::numeric_limits<float>::max();
     uint32_t min_i = -1;
-    for (uint32_t i = 0; i < K_; ++i) {
+    for (uint32_t i = 0; i < k; ++i) {
         if (dists[i] < min_dist) {
             min_i = i;
             min_dist = dists[i];
@@ -41,62 +46,380 @@ NearestCenter(const T* query, const std::vector<std::vector<float>>& centers)
     return std::pair<uint32_t, float>(min_i, min_dist);
 }
 
-// kmeans Lloyd implementation
+// Sum and count of the observations labeled with each centroid.
+// One pass over the observations: every thread sums its share into its own k x D buffer,
+// then the buffers are merged per centroid. O(N * D + threads * k * D) instead of
+// scanning all the labels for each centroid. The team may get fewer threads than
+// requested (e.g. in a nested region): the buffers of the threads that did not run stay empty.
+// sums: k x D, sizes: k. Both are overwritten
+template<typename T>
+void SumClusters(const T* obs, size_t N, size_t D, const uint32_t* labels, int k, double* sums, size_t* sizes)
+{
+    int nt = omp_get_max_threads();
+    std::vector<std::vector<double>> thread_sums(nt);
+    std::vector<std::vector<size_t>> thread_counts(nt);
+
+    #pragma omp parallel num_threads(nt)
+    {
+        int rank = omp_get_thread_num();
+        std::vector<double>& sum = thread_sums[rank];
+        std::vector<size_t>& count = thread_counts[rank];
+        sum.assign(k * D, 0.0);
+        count.assign(k, 0);
+
+        #pragma omp for
+        for (size_t i = 0; i < N; ++i) {
+            double* s = sum.data() + labels[i] * D;
+            const T* x = obs + i * D;
+            for (size_t j = 0; j < D; ++j) {
+                s[j] += x[j];
+            }
+            ++count[labels[i]];
+        }
+    }
+
+    #pragma omp parallel for
+    for (int c = 0; c < k; ++c) {
+        size_t count = 0;
+        for (int t = 0; t < nt; ++t) {
+            if (!thread_counts[t].empty()) count += thread_counts[t][c];
+        }
+        sizes[c] = count;
+        for (size_t j = 0; j < D; ++j) {
+            double s = 0.0;
+            for (int t = 0; t < nt; ++t) {
+                if (!thread_sums[t].empty()) s += thread_sums[t][c * D + j];
+            }
+            sums[c * D + j] = s;
+        }
+    }
+}
+
+// Lloyd update: each centroid becomes the mean of the observations labeled with it.
+// A centroid without observations is kept. Returns the size of each cluster.
 template<typename T>
-std::tuple<std::vector<std::vector<float>>, std::vector<int>> 
-KMeans(const std::vector<std::vector<T>>& obs, int k, int iter, const std::string& minit)
+std::vector<size_t> UpdateCentroids(const T* obs, size_t N, size_t D, const uint32_t* labels, int k, float* centroids)
 {
-    int N = obs.size();
-    int D = obs[0].size();
+    std::vector<double> sums(k * D);
+    std::vector<size_t> sizes(k);
+    SumClusters(obs, N, D, labels, k, sums.data(), sizes.data());
 
-    // Initialize centroids based on minit
-    std::vector<std::vector<float>> centroids(k, std::vector<float>(D, 0.0));
-    if (minit == "points") {
-        std::default_random_engine rd;
+    #pragma omp parallel for
+    for (int c = 0; c < k; ++c) {
+        if (sizes[c] == 0) continue;
+        for (size_t j = 0; j < D; ++j) {
+            centroids[c * D + j] = sums[c * D + j] / sizes[c];
+        }
+    }
+    return sizes;
+}
+
+// Gives each empty cluster half of a populated one, as Faiss does: the empty centroid takes
+// a copy of a centroid picked with probability proportional to its cluster size, and the
+// two copies are pushed slightly apart, so the next assignment splits that cluster.
+// Without it an empty centroid stays where it is and its share of the data piles up
+// in the neighboring lists.
+inline void SplitEmptyClusters(size_t N, size_t D, int k, std::vector<size_t>& sizes,
+    float* centroids, std::default_random_engine& rd)
+{
+    constexpr float EPS = 1.0f / 1024;
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    for (int ci = 0; ci < k; ++ci) {
+        if (sizes[ci] != 0) continue;
+        // Pick the cluster to split, with probability (size - 1) / (N - k)
+        int cj = 0;
+        while (true) {
+            double p = (sizes[cj] - 1.0) / (N - k);
+            if (uniform(rd) < p) break;
+            cj = (cj + 1) % k;
+        }
+        float* xi = centroids + ci * D;
+        float* xj = centroids + cj * D;
+        for (size_t j = 0; j < D; ++j) {
+            float v = xj[j];
+            xi[j] = v * (j % 2 == 0 ? 1 + EPS : 1 - EPS);
+            xj[j] = v * (j % 2 == 0 ? 1 - EPS : 1 + EPS);
+        }
+        sizes[ci] = sizes[cj] / 2;
+        sizes[cj] -= sizes[ci];
+    }
+}
+
+// k-means++ seeding: each new centroid is an observation drawn with probability
+// proportional to its squared distance to the closest centroid so far.
+// Drawing one centroid at a time costs k passes over the data, so the centroids are
+// drawn in at most KMEANSPP_ROUNDS rounds of equal batches, as in k-means||: a batch is
+// sampled without replacement from the same distribution (Efraimidis-Spirakis keys),
+// and the distances are then refreshed against the whole batch with the blocked search.
+// Seeding costs about one Lloyd iteration; for k <= KMEANSPP_ROUNDS it is exact k-means++.
+constexpr int KMEANSPP_ROUNDS = 32;
+
+template<typename T>
+void KMeansPlusPlus(const T* obs, size_t N, size_t D, int k, float* centroids, std::default_random_engine& rd)
+{
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    auto copy_obs = [&](size_t c, size_t i) {
+        std::copy(obs + i * D, obs + (i + 1) * D, centroids + c * D);
+    };
+
+    copy_obs(0, std::uniform_int_distribution<size_t>(0, N - 1)(rd));
+    const size_t batch = (k + KMEANSPP_ROUNDS - 1) / KMEANSPP_ROUNDS;
+
+    std::vector<float> min_dist(N, std::numeric_limits<float>::max());
+    std::vector<float> dist(N);
+    std::vector<uint32_t> labels(N);
+    std::vector<std::pair<double, size_t>> keys(N);
+    size_t done = 0, nc = 1;
+    while (nc < (size_t)k) {
+        // Distances to the centroids added by the last round
+        NearestCenters(obs, N, D, CenterPanels(centroids + done * D, nc - done, D), labels.data(), dist.data());
+        #pragma omp parallel for
+        for (size_t i = 0; i < N; ++i) {
+            min_dist[i] = std::min(min_dist[i], dist[i]);
+        }
+
+        // The b largest log(u) / w; observations already taken (w = 0) come last
+        size_t b = std::min(batch, k - nc);
+        for (size_t i = 0; i < N; ++i) {
+            double u = uniform(rd);
+            keys[i] = {min_dist[i] > 0 ? std::log(u) / min_dist[i] : -std::numeric_limits<double>::infinity(), i};
+        }
+        std::nth_element(keys.begin(), keys.begin() + b, keys.end(), std::greater<>());
+        std::sort(keys.begin(), keys.begin() + b, std::greater<>());
+        for (size_t j = 0; j < b; ++j) {
+            copy_obs(nc + j, keys[j].second);
+        }
+        done = nc;
+        nc += b;
+    }
+}
+
+// Initial centroids, picked from the N observations
+// minit: "points" seeds with k random observations, "++" with k-means++ (KMeansPlusPlus)
+template<typename T>
+void InitCentroids(const T* obs, size_t N, size_t D, int k, const std::string& minit,
+    float* centroids, std::default_random_engine& rd)
+{
+    if (minit == "++") {
+        KMeansPlusPlus(obs, N, D, k, centroids, rd);
+    } else if (minit == "points") {
         // std::mt19937 gen(rd());
-        std::uniform_int_distribution<int> dist(0, N - 1);
+        std::uniform_int_distribution<size_t> dist(0, N - 1);
 
-        std::vector<int> initial_indices(k);
+        std::vector<size_t> initial_indices(k);
         for (int i = 0; i < k; ++i) {
-            int idx = dist(rd);
+            size_t idx = dist(rd);
             initial_indices[i] = idx;
             // centroids[i] = static_cast<float>(obs[idx]);
             for (size_t j = 0; j < D; ++j) {
-                centroids[i][j] = static_cast<float>(obs[idx][j]);
+                centroids[i * D + j] = static_cast<float>(obs[idx * D + j]);
             }
         }
+    } else {
+        std::cerr << "Error. Unknown minit for KMeans: " << minit << std::endl;
+        throw;
     }
+}
 
-    // Perform k-means iterations
-    std::vector<int> labels(N);
-    for (int iter_count = 0; iter_count < iter; ++iter_count) {
-        // std::cout << iter_count << '\n';
-        // Assign each observation to the nearest centroid
-        double errors_sum = 0.0;
-        
+// Assignment step with group bounds (Yinyang k-means, Ding et al. 2015), for a large k.
+// The centroids are clustered once into t groups. Each observation keeps an upper bound u
+// on the distance to its centroid and, per group, a lower bound on the distance to the
+// centroids of that group other than its own. When the centroids move, u grows by the
+// shift of its centroid and the bound of a group shrinks by the largest shift in that
+// group. If u is below every group bound, the observation cannot change cluster and is
+// skipped; otherwise u is recomputed, and only the groups whose bound is still below u
+// are scanned. With t = 1 this is Hamerly's algorithm and with t = k Elkan's: one bound
+// gives up too early when k is large, since it shrinks by the largest shift of all,
+// and k bounds take O(N * k) memory. An assignment then computes a small fraction of
+// Lloyd's N * k distances, but one at a time, so below KMEANS_BOUNDS_MIN_K centroids
+// the blocked search of NearestCenters is faster.
+// The labels are those of Lloyd's assignment, up to rounding on exact ties.
+// Distances are Euclidean (not squared) so that the triangle inequality holds.
+constexpr int KMEANS_BOUNDS_MIN_K = 1024;
+// Centroids per group, and at most KMEANS_BOUNDS_MAX_GROUPS groups (N x t bounds)
+constexpr int KMEANS_BOUNDS_GROUP_SIZE = 16;
+constexpr int KMEANS_BOUNDS_MAX_GROUPS = 32;
+
+template<typename T>
+class YinyangBounds {
+public:
+    // First assignment, with the exact distance to every group.
+    // centroids: k x D, packed in panels
+    void Init(const T* obs, size_t N, size_t D, const float* centroids, const CenterPanels& panels,
+        uint32_t* labels, std::default_random_engine& rd)
+    {
+        const int k = panels.k();
+        t_ = std::min(std::max(k / KMEANS_BOUNDS_GROUP_SIZE, 1), KMEANS_BOUNDS_MAX_GROUPS);
+
+        // Group the centroids with a few Lloyd iterations
+        std::vector<float> group_centroids(t_ * D);
+        std::vector<uint32_t> group_labels(k);
+        InitCentroids(centroids, k, D, t_, "points", group_centroids.data(), rd);
+        for (int it = 0; it < 5; ++it) {
+            NearestCenters(centroids, k, D, CenterPanels(group_centroids.data(), t_, D), group_labels.data(), nullptr);
+            UpdateCentroids(centroids, k, D, group_labels.data(), t_, group_centroids.data());
+        }
+        group_.assign(group_labels.begin(), group_labels.end());
+        members_.assign(t_, std::vector<uint32_t>());
+        for (int c = 0; c < k; ++c) {
+            members_[group_[c]].push_back(c);
+        }
+
+        // Closest centroid of each group, then the assignment and the bounds
+        upper_.assign(N, std::numeric_limits<float>::max());
+        lower_.resize(N * t_);
+        std::vector<uint32_t> ids(N);
+        std::vector<float> dists(N);
+        std::vector<float> group_best(N * t_, std::numeric_limits<float>::max());
+        std::vector<float> group_second(N * t_, std::numeric_limits<float>::max());
+        std::vector<float> member_centroids;
+        for (int g = 0; g < t_; ++g) {
+            const auto& members = members_[g];
+            if (members.empty()) continue;
+            member_centroids.resize(members.size() * D);
+            for (size_t j = 0; j < members.size(); ++j) {
+                std::copy_n(centroids + members[j] * D, D, member_centroids.begin() + j * D);
+            }
+            size_t w = std::min<size_t>(2, members.size());
+            std::vector<uint32_t> top_ids(N * w);
+            std::vector<float> top_dists(N * w);
+            TopWCenters(obs, N, D, CenterPanels(member_centroids.data(), members.size(), D),
+                w, top_ids.data(), top_dists.data());
+
+            #pragma omp parallel for
+            for (size_t i = 0; i < N; ++i) {
+                group_best[i * t_ + g] = std::sqrt(top_dists[i * w]);
+                if (w == 2) group_second[i * t_ + g] = std::sqrt(top_dists[i * w + 1]);
+                if (group_best[i * t_ + g] < upper_[i]) {
+                    labels[i] = members[top_ids[i * w]];
+                    upper_[i] = group_best[i * t_ + g];
+                }
+            }
+        }
         #pragma omp parallel for
-        for (int i = 0; i < N; ++i) {
-            float min_dist;
-            std::tie(labels[i], min_dist) = NearestCenter(obs[i].data(), centroids);
+        for (size_t i = 0; i < N; ++i) {
+            int ga = group_[labels[i]];
+            for (int g = 0; g < t_; ++g) {
+                lower_[i * t_ + g] = g == ga ? group_second[i * t_ + g] : group_best[i * t_ + g];
+            }
         }
+    }
 
-        // Update centroids based on assigned observations
+    // centroids: k x D after the update, prev: before. labels are updated in place
+    void Assign(const T* obs, size_t N, size_t D, const float* centroids, const float* prev, uint32_t* labels)
+    {
+        const size_t k = group_.size();
+
+        // How far every centroid, and at most every group, moved
+        std::vector<float> shift(k);
         #pragma omp parallel for
-        for (int j = 0; j < k; ++j) {
-            std::vector<float> sum(D, 0.0);
-            int count = 0;
-            for (int i = 0; i < N; ++i) {
-                if (labels[i] == j) {
-                    std::transform(sum.begin(), sum.end(), obs[i].begin(), sum.begin(), std::plus<float>());
-                    ++count;
-                }
+        for (size_t c = 0; c < k; ++c) {
+            shift[c] = std::sqrt(fvec_L2sqr(centroids + c * D, prev + c * D, D));
+        }
+        std::vector<float> group_shift(t_, 0);
+        for (size_t c = 0; c < k; ++c) {
+            group_shift[group_[c]] = std::max(group_shift[group_[c]], shift[c]);
+        }
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (size_t i = 0; i < N; ++i) {
+            const T* x = obs + i * D;
+            float* lower = lower_.data() + i * t_;
+            uint32_t a = labels[i];
+            float u = upper_[i] + shift[a];
+            float global_lower = std::numeric_limits<float>::max();
+            for (int g = 0; g < t_; ++g) {
+                lower[g] -= group_shift[g];
+                global_lower = std::min(global_lower, lower[g]);
+            }
+            if (u <= global_lower) {
+                upper_[i] = u;
+                continue;
             }
-            // To match the centroids and the labels, 
-            // no update should be done in the last iter. 
-            if (iter_count != iter - 1 && count > 0) {
-            // if (count > 0) {
-                std::transform(sum.begin(), sum.end(), centroids[j].begin(), [count](float val) { return val / count; });
+            u = std::sqrt(fvec_L2sqr(x, centroids + a * D, D));
+            upper_[i] = u;
+            if (u <= global_lower) continue;
+
+            // Scan the groups whose bound is below u. d(x, a) is known, and the centroid
+            // that x leaves becomes a candidate for the bound of its group
+            const uint32_t a0 = a;
+            const float u0 = u;
+            for (int g = 0; g < t_; ++g) {
+                if (lower[g] >= u) continue;
+                float best = std::numeric_limits<float>::max(), second = best;
+                uint32_t best_c = 0;
+                for (uint32_t c : members_[g]) {
+                    float d = c == a ? u : c == a0 ? u0 : std::sqrt(fvec_L2sqr(x, centroids + c * D, D));
+                    if (d < best) {
+                        second = best;
+                        best = d;
+                        best_c = c;
+                    } else if (d < second) {
+                        second = d;
+                    }
+                }
+                if (best_c != a && best < u) {
+                    int ga = group_[a];
+                    if (ga != g) lower[ga] = std::min(lower[ga], u);
+                    a = best_c;
+                    u = best;
+                    lower[g] = second;
+                } else {
+                    lower[g] = best_c == a ? second : best;
+                }
             }
+            labels[i] = a;
+            upper_[i] = u;
+        }
+    }
+
+private:
+    int t_ = 0;
+    std::vector<int> group_;                        // group of each centroid
+    std::vector<std::vector<uint32_t>> members_;    // centroids of each group
+    std::vector<float> upper_;                      // N
+    std::vector<float> lower_;                      // N x t
+};
+
+// kmeans Lloyd implementation
+// obs: N vectors of dimension D, contiguous. Returns the k centroids (k x D, contiguous)
+// and the label of each vector
+// minit: "points" seeds with k random observations, "++" with k-means++ (KMeansPlusPlus)
+// seed: seeds the initialization and the splitting of empty clusters
+template<typename T>
+std::tuple<std::vector<float>, std::vector<uint32_t>> 
+KMeans(const T* obs, size_t N, size_t D, int k, int iter, const std::string& minit, int seed = 0)
+{
+    std::default_random_engine rd(seed);
+    // Initialize centroids based on minit. Kept flat (k x D) for the blocked assignment
+    std::vector<float> centroids(k * D, 0.0);
+    InitCentroids(obs, N, D, k, minit, centroids.data(), rd);
+
+    // Perform k-means iterations
+    // For a large k, the assignments after the first one go through YinyangBounds
+    const bool bounded = k >= KMEANS_BOUNDS_MIN_K;
+    YinyangBounds<T> bounds;
+    std::vector<float> prev;
+    std::vector<uint32_t> labels(N);
+    for (int iter_count = 0; iter_count < iter; ++iter_count) {
+        // std::cout << iter_count << '\n';
+        // Assign each observation to the nearest centroid
+        CenterPanels panels(centroids.data(), k, D);
+        if (!bounded) {
+            NearestCenters(obs, N, D, panels, labels.data(), nullptr);
+        } else if (iter_count == 0) {
+            bounds.Init(obs, N, D, centroids.data(), panels, labels.data(), rd);
+        } else {
+            bounds.Assign(obs, N, D, centroids.data(), prev.data(), labels.data());
+        }
+
+        // To match the centroids and the labels, 
+        // no update should be done in the last iter. 
+        if (iter_count != iter - 1) {
+            if (bounded) prev = centroids;
+            std::vector<size_t> sizes = UpdateCentroids(obs, N, D, labels.data(), k, centroids.data());
+            SplitEmptyClusters(N, D, k, sizes, centroids.data(), rd);
         }
     }
 
@@ -104,4 +427,71 @@ KMeans(const std::vector<std::vector<T>>& obs, int k, int iter, const std::strin
 }
 
 
+// Stream of training vectors: fills buf with up to n vectors and returns how many
+// were read, 0 once the stream is exhausted. See VecsFileReader (binary_io.hpp)
+template<typename T>
+using BatchReader = std::function<size_t(T* buf, size_t n)>;
+
+// Mini-batch k-means (Sculley, 2010), for training sets that do not fit in memory.
+// The observations come in batches. Each batch is assigned with the blocked search,
+// then every centroid moves to the running mean of all the observations it was ever
+// given: c <- (n_c * c + sum of its batch members) / (n_c + number of members).
+// Memory is O(k * D) plus the batch, whatever the size of the training set.
+// The first batch seeds the centroids, so it needs at least k vectors.
+template<typename T>
+class MiniBatchKMeans {
+public:
+    // minit and seed: see KMeans
+    MiniBatchKMeans(size_t D, int k, const std::string& minit = "++", int seed = 0)
+        : D_(D), k_(k), minit_(minit), rd_(seed), centroids_(k * D, 0.0), counts_(k, 0) {}
+
+    // obs: n vectors of dimension D, contiguous
+    void Step(const T* obs, size_t n)
+    {
+        if (seen_ == 0) {
+            if (n < (size_t)k_) {
+                std::cerr << "Error. The first batch of MiniBatchKMeans needs at least k = "
+                          << k_ << " vectors, got " << n << std::endl;
+                throw;
+            }
+            InitCentroids(obs, n, D_, k_, minit_, centroids_.data(), rd_);
+        }
+
+        std::vector<uint32_t> labels(n);
+        NearestCenters(obs, n, D_, CenterPanels(centroids_.data(), k_, D_), labels.data(), nullptr);
+
+        std::vector<double> sums(k_ * D_);
+        std::vector<size_t> sizes(k_);
+        SumClusters(obs, n, D_, labels.data(), k_, sums.data(), sizes.data());
+
+        #pragma omp parallel for
+        for (int c = 0; c < k_; ++c) {
+            if (sizes[c] == 0) continue;
+            double total = counts_[c] + sizes[c];
+            for (size_t j = 0; j < D_; ++j) {
+                float& x = centroids_[c * D_ + j];
+                x = (counts_[c] * (double)x + sums[c * D_ + j]) / total;
+            }
+            counts_[c] += sizes[c];
+        }
+        seen_ += n;
+        SplitEmptyClusters(seen_, D_, k_, counts_, centroids_.data(), rd_);
+    }
+
+    // The number of observations seen so far
+    size_t seen() const { return seen_; }
+    // k x D, row-major
+    const std::vector<float>& centroids() const { return centroids_; }
+
+private:
+    size_t D_;
+    int k_;
+    std::string minit_;
+    std::default_random_engine rd_;
+    std::vector<float> centroids_;
+    std::vector<size_t> counts_;    // observations given to each centroid so far
+    size_t seen_ = 0;
+};
+
+
 #endif
\ No newline at end of file
@@ -9,6 +9,12 @@
 #include <algorithm>
 #include <random>
 #include <cfloat>
+#include <string>
+
+#include "distance.hpp"
+#include "centroid_search.hpp"
+#include "kmeans.hpp"
+#include "util.hpp"
 
 namespace Quantizer {
 
@@ -16,15 +22,60 @@ template <typename T> class Quantizer {
 public:
     Quantizer(size_t D, size_t N, size_t M, size_t K, bool verbose = false);
 
-    uint32_t predict_one(const T* vec, uint32_t m);
-    void fit(const std::vector<T>& rawdata, int iter = 20, int seed = 123);
+    uint32_t predict_one(const T* vec, uint32_t m, MetricType metric = METRIC_L2);
+    void predict(const T* vecs, size_t n, uint32_t m, uint32_t* labels, MetricType metric = METRIC_L2);
+    void search(const T* vecs, size_t n, uint32_t m, size_t w, 
+                uint32_t* labels, float* dists, MetricType metric = METRIC_L2);
+    /**
+     * Cells of an inverted multi-index: with M_ = 2, the cell of the centers i0 and i1 of
+     * the two halves is i0 * K_ + i1, and its distance to a vector the sum of theirs, so
+     * K_^2 cells cost 2 K_ distances. With M_ = 1, the cells are the centers
+    */
+    size_t ncells() const { return M_ == 1 ? K_ : K_ * K_; }
+    // Center of cell in the m-th subspace
+    size_t cell_center(size_t cell, size_t m) const { return M_ == 1 ? cell : m == 0 ? cell / K_ : cell % K_; }
+    // labels: the closest cells of n vectors of D_, contiguous
+    void predict_cells(const T* vecs, size_t n, uint32_t* labels, MetricType metric = METRIC_L2) const;
+    // labels, dists: the w closest cells of vec, closest first (w is capped at ncells()).
+    // With M_ = 2, the w closest centers of each half are combined by MultiSequence
+    void search_cells(const T* vec, size_t w, uint32_t* labels, float* dists,
+                      MultiSequenceScratch& scratch, MetricType metric = METRIC_L2) const;
+    // labels, dists: n x w, the w closest cells of each of n vectors of D_, contiguous (w <= ncells())
+    void search_cells(const T* vecs, size_t n, size_t w, uint32_t* labels, float* dists,
+                      MetricType metric = METRIC_L2) const;
+    // Spilled assignment of n vectors of D_: each goes to its closest cell, then to up to r - 1
+    // of the next closest whose distance d is within ratio of the closest one, d1:
+    // d <= d1 + (ratio - 1) |d1|. cells: the cell of every entry, rows: its vector, in order
+    void spill_cells(const T* vecs, size_t n, size_t r, float ratio, std::vector<uint32_t>& cells,
+                     std::vector<size_t>& rows, MetricType metric = METRIC_L2) const;
+    // Distance tables of n vectors of D_ (row i at vecs + i * D_): tables[(i * M_ + m) * K_ + k]
+    // is the distance of sub-vector m of vector i to the k-th center of subspace m (see fvec_distance)
+    void DistanceTables(const T* vecs, size_t n, float* tables, MetricType metric = METRIC_L2) const;
+    // minit: k-means initialization, "points" or "++" (see KMeans)
+    void fit(const std::vector<T>& rawdata, int iter = 20, int seed = 123, const std::string& minit = "points");
+    // Mini-batch k-means on a stream of vectors of dimension D_, read batch_size at a time,
+    // for at most nbatch batches. Only one batch is held in memory; no assignment is kept
+    void fit(const BatchReader<T>& reader, size_t batch_size, size_t nbatch, int seed = 123,
+             const std::string& minit = "++");
     const std::vector<std::vector<int>>& GetAssignments();
 
-    void SetCentroids(const std::vector<std::vector<std::vector<float>>>& centers_new);
+    // centers_new: M_ x K_ x Ds_, contiguous
+    void SetCentroids(const float* centers_new);
     void Load(std::string quantizer_path);
     void Write(std::string quantizer_path);
-    const std::vector<std::vector<std::vector<float>>>& get_centroids();
-    std::vector<std::vector<uint8_t>> Encode(const std::vector<T>& rawdata);
+    // All the centers, M_ x K_ x Ds_
+    const AlignedVector<float>& get_centroids() const { return centers_; }
+    // The K_ centers of the m-th subspace, K_ x Ds_
+    const float* centroids(size_t m) const { return centers_.data() + m * K_ * Ds_; }
+    // k-th center of the m-th subspace, Ds_ floats
+    const float* centroid(size_t m, size_t k) const { return centers_.data() + (m * K_ + k) * Ds_; }
+    size_t sub_dim() const { return Ds_; }
+    // Codes of the vectors of rawdata, N x M_, contiguous
+    std::vector<uint8_t> Encode(const std::vector<T>& rawdata);
+    std::vector<uint8_t> Encode(const T* x, size_t N);
+    // 4-bit codes (K_ <= 16) of the N vectors of x, two per byte, N x (M_ + 1) / 2:
+    // sub-space 2i in the low nibble of byte i, sub-space 2i + 1 in the high one
+    std::vector<uint8_t> Encode4(const T* x, size_t N);
     std::vector<std::vector<uint8_t>> Encode(const std::vector<std::vector<T>>& rawdata);
 
 private:
@@ -35,8 +86,13 @@ private:
     size_t N_;  // the number of input rawdata (vector)
     bool verbose_;
 
-    // centers for clustering. shape = M_ * K_ * Ds_
-    std::vector<std::vector<std::vector<float>>> centers_;  
+    // centers for clustering. shape = M_ * K_ * Ds_, in one 64-byte aligned buffer.
+    // The indexes read them in place through centroids() / centroid()
+    AlignedVector<float> centers_;
+    // centers_ of each subspace packed for the blocked search (centroid_search.hpp).
+    // Refreshed by UpdateCenterCache() whenever centers_ change
+    std::vector<CenterPanels> panels_;
+    void UpdateCenterCache();
     // assignement for each intput vector. shape = M_ * N
     // assignments_[m][n] in [0, K_)
     std::vector<std::vector<int>> assignments_;  
@@ -0,0 +1,57 @@
+#ifndef INCLUDE_SEARCH_CONTEXT_HPP
+#define INCLUDE_SEARCH_CONTEXT_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "util.hpp"
+#include "topk.hpp"
+#include "centroid_graph.hpp"
+#include "centroid_search.hpp"
+
+
+namespace toy {
+
+struct DistanceTable {
+    // Helper structure. This is identical to vec<vec<float>> dt(M, vec<float>(Ks))
+    // Entries are metric distances (smaller is closer): sub-space squared L2 distances,
+    // or negated sub-space inner products, which add up to the negated inner product.
+    DistanceTable() {}
+    DistanceTable(size_t M, size_t Ks) : kp(Ks), data_(M * Ks) {}
+    void set_value(size_t m, size_t ks, float val) {
+        data_[m * kp + ks] = val;
+    }
+    float get_value(size_t m, size_t ks) const {
+        return data_[m * kp + ks];
+    }
+    size_t kp;
+    std::vector<float> data_;
+};
+
+/**
+ * Buffers of one search, for the Search() of the indexes. A caller keeps one per thread
+ * and passes it to every query: the buffers grow on the first queries, then a search
+ * does no heap allocation. A context must not be shared by concurrent searches.
+ */
+struct SearchContext {
+    std::vector<float> query;           // the normalized query, METRIC_COSINE
+    std::vector<uint32_t> lists;        // ids of the lists probed
+    std::vector<float> list_dists;      // and their coarse distances, nearest first
+    GraphSearchScratch graph;           // the search of the coarse graph, if any
+    MultiSequenceScratch cells;         // the search of the cells, mc = 2
+    TopK topk;
+
+    // IndexIVFPQ
+    DistanceTable dtable, list_table;   // the query table, and the table of a list by residual
+    std::vector<float> dis;             // distances of a list, CODE_LAYOUT_BLOCK_16
+    AlignedVector<uint8_t> lut;         // uint8 tables: fast scan, TABLE_UINT8
+    std::vector<uint16_t> table16;      // TABLE_UINT16
+    std::vector<uint16_t> acc16;        // table sums of a list: fast scan
+    std::vector<uint32_t> acc;          // table sums of a list: TABLE_UINT8 / TABLE_UINT16
+    DistanceTable list_terms;           // the terms of a list by residual, and their sums
+    std::vector<float> term_sums;       // by entry: TopKIdListMajor with quantized tables
+};
+
+} // namespace toy
+
+#endif
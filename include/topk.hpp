@@ -0,0 +1,100 @@
+#ifndef INCLUDE_TOPK_HPP
+#define INCLUDE_TOPK_HPP
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "inverted_lists.hpp"
+
+
+namespace toy {
+
+/**
+ * The k nearest entries of a stream of (distance, id), smaller distances first.
+ * A max-heap of at most k entries: the scans push every candidate, and those at or past
+ * threshold(), the k-th best so far, are dropped at once, so a search holds O(k) entries
+ * however many it scans. Equal distances are ordered by id, whatever the scan order.
+ * Reset() keeps the buffer, so one collector can serve query after query.
+ * With unique, an id pushed again (a vector spilled to several lists) keeps its smallest
+ * distance instead of taking a second entry. Only the candidates under threshold() look
+ * for their id, among the k entries held.
+ */
+class TopK {
+public:
+    TopK() = default;
+    explicit TopK(size_t k, bool unique = false) { Reset(k, unique); }
+
+    void Reset(size_t k, bool unique = false) {
+        k_ = k;
+        unique_ = unique;
+        heap_.clear();
+        heap_.reserve(k);
+    }
+
+    size_t size() const { return heap_.size(); }
+
+    // Distance a candidate has to be under to enter, +inf until k entries are in
+    float threshold() const {
+        return heap_.size() < k_ ? std::numeric_limits<float>::infinity() : heap_.front().first;
+    }
+
+    void Push(float dist, idx_t id) {
+        if (heap_.size() < k_) {
+            if (unique_ && Update(dist, id)) return;
+            heap_.emplace_back(dist, id);
+            std::push_heap(heap_.begin(), heap_.end());
+        } else if (k_ > 0 && std::make_pair(dist, id) < heap_.front()) {
+            if (unique_ && Update(dist, id)) return;
+            std::pop_heap(heap_.begin(), heap_.end());
+            heap_.back() = {dist, id};
+            std::push_heap(heap_.begin(), heap_.end());
+        }
+    }
+
+    // The entries, nearest first, into ids and dist. The collector is left empty
+    // @return the number of entries, at most k
+    size_t Extract(idx_t* ids, float* dist) {
+        std::sort_heap(heap_.begin(), heap_.end());
+        size_t n = heap_.size();
+        for (size_t i = 0; i < n; ++i) {
+            ids[i] = heap_[i].second;
+            dist[i] = heap_[i].first;
+        }
+        heap_.clear();
+        return n;
+    }
+
+    // The entries, nearest first, as (id, distance). The collector is left empty
+    void Extract(std::vector<std::pair<idx_t, float>>& result) {
+        std::sort_heap(heap_.begin(), heap_.end());
+        result.resize(heap_.size());
+        for (size_t i = 0; i < heap_.size(); ++i) {
+            result[i] = {heap_[i].second, heap_[i].first};
+        }
+        heap_.clear();
+    }
+
+private:
+    // If id is held, keeps the smaller of its distances. Returns whether it was
+    bool Update(float dist, idx_t id) {
+        for (auto& entry : heap_) {
+            if (entry.second != id) continue;
+            if (dist < entry.first) {
+                entry.first = dist;
+                std::make_heap(heap_.begin(), heap_.end());
+            }
+            return true;
+        }
+        return false;
+    }
+
+    size_t k_ = 0;
+    bool unique_ = false;
+    std::vector<std::pair<float, idx_t>> heap_;
+};
+
+} // namespace toy
+
+#endif
@@ -1,9 +1,11 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <iostream>
+#include <new>
 #include <string>
 #include <typeinfo>
 #include <vector>
@@ -36,6 +38,41 @@ void PrintType(const T& var) {
     }  
 }  
 
+// Allocator of buffers aligned on Align bytes, a cache line by default, so that SIMD
+// loads never straddle two lines and rows of a multiple of 16 floats stay aligned
+template<typename T, size_t Align = 64>
+struct AlignedAllocator {
+    using value_type = T;
+    template<typename U> struct rebind { using other = AlignedAllocator<U, Align>; };
+
+    AlignedAllocator() = default;
+    template<typename U> AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+    }
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(Align));
+    }
+    template<typename U> bool operator==(const AlignedAllocator<U, Align>&) const { return true; }
+    template<typename U> bool operator!=(const AlignedAllocator<U, Align>&) const { return false; }
+};
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// The rows of x, d elements each, in the order of rows
+template<typename T>
+std::vector<T> GatherRows(const T* x, size_t d, const std::vector<size_t>& rows)
+{
+    std::vector<T> gathered(rows.size() * d);
+    #pragma omp parallel for
+    for (size_t i = 0; i < rows.size(); ++i) {
+        std::copy_n(x + rows[i] * d, d, gathered.data() + i * d);
+    }
+    return gathered;
+}
+
 class Timer
 {
   private:
@@ -0,0 +1,275 @@
+#include "centroid_graph.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+
+CentroidGraph::CentroidGraph(const float* centers, size_t k, size_t d, MetricType metric,
+                             size_t M, size_t ef_construction, int seed)
+    : centers_(centers), k_(k), d_(d), metric_(metric), M_(M), M0_(2 * M),
+      levels_(k), links0_(k * (2 * M + 1), 0), upper_(k)
+{
+    if (k == 0) return;
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    const double mult = 1 / std::log((double)std::max<size_t>(M, 2));
+    for (size_t c = 0; c < k; ++c) {
+        levels_[c] = (int)(-std::log(1 - uniform(rng)) * mult);
+        upper_[c].assign(levels_[c] * (M_ + 1), 0);
+        if (levels_[c] > max_level_) {
+            max_level_ = levels_[c];
+            entry_ = c;
+        }
+    }
+
+    // The entry point is on the top layer from the start, so the other centers can be
+    // inserted by all the threads at once, each link list under the lock of its center
+    std::vector<std::mutex> locks(k);
+    #pragma omp parallel
+    {
+        GraphSearchScratch scratch;
+        #pragma omp for schedule(dynamic, 64)
+        for (size_t c = 0; c < k; ++c) {
+            if (c != entry_) Insert(c, ef_construction, scratch, locks.data());
+        }
+    }
+}
+
+const uint32_t* CentroidGraph::ReadLinks(uint32_t c, int l, GraphSearchScratch& scratch,
+                                         std::mutex* locks) const
+{
+    const uint32_t* links = Links(c, l);
+    if (locks == nullptr) return links;
+    std::lock_guard<std::mutex> guard(locks[c]);
+    scratch.neighbors.assign(links, links + 1 + links[0]);
+    return scratch.neighbors.data();
+}
+
+template<typename T>
+void CentroidGraph::Greedy(const T* x, int l, uint32_t& cur, float& dcur,
+                           GraphSearchScratch& scratch, std::mutex* locks) const
+{
+    for (bool moved = true; moved; ) {
+        moved = false;
+        const uint32_t* links = ReadLinks(cur, l, scratch, locks);
+        for (uint32_t i = 1; i <= links[0]; ++i) {
+            float dist = Distance(x, links[i]);
+            if (dist < dcur) {
+                dcur = dist;
+                cur = links[i];
+                moved = true;
+            }
+        }
+    }
+}
+
+template<typename T>
+void CentroidGraph::SearchLayer(const T* x, int l, uint32_t cur, float dcur, size_t ef,
+                                GraphSearchScratch& scratch, std::mutex* locks) const
+{
+    auto& visited = scratch.visited;
+    if (visited.size() != k_) {
+        visited.assign(k_, 0);
+        scratch.tag = 0;
+    }
+    if (++scratch.tag == 0) {
+        std::fill(visited.begin(), visited.end(), 0);
+        scratch.tag = 1;
+    }
+
+    // candidates: the centers left to expand, a min-heap
+    auto& candidates = scratch.candidates;
+    auto& results = scratch.results;
+    const auto closer = std::greater<std::pair<float, uint32_t>>();
+    candidates.assign(1, {dcur, cur});
+    results.assign(1, {dcur, cur});
+    visited[cur] = scratch.tag;
+
+    while (!candidates.empty()) {
+        const auto [dist, c] = candidates.front();
+        if (results.size() >= ef && dist > results.front().first) break;
+        std::pop_heap(candidates.begin(), candidates.end(), closer);
+        candidates.pop_back();
+
+        const uint32_t* links = ReadLinks(c, l, scratch, locks);
+        for (uint32_t i = 1; i <= links[0]; ++i) {
+            const uint32_t n = links[i];
+            if (visited[n] == scratch.tag) continue;
+            visited[n] = scratch.tag;
+
+            float dn = Distance(x, n);
+            if (results.size() < ef || dn < results.front().first) {
+                candidates.emplace_back(dn, n);
+                std::push_heap(candidates.begin(), candidates.end(), closer);
+                results.emplace_back(dn, n);
+                std::push_heap(results.begin(), results.end());
+                if (results.size() > ef) {
+                    std::pop_heap(results.begin(), results.end());
+                    results.pop_back();
+                }
+            }
+        }
+    }
+}
+
+void CentroidGraph::SelectNeighbors(std::vector<std::pair<float, uint32_t>>& candidates, size_t m) const
+{
+    if (candidates.size() <= m) return;
+
+    size_t nkept = 0;
+    for (size_t i = 0; i < candidates.size() && nkept < m; ++i) {
+        const float* xi = centers_ + candidates[i].second * d_;
+        bool keep = true;
+        for (size_t j = 0; j < nkept && keep; ++j) {
+            keep = Distance(xi, candidates[j].second) >= candidates[i].first;
+        }
+        if (keep) candidates[nkept++] = candidates[i];
+    }
+    candidates.resize(nkept);
+}
+
+void CentroidGraph::Insert(uint32_t c, size_t ef_construction, GraphSearchScratch& scratch,
+                           std::mutex* locks)
+{
+    const float* x = centers_ + c * d_;
+    uint32_t cur = entry_;
+    float dcur = Distance(x, cur);
+    for (int l = max_level_; l > levels_[c]; --l) {
+        Greedy(x, l, cur, dcur, scratch, locks);
+    }
+
+    std::vector<std::pair<float, uint32_t>> selected;
+    for (int l = levels_[c]; l >= 0; --l) {
+        SearchLayer(x, l, cur, dcur, ef_construction, scratch, locks);
+        selected.assign(scratch.results.begin(), scratch.results.end());
+        selected.erase(std::remove_if(selected.begin(), selected.end(),
+            [c](const auto& e) { return e.second == c; }), selected.end());
+        if (selected.empty()) continue;
+        std::sort(selected.begin(), selected.end());
+        cur = selected[0].second;
+        dcur = selected[0].first;
+
+        SelectNeighbors(selected, l == 0 ? M0_ : M_);
+        {
+            std::lock_guard<std::mutex> guard(locks[c]);
+            uint32_t* links = Links(c, l);
+            links[0] = selected.size();
+            for (size_t i = 0; i < selected.size(); ++i) links[i + 1] = selected[i].second;
+        }
+        for (const auto& [dist, n] : selected) AddLink(n, c, l, locks);
+    }
+}
+
+void CentroidGraph::AddLink(uint32_t c, uint32_t n, int l, std::mutex* locks)
+{
+    std::lock_guard<std::mutex> guard(locks[c]);
+    uint32_t* links = Links(c, l);
+    const size_t m = l == 0 ? M0_ : M_;
+    if (std::find(links + 1, links + 1 + links[0], n) != links + 1 + links[0]) return;
+    if (links[0] < m) {
+        links[++links[0]] = n;
+        return;
+    }
+
+    // Full: n competes with the links of c
+    const float* xc = centers_ + c * d_;
+    std::vector<std::pair<float, uint32_t>> candidates;
+    candidates.emplace_back(Distance(xc, n), n);
+    for (uint32_t i = 1; i <= links[0]; ++i) {
+        candidates.emplace_back(Distance(xc, links[i]), links[i]);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    SelectNeighbors(candidates, m);
+    links[0] = candidates.size();
+    for (size_t i = 0; i < candidates.size(); ++i) links[i + 1] = candidates[i].second;
+}
+
+template<typename T>
+void CentroidGraph::Search(const T* x, size_t w, size_t ef, uint32_t* labels, float* dists,
+                           GraphSearchScratch& scratch) const
+{
+    w = std::min(w, k_);
+    if (w == 0) return;
+
+    uint32_t cur = entry_;
+    float dcur = Distance(x, cur);
+    for (int l = max_level_; l > 0; --l) {
+        Greedy(x, l, cur, dcur, scratch, nullptr);
+    }
+    SearchLayer(x, 0, cur, dcur, std::max(ef, w), scratch, nullptr);
+
+    // Centers the search could not reach fill the list, if it is short
+    auto& results = scratch.results;
+    for (uint32_t c = 0; c < k_ && results.size() < w; ++c) {
+        if (scratch.visited[c] != scratch.tag) results.emplace_back(Distance(x, c), c);
+    }
+    std::sort(results.begin(), results.end());
+    for (size_t i = 0; i < w; ++i) {
+        labels[i] = results[i].second;
+        if (dists) dists[i] = results[i].first;
+    }
+}
+
+// Layout: k, d, M, metric, max_level, entry, the levels, layer 0, then the upper
+// layers of every center of level > 0
+void CentroidGraph::Write(const std::string& path) const
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file: " << path << std::endl;
+        throw;
+    }
+    const uint64_t header[3] = {k_, d_, M_};
+    const int32_t header_int[3] = {(int32_t)metric_, max_level_, (int32_t)entry_};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(header_int), sizeof(header_int));
+    file.write(reinterpret_cast<const char*>(levels_.data()), k_ * sizeof(int));
+    file.write(reinterpret_cast<const char*>(links0_.data()), links0_.size() * sizeof(uint32_t));
+    for (const auto& links : upper_) {
+        file.write(reinterpret_cast<const char*>(links.data()), links.size() * sizeof(uint32_t));
+    }
+}
+
+void CentroidGraph::Load(const std::string& path, const float* centers)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file: " << path << std::endl;
+        throw;
+    }
+    uint64_t header[3];
+    int32_t header_int[3];
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    file.read(reinterpret_cast<char*>(header_int), sizeof(header_int));
+    centers_ = centers;
+    k_ = header[0];
+    d_ = header[1];
+    M_ = header[2];
+    M0_ = 2 * M_;
+    metric_ = (MetricType)header_int[0];
+    max_level_ = header_int[1];
+    entry_ = header_int[2];
+
+    levels_.resize(k_);
+    links0_.resize(k_ * (M0_ + 1));
+    upper_.assign(k_, {});
+    file.read(reinterpret_cast<char*>(levels_.data()), k_ * sizeof(int));
+    file.read(reinterpret_cast<char*>(links0_.data()), links0_.size() * sizeof(uint32_t));
+    for (size_t c = 0; c < k_; ++c) {
+        upper_[c].resize(levels_[c] * (M_ + 1));
+        file.read(reinterpret_cast<char*>(upper_[c].data()), upper_[c].size() * sizeof(uint32_t));
+    }
+    if (!file) {
+        std::cerr << "Error. " << path << " is truncated." << std::endl;
+        throw;
+    }
+}
+
+template void CentroidGraph::Search<float>(const float*, size_t, size_t, uint32_t*, float*,
+                                           GraphSearchScratch&) const;
+template void CentroidGraph::Search<uint8_t>(const uint8_t*, size_t, size_t, uint32_t*, float*,
+                                             GraphSearchScratch&) const;
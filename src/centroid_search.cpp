@@ -0,0 +1,244 @@
+#include "centroid_search.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <utility>
+
+// Tile sizes: BX vectors against BP panels (16 * BP centers) at a time.
+// For d = 128 that is 32 KiB of vectors and 128 KiB of centers.
+static constexpr size_t BX = 64;
+static constexpr size_t BP = 16;
+// Vectors per call of the panel kernel
+static constexpr size_t MR = 8;
+
+CenterPanels::CenterPanels(const float* centers, size_t k, size_t d)
+    : k_(k), d_(d), panels_(npanel() * d * 16, 0), norms_(npanel() * 16, 0)
+{
+    for (size_t c = 0; c < k; ++c) {
+        const float* center = centers + c * d;
+        float* panel = panels_.data() + (c / 16) * d * 16 + c % 16;
+        for (size_t j = 0; j < d; ++j) {
+            panel[j * 16] = center[j];
+        }
+        norms_[c] = fvec_inner_product(center, center, d);
+    }
+}
+
+// Core of NearestCenters and TopWCenters. Keeps the w best centers of each vector of a tile:
+// a running minimum for w == 1, a max-heap of (distance, id) otherwise.
+template<typename T>
+static void SearchCenters(
+    const T* x, size_t n, size_t stride,
+    const CenterPanels& centers,
+    size_t w, uint32_t* labels, float* dists,
+    MetricType metric
+)
+{
+    const size_t k = centers.k(), d = centers.d();
+    w = std::min(w, k);
+    if (n == 0 || w == 0) return;
+
+    const bool l2 = metric == METRIC_L2;
+    const size_t npanel = centers.npanel();
+    const size_t ntile = (n + BX - 1) / BX;
+
+    #pragma omp parallel for schedule(dynamic) if (ntile > 1)
+    for (size_t t = 0; t < ntile; ++t) {
+        const size_t i0 = t * BX;
+        const size_t bx = std::min(n, i0 + BX) - i0;
+
+        // The tile in float, with its squared norms. The buffers are kept by each thread,
+        // so that searching one query at a time does not allocate
+        thread_local std::vector<float> xf;
+        xf.resize(bx * d);
+        float xnorm[BX];
+        for (size_t i = 0; i < bx; ++i) {
+            const T* xi = x + (i0 + i) * stride;
+            std::copy(xi, xi + d, xf.begin() + i * d);
+            xnorm[i] = l2 ? fvec_inner_product(xf.data() + i * d, xf.data() + i * d, d) : 0;
+        }
+
+        float best_dist[BX];
+        uint32_t best_id[BX];
+        std::fill(best_dist, best_dist + BX, std::numeric_limits<float>::max());
+        std::fill(best_id, best_id + BX, 0);
+        thread_local std::vector<std::vector<std::pair<float, uint32_t>>> heaps;
+        heaps.resize(w > 1 ? bx : 0);
+        for (auto& heap : heaps) {
+            heap.clear();
+            heap.reserve(w);
+        }
+
+        float ip[MR * 16];
+        for (size_t p0 = 0; p0 < npanel; p0 += BP) {
+            const size_t p1 = std::min(npanel, p0 + BP);
+            for (size_t r0 = 0; r0 < bx; r0 += MR) {
+                const size_t nr = std::min(bx - r0, MR);
+                for (size_t p = p0; p < p1; ++p) {
+                    fvec_inner_product_panel_16(xf.data() + r0 * d, d, nr, centers.panel(p), d, ip);
+
+                    const float* cnorm = centers.norms() + p * 16;
+                    const size_t nc = std::min<size_t>(16, k - p * 16);
+                    for (size_t r = 0; r < nr; ++r) {
+                        float* dist = ip + r * 16;
+                        if (l2) {
+                            for (size_t c = 0; c < 16; ++c) dist[c] = xnorm[r0 + r] - 2 * dist[c] + cnorm[c];
+                        } else {
+                            for (size_t c = 0; c < 16; ++c) dist[c] = -dist[c];
+                        }
+
+                        const size_t i = r0 + r;
+                        if (w == 1) {
+                            for (size_t c = 0; c < nc; ++c) {
+                                if (dist[c] < best_dist[i]) {
+                                    best_dist[i] = dist[c];
+                                    best_id[i] = p * 16 + c;
+                                }
+                            }
+                            continue;
+                        }
+                        auto& heap = heaps[i];
+                        for (size_t c = 0; c < nc; ++c) {
+                            if (heap.size() < w) {
+                                heap.emplace_back(dist[c], p * 16 + c);
+                                std::push_heap(heap.begin(), heap.end());
+                            } else if (dist[c] < heap.front().first) {
+                                std::pop_heap(heap.begin(), heap.end());
+                                heap.back() = {dist[c], p * 16 + c};
+                                std::push_heap(heap.begin(), heap.end());
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // Rounding in the expanded form can make a tiny L2 distance negative
+        auto out_dist = [l2](float dist) { return l2 ? std::max(0.0f, dist) : dist; };
+        for (size_t i = 0; i < bx; ++i) {
+            size_t row = i0 + i;
+            if (w == 1) {
+                labels[row] = best_id[i];
+                if (dists != nullptr) dists[row] = out_dist(best_dist[i]);
+                continue;
+            }
+            auto& heap = heaps[i];
+            std::sort_heap(heap.begin(), heap.end());
+            for (size_t j = 0; j < w; ++j) {
+                labels[row * w + j] = heap[j].second;
+                if (dists != nullptr) dists[row * w + j] = out_dist(heap[j].first);
+            }
+        }
+    }
+}
+
+template<typename T>
+void NearestCenters(
+    const T* x, size_t n, size_t stride,
+    const CenterPanels& centers,
+    uint32_t* labels, float* dists,
+    MetricType metric
+)
+{
+    SearchCenters(x, n, stride, centers, 1, labels, dists, metric);
+}
+
+template<typename T>
+void TopWCenters(
+    const T* x, size_t n, size_t stride,
+    const CenterPanels& centers,
+    size_t w, uint32_t* labels, float* dists,
+    MetricType metric
+)
+{
+    SearchCenters(x, n, stride, centers, w, labels, dists, metric);
+}
+
+template<typename T>
+void CenterDistances(
+    const T* x, size_t n, size_t stride,
+    const CenterPanels& centers,
+    float* dists, size_t ldd,
+    MetricType metric
+)
+{
+    const size_t k = centers.k(), d = centers.d();
+    const bool l2 = metric == METRIC_L2;
+    const size_t npanel = centers.npanel();
+    const size_t ntile = (n + MR - 1) / MR;
+
+    // One kernel call per panel for MR vectors; the panels are read once per tile
+    #pragma omp parallel for schedule(dynamic) if (ntile > BX / MR)
+    for (size_t t = 0; t < ntile; ++t) {
+        const size_t i0 = t * MR;
+        const size_t nr = std::min(n, i0 + MR) - i0;
+
+        // Kept by each thread, like the tile of SearchCenters
+        thread_local std::vector<float> xf;
+        xf.resize(nr * d);
+        float* xt = xf.data();
+        float xnorm[MR];
+        for (size_t i = 0; i < nr; ++i) {
+            const T* xi = x + (i0 + i) * stride;
+            std::copy(xi, xi + d, xt + i * d);
+            xnorm[i] = l2 ? fvec_inner_product(xt + i * d, xt + i * d, d) : 0;
+        }
+
+        float ip[MR * 16];
+        for (size_t p = 0; p < npanel; ++p) {
+            fvec_inner_product_panel_16(xt, d, nr, centers.panel(p), d, ip);
+            const float* cnorm = centers.norms() + p * 16;
+            const size_t nc = std::min<size_t>(16, k - p * 16);
+            for (size_t r = 0; r < nr; ++r) {
+                float* out = dists + (i0 + r) * ldd + p * 16;
+                for (size_t c = 0; c < nc; ++c) {
+                    out[c] = l2 ? std::max(0.0f, xnorm[r] - 2 * ip[r * 16 + c] + cnorm[c]) : -ip[r * 16 + c];
+                }
+            }
+        }
+    }
+}
+
+void MultiSequence(
+    const float* d0, const float* d1, size_t L,
+    size_t w, uint32_t* pairs, float* dists,
+    MultiSequenceScratch& scratch
+)
+{
+    w = std::min(w, L * L);
+    if (w == 0) return;
+
+    // traversed[r0]: pairs of row r0 already out, which are the first ones of the row
+    auto& traversed = scratch.traversed;
+    auto& heap = scratch.heap;
+    const auto closer = std::greater<std::pair<float, uint32_t>>();
+    traversed.assign(L, 0);
+    heap.assign(1, {d0[0] + d1[0], 0});
+
+    for (size_t i = 0; i < w; ++i) {
+        std::pop_heap(heap.begin(), heap.end(), closer);
+        const auto [dist, pair] = heap.back();
+        heap.pop_back();
+        pairs[i] = pair;
+        if (dists) dists[i] = dist;
+
+        const uint32_t r0 = pair / L, r1 = pair % L;
+        traversed[r0] = r1 + 1;
+        if (r0 + 1 < L && (r1 == 0 || traversed[r0 + 1] >= r1)) {
+            heap.emplace_back(d0[r0 + 1] + d1[r1], (r0 + 1) * L + r1);
+            std::push_heap(heap.begin(), heap.end(), closer);
+        }
+        if (r1 + 1 < L && (r0 == 0 || traversed[r0 - 1] >= r1 + 2)) {
+            heap.emplace_back(d0[r0] + d1[r1 + 1], r0 * L + r1 + 1);
+            std::push_heap(heap.begin(), heap.end(), closer);
+        }
+    }
+}
+
+template void NearestCenters<float>(const float*, size_t, size_t, const CenterPanels&, uint32_t*, float*, MetricType);
+template void NearestCenters<uint8_t>(const uint8_t*, size_t, size_t, const CenterPanels&, uint32_t*, float*, MetricType);
+template void TopWCenters<float>(const float*, size_t, size_t, const CenterPanels&, size_t, uint32_t*, float*, MetricType);
+template void TopWCenters<uint8_t>(const uint8_t*, size_t, size_t, const CenterPanels&, size_t, uint32_t*, float*, MetricType);
+template void CenterDistances<float>(const float*, size_t, size_t, const CenterPanels&, float*, size_t, MetricType);
+template void CenterDistances<uint8_t>(const uint8_t*, size_t, size_t, const CenterPanels&, float*, size_t, MetricType);
@@ -1,7 +1,30 @@
 #include "distance.hpp"
 
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 
+// Per-function ISA selection. The kernels below are built for the given target
+// even when the rest of the library is compiled for a plain SSE4.2 baseline.
+#if defined(__GNUC__)
+#  define TOY_TARGET(isa) __attribute__((target(isa)))
+#else
+#  define TOY_TARGET(isa)
+#endif
+
+// The AVX512 intrinsics of GCC start some of their results from an undefined
+// register, which -Wall reports as uninitialized once they are inlined.
+// The AVX512 kernels are wrapped in these to silence that warning only there.
+#if defined(__GNUC__) && !defined(__clang__)
+#  define TOY_AVX512_BEGIN _Pragma("GCC diagnostic push") \
+    _Pragma("GCC diagnostic ignored \"-Wuninitialized\"") \
+    _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#  define TOY_AVX512_END _Pragma("GCC diagnostic pop")
+#else
+#  define TOY_AVX512_BEGIN
+#  define TOY_AVX512_END
+#endif
 
 
 float fvec_L2sqr_ref(const float *x, const float *y, size_t d)
@@ -60,13 +83,13 @@ static inline __m128i masked_read (int d, const uint8_t *x)
     return _mm_load_si128((const __m128i *)buf);
 }
 
-float fvec_L2sqr(const uint8_t *x, const uint8_t *y, size_t d) {
+static float fvec_L2sqr_u8_sse(const uint8_t *x, const uint8_t *y, size_t d) {
     __m128 msum = _mm_setzero_ps();
     const __m128i m128i_zero = _mm_setzero_si128();
 
     while (d >= 16) {
-        __m128i mx = _mm_load_si128((const __m128i *)x); x += 16;
-        __m128i my = _mm_load_si128((const __m128i *)y); y += 16;
+        __m128i mx = _mm_loadu_si128((const __m128i *)x); x += 16;
+        __m128i my = _mm_loadu_si128((const __m128i *)y); y += 16;
         __m128i lo_m_8i16 = _mm_subs_epi16(_mm_unpacklo_epi8(mx, m128i_zero), _mm_unpacklo_epi8(my, m128i_zero));
         __m128i hi_m_8i16 = _mm_subs_epi16(_mm_unpackhi_epi8(mx, m128i_zero), _mm_unpackhi_epi8(my, m128i_zero));
         __m128i lo_m_8i16_2 = _mm_mullo_epi16(lo_m_8i16, lo_m_8i16);
@@ -116,17 +139,6 @@ float fvec_L2sqr(const uint8_t *x, const uint8_t *y, size_t d) {
 //     return (float)res_;
 // }
 
-float fvec_L2sqr(const uint8_t *x, const float *y, size_t d)
-{
-    size_t i;
-    float res_ = 0;
-    for (i = 0; i < d; i++) {
-        const float tmp = (float)x[i] - y[i];
-        res_ += tmp * tmp;
-    }
-    return res_;
-}
-
 // ========================= Reading functions ============================
 
 // Reading function for SSE, AVX, and AVX512
@@ -155,10 +167,10 @@ static inline __m128 masked_read (int d, const float *x)
     // cannot use AVX2 _mm_mask_set1_epi32
 }
 
-#if defined(__AVX__)
 // Reading function for AVX and AVX512
 // This function is from Faiss
 // reads 0 <= d < 8 floats as __m256
+TOY_TARGET("avx")
 static inline __m256 masked_read_8 (int d, const float *x)
 {
     assert (0 <= d && d < 8);
@@ -174,13 +186,12 @@ static inline __m256 masked_read_8 (int d, const float *x)
     }
 }
 
-#endif // __AVX__
-
 
 
-#if defined(__AVX512F__) 
+TOY_AVX512_BEGIN
 // Reading function for AVX512
 // reads 0 <= d < 16 floats as __m512
+TOY_TARGET("avx512f,avx512dq")
 static inline __m512 masked_read_16 (int d, const float *x)
 {
     assert (0 <= d && d < 16);
@@ -195,17 +206,212 @@ static inline __m512 masked_read_16 (int d, const float *x)
         return res;
     }
 }
+TOY_AVX512_END
 
-#endif // __AVX512F__
 
 
 
-// ========================= Distance functions ============================
+// ===================== 8-bit integer distance functions =====================
+//
+// uint8 vectors (bvecs: SIFT10M/100M) are widened to int16 so that the difference
+// fits, and squared + pairwise-summed into int32 lanes by pmaddwd. With AVX512 VNNI
+// the multiply and the accumulation fuse into vpdpwssd. (vpdpbusd is not usable
+// here: it multiplies unsigned by signed bytes, and x - y needs 9 bits.)
+// The int32 lanes cannot overflow for d < 2^31 / 255^2, i.e. about 33k dimensions.
+
+// SSE4.1 implementation of the mixed uint8 x float distance
+static float fvec_L2sqr_u8f32_sse(const uint8_t *x, const float *y, size_t d)
+{
+    __m128 msum = _mm_setzero_ps();
+
+    while (d >= 4) {
+        int32_t x4;
+        std::memcpy(&x4, x, 4); x += 4;
+        __m128 mx = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(x4)));
+        __m128 my = _mm_loadu_ps(y); y += 4;
+        const __m128 a_m_b1 = _mm_sub_ps(mx, my);
+        msum = _mm_add_ps(msum, _mm_mul_ps(a_m_b1, a_m_b1));
+        d -= 4;
+    }
+
+    msum = _mm_hadd_ps (msum, msum);
+    msum = _mm_hadd_ps (msum, msum);
+    float res_ = _mm_cvtss_f32(msum);
+    for (size_t i = 0; i < d; i++) {
+        const float tmp = (float)x[i] - y[i];
+        res_ += tmp * tmp;
+    }
+    return res_;
+}
+
+TOY_TARGET("avx2")
+static inline int32_t reduce_add_epi32(__m256i v)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_hadd_epi32(s, s);
+    s = _mm_hadd_epi32(s, s);
+    return _mm_cvtsi128_si32(s);
+}
+
+// AVX2 implementation. 32 bytes per loop
+TOY_TARGET("avx2")
+static float fvec_L2sqr_u8_avx2(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    __m256i msum1 = _mm256_setzero_si256();
+    __m256i msum2 = _mm256_setzero_si256();
+
+    while (d >= 32) {
+        __m256i mx1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)x));
+        __m256i my1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)y));
+        __m256i mx2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(x + 16)));
+        __m256i my2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + 16)));
+        x += 32; y += 32;
+        const __m256i a_m_b1 = _mm256_sub_epi16(mx1, my1);
+        const __m256i a_m_b2 = _mm256_sub_epi16(mx2, my2);
+        msum1 = _mm256_add_epi32(msum1, _mm256_madd_epi16(a_m_b1, a_m_b1));
+        msum2 = _mm256_add_epi32(msum2, _mm256_madd_epi16(a_m_b2, a_m_b2));
+        d -= 32;
+    }
+
+    while (d > 0) {
+        // the last 1..31 values, 16 at a time
+        size_t dd = d < 16 ? d : 16;
+        __m256i mx = _mm256_cvtepu8_epi16(dd == 16 ? _mm_loadu_si128((const __m128i *)x) : masked_read(dd, x));
+        __m256i my = _mm256_cvtepu8_epi16(dd == 16 ? _mm_loadu_si128((const __m128i *)y) : masked_read(dd, y));
+        x += dd; y += dd;
+        const __m256i a_m_b1 = _mm256_sub_epi16(mx, my);
+        msum1 = _mm256_add_epi32(msum1, _mm256_madd_epi16(a_m_b1, a_m_b1));
+        d -= dd;
+    }
+
+    return (float)reduce_add_epi32(_mm256_add_epi32(msum1, msum2));
+}
+
+// AVX2 + FMA implementation of the mixed uint8 x float distance
+TOY_TARGET("avx2,fma")
+static float fvec_L2sqr_u8f32_avx2(const uint8_t *x, const float *y, size_t d)
+{
+    __m256 msum1 = _mm256_setzero_ps();
+
+    while (d >= 8) {
+        __m256 mx = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)x))); x += 8;
+        __m256 my = _mm256_loadu_ps (y); y += 8;
+        const __m256 a_m_b1 = _mm256_sub_ps(mx, my);
+        msum1 = _mm256_fmadd_ps(a_m_b1, a_m_b1, msum1);
+        d -= 8;
+    }
+
+    __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
+    msum2 = _mm_add_ps(msum2, _mm256_castps256_ps128(msum1));
+
+    if (d > 0) {
+        __m128i mx8 = masked_read(d, x);
+        __m256 mx = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(mx8));
+        __m256 my = masked_read_8(d, y);
+        const __m256 a_m_b1 = _mm256_sub_ps(mx, my);
+        const __m256 sq = _mm256_mul_ps(a_m_b1, a_m_b1);
+        msum2 = _mm_add_ps(msum2, _mm256_extractf128_ps(sq, 1));
+        msum2 = _mm_add_ps(msum2, _mm256_castps256_ps128(sq));
+    }
+
+    msum2 = _mm_hadd_ps (msum2, msum2);
+    msum2 = _mm_hadd_ps (msum2, msum2);
+    return  _mm_cvtss_f32 (msum2);
+}
+
+TOY_AVX512_BEGIN
+// AVX512BW implementation. 32 bytes per loop, widened to 32 x int16
+TOY_TARGET("avx512f,avx512bw,avx512vl")
+static float fvec_L2sqr_u8_avx512(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    __m512i msum1 = _mm512_setzero_si512();
+
+    while (d >= 32) {
+        __m512i mx = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)x)); x += 32;
+        __m512i my = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)y)); y += 32;
+        const __m512i a_m_b1 = _mm512_sub_epi16(mx, my);
+        msum1 = _mm512_add_epi32(msum1, _mm512_madd_epi16(a_m_b1, a_m_b1));
+        d -= 32;
+    }
+
+    if (d > 0) {
+        const __mmask32 mask = (__mmask32)((1ULL << d) - 1);
+        __m512i mx = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, x));
+        __m512i my = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, y));
+        const __m512i a_m_b1 = _mm512_sub_epi16(mx, my);
+        msum1 = _mm512_add_epi32(msum1, _mm512_madd_epi16(a_m_b1, a_m_b1));
+    }
+
+    return (float)_mm512_reduce_add_epi32(msum1);
+}
+
+// AVX512 VNNI implementation. Same as above, with vpdpwssd doing madd + add
+TOY_TARGET("avx512f,avx512bw,avx512vl,avx512vnni")
+static float fvec_L2sqr_u8_avx512_vnni(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    __m512i msum1 = _mm512_setzero_si512();
+    __m512i msum2 = _mm512_setzero_si512();
+
+    while (d >= 64) {
+        __m512i mx1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)x));
+        __m512i my1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)y));
+        __m512i mx2 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(x + 32)));
+        __m512i my2 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(y + 32)));
+        x += 64; y += 64;
+        const __m512i a_m_b1 = _mm512_sub_epi16(mx1, my1);
+        const __m512i a_m_b2 = _mm512_sub_epi16(mx2, my2);
+        msum1 = _mm512_dpwssd_epi32(msum1, a_m_b1, a_m_b1);
+        msum2 = _mm512_dpwssd_epi32(msum2, a_m_b2, a_m_b2);
+        d -= 64;
+    }
+
+    while (d > 0) {
+        // the last 1..63 values, 32 at a time
+        size_t dd = d < 32 ? d : 32;
+        const __mmask32 mask = (__mmask32)((1ULL << dd) - 1);
+        __m512i mx = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, x));
+        __m512i my = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, y));
+        x += dd; y += dd;
+        const __m512i a_m_b1 = _mm512_sub_epi16(mx, my);
+        msum1 = _mm512_dpwssd_epi32(msum1, a_m_b1, a_m_b1);
+        d -= dd;
+    }
+
+    return (float)_mm512_reduce_add_epi32(_mm512_add_epi32(msum1, msum2));
+}
+
+// AVX512 implementation of the mixed uint8 x float distance
+TOY_TARGET("avx512f,avx512bw,avx512vl")
+static float fvec_L2sqr_u8f32_avx512(const uint8_t *x, const float *y, size_t d)
+{
+    __m512 msum1 = _mm512_setzero_ps();
+
+    while (d >= 16) {
+        __m512 mx = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)x))); x += 16;
+        __m512 my = _mm512_loadu_ps (y); y += 16;
+        const __m512 a_m_b1 = _mm512_sub_ps(mx, my);
+        msum1 = _mm512_fmadd_ps(a_m_b1, a_m_b1, msum1);
+        d -= 16;
+    }
 
-#if defined(__AVX512F__)  
+    if (d > 0) {
+        const __mmask16 mask = (__mmask16)((1U << d) - 1);
+        __m512 mx = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(mask, x)));
+        __m512 my = _mm512_maskz_loadu_ps(mask, y);
+        const __m512 a_m_b1 = _mm512_sub_ps(mx, my);
+        msum1 = _mm512_fmadd_ps(a_m_b1, a_m_b1, msum1);
+    }
+
+    return _mm512_reduce_add_ps(msum1);
+}
+TOY_AVX512_END
+
+// ========================= Distance functions ============================
 
+TOY_AVX512_BEGIN
 // AVX512 implementation by Yusuke
-float fvec_L2sqr (const float *x, const float *y, size_t d)
+TOY_TARGET("avx512f,avx512dq")
+static float fvec_L2sqr_avx512 (const float *x, const float *y, size_t d)
 {
     __m512 msum1 = _mm512_setzero_ps();
 
@@ -259,12 +465,12 @@ float fvec_L2sqr (const float *x, const float *y, size_t d)
     msum3 = _mm_hadd_ps (msum3, msum3);
     return  _mm_cvtss_f32 (msum3);
 }
-
-#elif defined (__AVX__)  
+TOY_AVX512_END
 
 // This function is from Faiss
 // AVX implementation
-float fvec_L2sqr (const float *x, const float *y, size_t d)
+TOY_TARGET("avx")
+static float fvec_L2sqr_avx (const float *x, const float *y, size_t d)
 {
     __m256 msum1 = _mm256_setzero_ps();
 
@@ -306,11 +512,9 @@ float fvec_L2sqr (const float *x, const float *y, size_t d)
     return  _mm_cvtss_f32 (msum2);
 }
 
-#else 
-
 // This function is from Faiss
 // SSE implementation. Unroot!
-float fvec_L2sqr(const float *x, const float *y, size_t d)
+static float fvec_L2sqr_sse(const float *x, const float *y, size_t d)
 {
     __m128 msum1 = _mm_setzero_ps();
 
@@ -340,6 +544,724 @@ float fvec_L2sqr(const float *x, const float *y, size_t d)
 }
 
 
+
+// ========================= Inner product functions ============================
+//
+// Same layout as the L2 kernels above, with x * y in place of (x - y)^2.
+
+float fvec_inner_product_ref(const float *x, const float *y, size_t d)
+{
+    size_t i;
+    float res_ = 0;
+    for (i = 0; i < d; i++) {
+        res_ += x[i] * y[i];
+    }
+    return res_;
+}
+
+static float fvec_inner_product_sse(const float *x, const float *y, size_t d)
+{
+    __m128 msum1 = _mm_setzero_ps();
+
+    while (d >= 4) {
+        __m128 mx = _mm_loadu_ps (x); x += 4;
+        __m128 my = _mm_loadu_ps (y); y += 4;
+        msum1 = _mm_add_ps(msum1, _mm_mul_ps(mx, my));
+        d -= 4;
+    }
+
+    if (d > 0) {
+        // add the last 1, 2 or 3 values
+        __m128 mx = masked_read (d, x);
+        __m128 my = masked_read (d, y);
+        msum1 = _mm_add_ps(msum1, _mm_mul_ps(mx, my));
+    }
+
+    msum1 = _mm_hadd_ps (msum1, msum1);
+    msum1 = _mm_hadd_ps (msum1, msum1);
+    return  _mm_cvtss_f32 (msum1);
+}
+
+TOY_TARGET("avx")
+static float fvec_inner_product_avx (const float *x, const float *y, size_t d)
+{
+    __m256 msum1 = _mm256_setzero_ps();
+
+    while (d >= 8) {
+        __m256 mx = _mm256_loadu_ps (x); x += 8;
+        __m256 my = _mm256_loadu_ps (y); y += 8;
+        msum1 = _mm256_add_ps(msum1, _mm256_mul_ps(mx, my));
+        d -= 8;
+    }
+
+    __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
+    msum2 =  _mm_add_ps(msum2, _mm256_extractf128_ps(msum1, 0));
+
+    if (d >= 4) {
+        __m128 mx = _mm_loadu_ps (x); x += 4;
+        __m128 my = _mm_loadu_ps (y); y += 4;
+        msum2 = _mm_add_ps(msum2, _mm_mul_ps(mx, my));
+        d -= 4;
+    }
+
+    if (d > 0) {
+        __m128 mx = masked_read (d, x);
+        __m128 my = masked_read (d, y);
+        msum2 = _mm_add_ps(msum2, _mm_mul_ps(mx, my));
+    }
+
+    msum2 = _mm_hadd_ps (msum2, msum2);
+    msum2 = _mm_hadd_ps (msum2, msum2);
+    return  _mm_cvtss_f32 (msum2);
+}
+
+TOY_AVX512_BEGIN
+TOY_TARGET("avx512f,avx512dq")
+static float fvec_inner_product_avx512 (const float *x, const float *y, size_t d)
+{
+    __m512 msum1 = _mm512_setzero_ps();
+
+    while (d >= 16) {
+        __m512 mx = _mm512_loadu_ps (x); x += 16;
+        __m512 my = _mm512_loadu_ps (y); y += 16;
+        msum1 = _mm512_fmadd_ps(mx, my, msum1);
+        d -= 16;
+    }
+
+    if (d > 0) {
+        __m512 mx = masked_read_16 (d, x);
+        __m512 my = masked_read_16 (d, y);
+        msum1 = _mm512_fmadd_ps(mx, my, msum1);
+    }
+
+    return _mm512_reduce_add_ps(msum1);
+}
+TOY_AVX512_END
+
+static float fvec_inner_product_u8_sse(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    __m128i msum = _mm_setzero_si128();
+
+    while (d > 0) {
+        size_t dd = d < 16 ? d : 16;
+        __m128i mx = dd == 16 ? _mm_loadu_si128((const __m128i *)x) : masked_read(dd, x);
+        __m128i my = dd == 16 ? _mm_loadu_si128((const __m128i *)y) : masked_read(dd, y);
+        x += dd; y += dd;
+        __m128i mx_lo = _mm_cvtepu8_epi16(mx);
+        __m128i my_lo = _mm_cvtepu8_epi16(my);
+        __m128i mx_hi = _mm_cvtepu8_epi16(_mm_srli_si128(mx, 8));
+        __m128i my_hi = _mm_cvtepu8_epi16(_mm_srli_si128(my, 8));
+        msum = _mm_add_epi32(msum, _mm_madd_epi16(mx_lo, my_lo));
+        msum = _mm_add_epi32(msum, _mm_madd_epi16(mx_hi, my_hi));
+        d -= dd;
+    }
+
+    msum = _mm_hadd_epi32(msum, msum);
+    msum = _mm_hadd_epi32(msum, msum);
+    return (float)_mm_cvtsi128_si32(msum);
+}
+
+TOY_TARGET("avx2")
+static float fvec_inner_product_u8_avx2(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    __m256i msum1 = _mm256_setzero_si256();
+
+    while (d > 0) {
+        size_t dd = d < 16 ? d : 16;
+        __m256i mx = _mm256_cvtepu8_epi16(dd == 16 ? _mm_loadu_si128((const __m128i *)x) : masked_read(dd, x));
+        __m256i my = _mm256_cvtepu8_epi16(dd == 16 ? _mm_loadu_si128((const __m128i *)y) : masked_read(dd, y));
+        x += dd; y += dd;
+        msum1 = _mm256_add_epi32(msum1, _mm256_madd_epi16(mx, my));
+        d -= dd;
+    }
+
+    return (float)reduce_add_epi32(msum1);
+}
+
+TOY_AVX512_BEGIN
+TOY_TARGET("avx512f,avx512bw,avx512vl")
+static float fvec_inner_product_u8_avx512(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    __m512i msum1 = _mm512_setzero_si512();
+
+    while (d > 0) {
+        size_t dd = d < 32 ? d : 32;
+        const __mmask32 mask = (__mmask32)((1ULL << dd) - 1);
+        __m512i mx = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, x));
+        __m512i my = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, y));
+        x += dd; y += dd;
+        msum1 = _mm512_add_epi32(msum1, _mm512_madd_epi16(mx, my));
+        d -= dd;
+    }
+
+    return (float)_mm512_reduce_add_epi32(msum1);
+}
+
+TOY_TARGET("avx512f,avx512bw,avx512vl,avx512vnni")
+static float fvec_inner_product_u8_avx512_vnni(const uint8_t *x, const uint8_t *y, size_t d)
+{
+    __m512i msum1 = _mm512_setzero_si512();
+
+    while (d > 0) {
+        size_t dd = d < 32 ? d : 32;
+        const __mmask32 mask = (__mmask32)((1ULL << dd) - 1);
+        __m512i mx = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, x));
+        __m512i my = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, y));
+        x += dd; y += dd;
+        msum1 = _mm512_dpwssd_epi32(msum1, mx, my);
+        d -= dd;
+    }
+
+    return (float)_mm512_reduce_add_epi32(msum1);
+}
+TOY_AVX512_END
+
+static float fvec_inner_product_u8f32_sse(const uint8_t *x, const float *y, size_t d)
+{
+    __m128 msum = _mm_setzero_ps();
+
+    while (d >= 4) {
+        int32_t x4;
+        std::memcpy(&x4, x, 4); x += 4;
+        __m128 mx = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(x4)));
+        __m128 my = _mm_loadu_ps(y); y += 4;
+        msum = _mm_add_ps(msum, _mm_mul_ps(mx, my));
+        d -= 4;
+    }
+
+    msum = _mm_hadd_ps (msum, msum);
+    msum = _mm_hadd_ps (msum, msum);
+    float res_ = _mm_cvtss_f32(msum);
+    for (size_t i = 0; i < d; i++) {
+        res_ += (float)x[i] * y[i];
+    }
+    return res_;
+}
+
+TOY_TARGET("avx2,fma")
+static float fvec_inner_product_u8f32_avx2(const uint8_t *x, const float *y, size_t d)
+{
+    __m256 msum1 = _mm256_setzero_ps();
+
+    while (d >= 8) {
+        __m256 mx = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)x))); x += 8;
+        __m256 my = _mm256_loadu_ps (y); y += 8;
+        msum1 = _mm256_fmadd_ps(mx, my, msum1);
+        d -= 8;
+    }
+
+    if (d > 0) {
+        __m256 mx = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(masked_read(d, x)));
+        __m256 my = masked_read_8(d, y);
+        msum1 = _mm256_fmadd_ps(mx, my, msum1);
+    }
+
+    __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
+    msum2 = _mm_add_ps(msum2, _mm256_castps256_ps128(msum1));
+    msum2 = _mm_hadd_ps (msum2, msum2);
+    msum2 = _mm_hadd_ps (msum2, msum2);
+    return  _mm_cvtss_f32 (msum2);
+}
+
+TOY_AVX512_BEGIN
+TOY_TARGET("avx512f,avx512bw,avx512vl")
+static float fvec_inner_product_u8f32_avx512(const uint8_t *x, const float *y, size_t d)
+{
+    __m512 msum1 = _mm512_setzero_ps();
+
+    while (d >= 16) {
+        __m512 mx = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)x))); x += 16;
+        __m512 my = _mm512_loadu_ps (y); y += 16;
+        msum1 = _mm512_fmadd_ps(mx, my, msum1);
+        d -= 16;
+    }
+
+    if (d > 0) {
+        const __mmask16 mask = (__mmask16)((1U << d) - 1);
+        __m512 mx = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(mask, x)));
+        __m512 my = _mm512_maskz_loadu_ps(mask, y);
+        msum1 = _mm512_fmadd_ps(mx, my, msum1);
+    }
+
+    return _mm512_reduce_add_ps(msum1);
+}
+TOY_AVX512_END
+
+// ========================= Panel inner products ============================
+//
+// Micro-kernel of the blocked center search (centroid_search.cpp): the inner products
+// of up to 8 vectors with a panel of 16 centers stored dimension-major.
+// Each step broadcasts one dimension of every vector and multiplies it with the
+// same dimension of the 16 centers, so no horizontal sum is ever needed and each
+// load of the panel is shared by all the vectors.
+
+static void fvec_inner_product_panel_16_ref(const float *x, size_t ldx, size_t nx,
+    const float *panel, size_t d, float *out)
+{
+    for (size_t r = 0; r < nx; r++) {
+        float acc[16] = {0};
+        for (size_t j = 0; j < d; j++) {
+            for (size_t c = 0; c < 16; c++) {
+                acc[c] += x[r * ldx + j] * panel[j * 16 + c];
+            }
+        }
+        std::memcpy(out + r * 16, acc, sizeof(acc));
+    }
+}
+
+// SSE: a panel row is 4 registers, so 2 vectors at a time
+template<int NX>
+static inline void fvec_inner_product_panel_16_sse_nx(const float *x, size_t ldx,
+    const float *panel, size_t d, float *out)
+{
+    __m128 acc[NX][4];
+    for (int r = 0; r < NX; r++) {
+        for (int c = 0; c < 4; c++) acc[r][c] = _mm_setzero_ps();
+    }
+    for (size_t j = 0; j < d; j++) {
+        const float *p = panel + j * 16;
+        __m128 p0 = _mm_loadu_ps(p), p1 = _mm_loadu_ps(p + 4);
+        __m128 p2 = _mm_loadu_ps(p + 8), p3 = _mm_loadu_ps(p + 12);
+        for (int r = 0; r < NX; r++) {
+            __m128 mx = _mm_set1_ps(x[r * ldx + j]);
+            acc[r][0] = _mm_add_ps(acc[r][0], _mm_mul_ps(mx, p0));
+            acc[r][1] = _mm_add_ps(acc[r][1], _mm_mul_ps(mx, p1));
+            acc[r][2] = _mm_add_ps(acc[r][2], _mm_mul_ps(mx, p2));
+            acc[r][3] = _mm_add_ps(acc[r][3], _mm_mul_ps(mx, p3));
+        }
+    }
+    for (int r = 0; r < NX; r++) {
+        for (int c = 0; c < 4; c++) _mm_storeu_ps(out + r * 16 + c * 4, acc[r][c]);
+    }
+}
+
+static void fvec_inner_product_panel_16_sse(const float *x, size_t ldx, size_t nx,
+    const float *panel, size_t d, float *out)
+{
+    for (; nx >= 2; nx -= 2, x += 2 * ldx, out += 32) {
+        fvec_inner_product_panel_16_sse_nx<2>(x, ldx, panel, d, out);
+    }
+    if (nx == 1) {
+        fvec_inner_product_panel_16_sse_nx<1>(x, ldx, panel, d, out);
+    }
+}
+
+// AVX2: a panel row is 2 registers, so 4 vectors at a time
+template<int NX>
+TOY_TARGET("avx2,fma")
+static inline void fvec_inner_product_panel_16_avx2_nx(const float *x, size_t ldx,
+    const float *panel, size_t d, float *out)
+{
+    __m256 acc[NX][2];
+    for (int r = 0; r < NX; r++) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    for (size_t j = 0; j < d; j++) {
+        __m256 p0 = _mm256_loadu_ps(panel + j * 16);
+        __m256 p1 = _mm256_loadu_ps(panel + j * 16 + 8);
+        for (int r = 0; r < NX; r++) {
+            __m256 mx = _mm256_broadcast_ss(x + r * ldx + j);
+            acc[r][0] = _mm256_fmadd_ps(mx, p0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(mx, p1, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < NX; r++) {
+        _mm256_storeu_ps(out + r * 16, acc[r][0]);
+        _mm256_storeu_ps(out + r * 16 + 8, acc[r][1]);
+    }
+}
+
+TOY_TARGET("avx2,fma")
+static void fvec_inner_product_panel_16_avx2(const float *x, size_t ldx, size_t nx,
+    const float *panel, size_t d, float *out)
+{
+    for (; nx >= 4; nx -= 4, x += 4 * ldx, out += 64) {
+        fvec_inner_product_panel_16_avx2_nx<4>(x, ldx, panel, d, out);
+    }
+    switch (nx) {
+        case 3: fvec_inner_product_panel_16_avx2_nx<3>(x, ldx, panel, d, out); break;
+        case 2: fvec_inner_product_panel_16_avx2_nx<2>(x, ldx, panel, d, out); break;
+        case 1: fvec_inner_product_panel_16_avx2_nx<1>(x, ldx, panel, d, out); break;
+    }
+}
+
+TOY_AVX512_BEGIN
+// AVX512: a panel row is 1 register, all 8 vectors at once
+template<int NX>
+TOY_TARGET("avx512f")
+static inline void fvec_inner_product_panel_16_avx512_nx(const float *x, size_t ldx,
+    const float *panel, size_t d, float *out)
+{
+    __m512 acc[NX];
+    for (int r = 0; r < NX; r++) acc[r] = _mm512_setzero_ps();
+    for (size_t j = 0; j < d; j++) {
+        __m512 p = _mm512_loadu_ps(panel + j * 16);
+        for (int r = 0; r < NX; r++) {
+            acc[r] = _mm512_fmadd_ps(_mm512_set1_ps(x[r * ldx + j]), p, acc[r]);
+        }
+    }
+    for (int r = 0; r < NX; r++) _mm512_storeu_ps(out + r * 16, acc[r]);
+}
+
+TOY_TARGET("avx512f")
+static void fvec_inner_product_panel_16_avx512(const float *x, size_t ldx, size_t nx,
+    const float *panel, size_t d, float *out)
+{
+    switch (nx) {
+        case 8: fvec_inner_product_panel_16_avx512_nx<8>(x, ldx, panel, d, out); break;
+        case 7: fvec_inner_product_panel_16_avx512_nx<7>(x, ldx, panel, d, out); break;
+        case 6: fvec_inner_product_panel_16_avx512_nx<6>(x, ldx, panel, d, out); break;
+        case 5: fvec_inner_product_panel_16_avx512_nx<5>(x, ldx, panel, d, out); break;
+        case 4: fvec_inner_product_panel_16_avx512_nx<4>(x, ldx, panel, d, out); break;
+        case 3: fvec_inner_product_panel_16_avx512_nx<3>(x, ldx, panel, d, out); break;
+        case 2: fvec_inner_product_panel_16_avx512_nx<2>(x, ldx, panel, d, out); break;
+        case 1: fvec_inner_product_panel_16_avx512_nx<1>(x, ldx, panel, d, out); break;
+    }
+}
+TOY_AVX512_END
+
+
+// ========================= 4-bit PQ fast scan ============================
+//
+// The 16 entries of a sub-space table fit in a 128-bit lane, so pshufb looks up
+// 16 codes at once, without touching memory. The uint8 results are widened into
+// 4 accumulators of uint16: vectors 0-7, 8-15 (low nibbles) and 16-23, 24-31
+// (high nibbles). Wider registers take one sub-space per 128-bit lane, and
+// their lanes are summed at the end of the block.
+
+static void pq4_accumulate_sse(const uint8_t *blocks, size_t nblock,
+    const uint8_t *lut, size_t M, uint16_t *out)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 32) {
+        __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+        for (size_t m = 0; m < M; m++) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(blocks + m * 16));
+            __m128i t = _mm_loadu_si128((const __m128i *)(lut + m * 16));
+            __m128i dlo = _mm_shuffle_epi8(t, _mm_and_si128(c, mask));
+            __m128i dhi = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(c, 4), mask));
+            acc0 = _mm_add_epi16(acc0, _mm_unpacklo_epi8(dlo, zero));
+            acc1 = _mm_add_epi16(acc1, _mm_unpackhi_epi8(dlo, zero));
+            acc2 = _mm_add_epi16(acc2, _mm_unpacklo_epi8(dhi, zero));
+            acc3 = _mm_add_epi16(acc3, _mm_unpackhi_epi8(dhi, zero));
+        }
+        _mm_storeu_si128((__m128i *)(out), acc0);
+        _mm_storeu_si128((__m128i *)(out + 8), acc1);
+        _mm_storeu_si128((__m128i *)(out + 16), acc2);
+        _mm_storeu_si128((__m128i *)(out + 24), acc3);
+    }
+}
+
+TOY_TARGET("avx2")
+static inline __m128i reduce_lanes_epi16(__m256i v)
+{
+    return _mm_add_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+TOY_TARGET("avx2")
+static void pq4_accumulate_avx2(const uint8_t *blocks, size_t nblock,
+    const uint8_t *lut, size_t M, uint16_t *out)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 32) {
+        __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+        for (size_t m = 0; m < M; m += 2) {
+            __m256i c = _mm256_loadu_si256((const __m256i *)(blocks + m * 16));
+            __m256i t = _mm256_loadu_si256((const __m256i *)(lut + m * 16));
+            __m256i dlo = _mm256_shuffle_epi8(t, _mm256_and_si256(c, mask));
+            __m256i dhi = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(c, 4), mask));
+            acc0 = _mm256_add_epi16(acc0, _mm256_unpacklo_epi8(dlo, zero));
+            acc1 = _mm256_add_epi16(acc1, _mm256_unpackhi_epi8(dlo, zero));
+            acc2 = _mm256_add_epi16(acc2, _mm256_unpacklo_epi8(dhi, zero));
+            acc3 = _mm256_add_epi16(acc3, _mm256_unpackhi_epi8(dhi, zero));
+        }
+        _mm_storeu_si128((__m128i *)(out), reduce_lanes_epi16(acc0));
+        _mm_storeu_si128((__m128i *)(out + 8), reduce_lanes_epi16(acc1));
+        _mm_storeu_si128((__m128i *)(out + 16), reduce_lanes_epi16(acc2));
+        _mm_storeu_si128((__m128i *)(out + 24), reduce_lanes_epi16(acc3));
+    }
+}
+
+TOY_AVX512_BEGIN
+TOY_TARGET("avx512f,avx512bw")
+static inline __m128i reduce_lanes_epi16(__m512i v)
+{
+    __m256i h = _mm256_add_epi16(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));
+    return _mm_add_epi16(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+}
+
+TOY_TARGET("avx512f,avx512bw")
+static void pq4_accumulate_avx512(const uint8_t *blocks, size_t nblock,
+    const uint8_t *lut, size_t M, uint16_t *out)
+{
+    const __m512i mask = _mm512_set1_epi8(0x0f);
+    const __m512i zero = _mm512_setzero_si512();
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 32) {
+        __m512i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+        for (size_t m = 0; m < M; m += 4) {
+            __m512i c = _mm512_loadu_si512((const void *)(blocks + m * 16));
+            __m512i t = _mm512_loadu_si512((const void *)(lut + m * 16));
+            __m512i dlo = _mm512_shuffle_epi8(t, _mm512_and_si512(c, mask));
+            __m512i dhi = _mm512_shuffle_epi8(t, _mm512_and_si512(_mm512_srli_epi16(c, 4), mask));
+            acc0 = _mm512_add_epi16(acc0, _mm512_unpacklo_epi8(dlo, zero));
+            acc1 = _mm512_add_epi16(acc1, _mm512_unpackhi_epi8(dlo, zero));
+            acc2 = _mm512_add_epi16(acc2, _mm512_unpacklo_epi8(dhi, zero));
+            acc3 = _mm512_add_epi16(acc3, _mm512_unpackhi_epi8(dhi, zero));
+        }
+        _mm_storeu_si128((__m128i *)(out), reduce_lanes_epi16(acc0));
+        _mm_storeu_si128((__m128i *)(out + 8), reduce_lanes_epi16(acc1));
+        _mm_storeu_si128((__m128i *)(out + 16), reduce_lanes_epi16(acc2));
+        _mm_storeu_si128((__m128i *)(out + 24), reduce_lanes_epi16(acc3));
+    }
+}
+TOY_AVX512_END
+
+
+// ========================= 8-bit PQ blocks ============================
+//
+// The 16 codes of a sub-space are contiguous, so one load gives 16 table indices.
+// They are widened to int32, offset by the sub-space table and gathered: the 16
+// (or 2 x 8) distances of the block add up in registers, one sub-space per step.
+
+static void pq8_accumulate_sse(const uint8_t *blocks, size_t nblock,
+    const float *table, size_t M, size_t ksub, float *out)
+{
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 16) {
+        float acc[16] = {0};
+        for (size_t m = 0; m < M; m++) {
+            const float *t = table + m * ksub;
+            for (size_t v = 0; v < 16; v++) {
+                acc[v] += t[blocks[m * 16 + v]];
+            }
+        }
+        std::memcpy(out, acc, sizeof(acc));
+    }
+}
+
+TOY_TARGET("avx2")
+static void pq8_accumulate_avx2(const uint8_t *blocks, size_t nblock,
+    const float *table, size_t M, size_t ksub, float *out)
+{
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 16) {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        __m256i offset = _mm256_setzero_si256();
+        const __m256i step = _mm256_set1_epi32(ksub);
+        for (size_t m = 0; m < M; m++) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(blocks + m * 16));
+            __m256i i0 = _mm256_add_epi32(_mm256_cvtepu8_epi32(c), offset);
+            __m256i i1 = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)), offset);
+            acc0 = _mm256_add_ps(acc0, _mm256_i32gather_ps(table, i0, 4));
+            acc1 = _mm256_add_ps(acc1, _mm256_i32gather_ps(table, i1, 4));
+            offset = _mm256_add_epi32(offset, step);
+        }
+        _mm256_storeu_ps(out, acc0);
+        _mm256_storeu_ps(out + 8, acc1);
+    }
+}
+
+TOY_AVX512_BEGIN
+TOY_TARGET("avx512f")
+static void pq8_accumulate_avx512(const uint8_t *blocks, size_t nblock,
+    const float *table, size_t M, size_t ksub, float *out)
+{
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 16) {
+        __m512 acc = _mm512_setzero_ps();
+        __m512i offset = _mm512_setzero_si512();
+        const __m512i step = _mm512_set1_epi32(ksub);
+        for (size_t m = 0; m < M; m++) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(blocks + m * 16));
+            __m512i idx = _mm512_add_epi32(_mm512_cvtepu8_epi32(c), offset);
+            acc = _mm512_add_ps(acc, _mm512_i32gather_ps(idx, table, 4));
+            offset = _mm512_add_epi32(offset, step);
+        }
+        _mm512_storeu_ps(out, acc);
+    }
+}
+TOY_AVX512_END
+
+
+// Quantized tables: the gathers read the 32-bit word at the entry (scale sizeof(Q))
+// and keep its low byte or half, little-endian
+
+template<typename Q>
+static void pq8_accumulate_int_sse(const uint8_t *blocks, size_t nblock,
+    const Q *table, size_t M, size_t ksub, uint32_t *out)
+{
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 16) {
+        uint32_t acc[16] = {0};
+        for (size_t m = 0; m < M; m++) {
+            const Q *t = table + m * ksub;
+            for (size_t v = 0; v < 16; v++) {
+                acc[v] += t[blocks[m * 16 + v]];
+            }
+        }
+        std::memcpy(out, acc, sizeof(acc));
+    }
+}
+
+template<typename Q>
+TOY_TARGET("avx2")
+static void pq8_accumulate_int_avx2(const uint8_t *blocks, size_t nblock,
+    const Q *table, size_t M, size_t ksub, uint32_t *out)
+{
+    const __m256i mask = _mm256_set1_epi32(sizeof(Q) == 1 ? 0xff : 0xffff);
+    const __m256i step = _mm256_set1_epi32(ksub);
+    const int *base = (const int *)table;
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 16) {
+        __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+        __m256i offset = _mm256_setzero_si256();
+        for (size_t m = 0; m < M; m++) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(blocks + m * 16));
+            __m256i i0 = _mm256_add_epi32(_mm256_cvtepu8_epi32(c), offset);
+            __m256i i1 = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)), offset);
+            acc0 = _mm256_add_epi32(acc0, _mm256_and_si256(_mm256_i32gather_epi32(base, i0, sizeof(Q)), mask));
+            acc1 = _mm256_add_epi32(acc1, _mm256_and_si256(_mm256_i32gather_epi32(base, i1, sizeof(Q)), mask));
+            offset = _mm256_add_epi32(offset, step);
+        }
+        _mm256_storeu_si256((__m256i *)out, acc0);
+        _mm256_storeu_si256((__m256i *)(out + 8), acc1);
+    }
+}
+
+TOY_AVX512_BEGIN
+template<typename Q>
+TOY_TARGET("avx512f")
+static void pq8_accumulate_int_avx512(const uint8_t *blocks, size_t nblock,
+    const Q *table, size_t M, size_t ksub, uint32_t *out)
+{
+    const __m512i mask = _mm512_set1_epi32(sizeof(Q) == 1 ? 0xff : 0xffff);
+    const __m512i step = _mm512_set1_epi32(ksub);
+    for (size_t b = 0; b < nblock; b++, blocks += M * 16, out += 16) {
+        __m512i acc = _mm512_setzero_si512();
+        __m512i offset = _mm512_setzero_si512();
+        for (size_t m = 0; m < M; m++) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(blocks + m * 16));
+            __m512i idx = _mm512_add_epi32(_mm512_cvtepu8_epi32(c), offset);
+            acc = _mm512_add_epi32(acc, _mm512_and_si512(_mm512_i32gather_epi32(idx, table, sizeof(Q)), mask));
+            offset = _mm512_add_epi32(offset, step);
+        }
+        _mm512_storeu_si512((void *)out, acc);
+    }
+}
+TOY_AVX512_END
+
+
+
+void fvec_normalize_L2(float *x, size_t d)
+{
+    float norm = std::sqrt(fvec_inner_product(x, x, d));
+    if (norm > 0) {
+        for (size_t i = 0; i < d; i++) {
+            x[i] /= norm;
+        }
+    }
+}
+
+
+
+// ========================= Runtime dispatch ============================
+
+static constexpr SimdKernels kPortableKernels = {
+    fvec_L2sqr_ref,
+    fvec_L2sqr_u8_sse,
+    fvec_L2sqr_u8f32_sse,
+    fvec_inner_product_ref,
+    fvec_inner_product_u8_sse,
+    fvec_inner_product_u8f32_sse,
+    fvec_inner_product_panel_16_ref,
+    pq4_accumulate_sse,
+    pq8_accumulate_sse,
+    pq8_accumulate_int_sse<uint8_t>,
+    pq8_accumulate_int_sse<uint16_t>,
+};
+
+SimdKernels g_simd_kernels = kPortableKernels;
+
+enum SimdLevel {
+    SIMD_SSE = 0, SIMD_AVX = 1, SIMD_AVX2 = 2, SIMD_AVX512 = 3, SIMD_AVX512_VNNI = 4
+};
+
+static SimdLevel DetectSimdLevel()
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+            && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+        return __builtin_cpu_supports("avx512vnni") ? SIMD_AVX512_VNNI : SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("avx")) {
+        return SIMD_AVX;
+    }
 #endif
+    return SIMD_SSE;
+}
+
+std::string BindSimdKernels(const char* cap)
+{
+    SimdLevel level = DetectSimdLevel();
+
+    if (cap != nullptr) {
+        SimdLevel cap_level = level;
+        if (std::strcmp(cap, "sse") == 0) cap_level = SIMD_SSE;
+        else if (std::strcmp(cap, "avx") == 0) cap_level = SIMD_AVX;
+        else if (std::strcmp(cap, "avx2") == 0) cap_level = SIMD_AVX2;
+        else if (std::strcmp(cap, "avx512") == 0) cap_level = SIMD_AVX512;
+        else if (std::strcmp(cap, "avx512_vnni") == 0) cap_level = SIMD_AVX512_VNNI;
+        if (cap_level < level) level = cap_level;
+    }
 
+    // The lower levels only override some of the kernels
+    g_simd_kernels = kPortableKernels;
+    switch (level) {
+        case SIMD_AVX512_VNNI:
+        case SIMD_AVX512:
+            g_simd_kernels.L2sqr = fvec_L2sqr_avx512;
+            g_simd_kernels.L2sqr_u8f32 = fvec_L2sqr_u8f32_avx512;
+            g_simd_kernels.inner_product = fvec_inner_product_avx512;
+            g_simd_kernels.inner_product_u8f32 = fvec_inner_product_u8f32_avx512;
+            g_simd_kernels.inner_product_panel_16 = fvec_inner_product_panel_16_avx512;
+            g_simd_kernels.pq4_accumulate = pq4_accumulate_avx512;
+            g_simd_kernels.pq8_accumulate = pq8_accumulate_avx512;
+            g_simd_kernels.pq8_accumulate_u8 = pq8_accumulate_int_avx512<uint8_t>;
+            g_simd_kernels.pq8_accumulate_u16 = pq8_accumulate_int_avx512<uint16_t>;
+            if (level == SIMD_AVX512_VNNI) {
+                g_simd_kernels.L2sqr_u8 = fvec_L2sqr_u8_avx512_vnni;
+                g_simd_kernels.inner_product_u8 = fvec_inner_product_u8_avx512_vnni;
+                return "avx512_vnni";
+            }
+            g_simd_kernels.L2sqr_u8 = fvec_L2sqr_u8_avx512;
+            g_simd_kernels.inner_product_u8 = fvec_inner_product_u8_avx512;
+            return "avx512";
+        case SIMD_AVX2:
+            g_simd_kernels.L2sqr = fvec_L2sqr_avx;
+            g_simd_kernels.L2sqr_u8 = fvec_L2sqr_u8_avx2;
+            g_simd_kernels.L2sqr_u8f32 = fvec_L2sqr_u8f32_avx2;
+            g_simd_kernels.inner_product = fvec_inner_product_avx;
+            g_simd_kernels.inner_product_u8 = fvec_inner_product_u8_avx2;
+            g_simd_kernels.inner_product_u8f32 = fvec_inner_product_u8f32_avx2;
+            g_simd_kernels.inner_product_panel_16 = fvec_inner_product_panel_16_avx2;
+            g_simd_kernels.pq4_accumulate = pq4_accumulate_avx2;
+            g_simd_kernels.pq8_accumulate = pq8_accumulate_avx2;
+            g_simd_kernels.pq8_accumulate_u8 = pq8_accumulate_int_avx2<uint8_t>;
+            g_simd_kernels.pq8_accumulate_u16 = pq8_accumulate_int_avx2<uint16_t>;
+            return "avx2";
+        case SIMD_AVX:
+            g_simd_kernels.L2sqr = fvec_L2sqr_avx;
+            g_simd_kernels.inner_product = fvec_inner_product_avx;
+            g_simd_kernels.inner_product_panel_16 = fvec_inner_product_panel_16_sse;
+            return "avx";
+        default:
+            g_simd_kernels.L2sqr = fvec_L2sqr_sse;
+            g_simd_kernels.inner_product = fvec_inner_product_sse;
+            g_simd_kernels.inner_product_panel_16 = fvec_inner_product_panel_16_sse;
+            return "sse";
+    }
+}
 
+const std::string g_simd_architecture = BindSimdKernels(std::getenv("TOY_SIMD"));
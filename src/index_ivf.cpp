@@ -1,34 +1,50 @@
 #include <index_ivf.hpp>
 
-using namespace toy;
+#include <cstdio>
+#include <limits>
 
-extern "C" {
-    void omp_init_lock(omp_lock_t *);
-    void omp_set_lock(omp_lock_t *);
-    void omp_unset_lock(omp_lock_t *);
-    void omp_destroy_lock(omp_lock_t *);
-}
+using namespace toy;
 
 IVFConfig::IVFConfig(
     size_t N, size_t D, size_t L, 
     size_t kc, 
     size_t mc, 
     size_t dc, 
-    std::string index_path, std::string db_path
+    std::string index_path, std::string db_path,
+    MetricType metric,
+    size_t spill,
+    float spill_ratio
 ) : N_(N), D_(D), L_(L), 
     kc(kc), mc(mc), dc(dc),
-    index_path(index_path), db_path(db_path)
+    index_path(index_path), db_path(db_path),
+    metric(metric), spill(spill), spill_ratio(spill_ratio)
 {}
 
 template <typename T>
 IndexIVF<T>::IndexIVF(const IVFConfig& cfg, size_t nq, bool verbose)
     : N_(cfg.N_), D_(cfg.D_), L_(cfg.L_), nq(nq), 
-    kc(cfg.kc), mc(cfg.mc), dc(cfg.dc)
+    kc(cfg.kc), mc(cfg.mc), dc(cfg.dc), metric_(cfg.metric),
+    spill_(std::max<size_t>(cfg.spill, 1)), spill_ratio_(cfg.spill_ratio), next_id_(0),
+    adaptive_(false), query_stats_(nq)
 {
     verbose_ = verbose;
-    assert(dc == D_ && mc == 1);
+    if ((mc != 1 && mc != 2) || dc * mc != D_) {
+        std::cerr << "Error. mc must be 1, or 2 for an inverted multi-index, with dc = D_ / mc.\n";
+        throw;
+    }
+    nlist_ = mc == 1 ? kc : kc * kc;
+    if (nlist_ > UINT32_MAX) {
+        std::cerr << "Error. kc^mc lists do not fit list ids of 32 bits.\n";
+        throw;
+    }
+
+    if (metric_ == METRIC_COSINE && !std::is_same<T, float>::value) {
+        std::cerr << "Error. METRIC_COSINE needs float vectors, use METRIC_INNER_PRODUCT on normalized data.\n";
+        throw;
+    }
 
     cq_ = nullptr;
+    cq_ef_search_ = 64;
 
     if (verbose_) {
         // Check which SIMD functions are used. See distance.hpp for this global variable.
@@ -61,49 +77,74 @@ void IndexIVF<T>::Train(const std::vector<T>& rawdata, int seed, size_t nsamples
                 rawdata.begin() + id * D_, rawdata.begin() + (id + 1) * D_);
     }
 
+    if (metric_ == METRIC_COSINE) {
+        *traindata = NormalizedCopy(traindata->data(), nsamples, D_);
+    }
+
     cq_ = std::make_unique<Quantizer::Quantizer<T>>(D_, nsamples, mc, kc, true);
-    cq_->fit(*traindata, 12, seed);
-    centers_cq_ = cq_->get_centroids()[0];      // Because mc == 1
+    cq_graph_.reset();
+    cq_->fit(*traindata, 12, seed, "++");
     labels_cq_ = cq_->GetAssignments()[0];
+    if (mc == 2) {
+        // The cells of the multi-index
+        const auto& assign1 = cq_->GetAssignments()[1];
+        for (size_t i = 0; i < labels_cq_.size(); ++i) labels_cq_[i] = labels_cq_[i] * kc + assign1[i];
+    }
 
     is_trained_ = true;
 }
 
-template <typename T> 
-void IndexIVF<T>::InsertIvf(const std::vector<T>& rawdata)
+template <typename T>
+void IndexIVF<T>::Train(const BatchReader<T>& reader, int seed, size_t batch_size, size_t nbatch)
 {
-    std::vector<omp_lock_t> locks(kc);
-
-    for (int i = 0; i < kc; ++i) {
-        omp_init_lock(&locks[i]);
+    if (verbose_) std::cout << "Training index with up to " << nbatch << " batches of " << batch_size << std::endl;
+
+    // Batches are normalized as they come for METRIC_COSINE (float only, see the constructor)
+    BatchReader<T> stream = reader;
+    if constexpr (std::is_same<T, float>::value) {
+        if (metric_ == METRIC_COSINE) {
+            stream = [&](float* buf, size_t n) {
+                size_t nread = reader(buf, n);
+                #pragma omp parallel for
+                for (size_t i = 0; i < nread; ++i) {
+                    fvec_normalize_L2(buf + i * D_, D_);
+                }
+                return nread;
+            };
+        }
     }
 
+    cq_ = std::make_unique<Quantizer::Quantizer<T>>(D_, 0, mc, kc, true);
+    cq_graph_.reset();
+    cq_->fit(stream, batch_size, nbatch, seed, "++");
+    labels_cq_.clear();
+
+    is_trained_ = true;
+}
+
+template <typename T> 
+void IndexIVF<T>::InsertIvf(const std::vector<T>& rawdata)
+{
     std::cerr << "Start to insert rawdata to IVF index" << std::endl;
     Timer timer_insert_ivf;
     timer_insert_ivf.Start();
 
-    #pragma omp parallel for
-    for (size_t n = 0; n < N_; ++n) {
-        // const auto& vec = NthRawVector(rawdata, n);
-        // int id = cq_->predict_one(vec.data(), 0);
-        int id = cq_->predict_one(rawdata.data() + n * D_, 0);
-        omp_set_lock(&locks[id]);
-        posting_lists_[id].emplace_back(n);
-        omp_unset_lock(&locks[id]);
-    }
-
-    for (int i = 0; i < kc; ++i) {
-        omp_destroy_lock(&locks[i]);
+    // Blocked assignment of all the vectors at once
+    std::vector<uint32_t> assign;
+    std::vector<idx_t> entry_ids;
+    std::vector<size_t> rows;
+    AssignEntries(rawdata.data(), N_, nullptr, 0, assign, entry_ids, rows);
+
+    // The vectors are stored in the lists as is, a spilled one in each of its lists
+    invlists_ = InvertedLists<T>(nlist_, D_);
+    if (rows.empty()) {
+        invlists_.Build(assign.data(), N_, rawdata.data(), entry_ids.data());
+    } else {
+        const auto& codes = GatherRows(rawdata.data(), D_, rows);
+        invlists_.Build(assign.data(), rows.size(), codes.data(), entry_ids.data());
     }
+    next_id_ = N_;
 
-    #pragma omp parallel for
-    for (size_t no = 0; no < kc; ++no) {
-        for (const auto& id : posting_lists_[no]) {
-            // const auto& nth_code = NthRawVector(rawdata, id);
-            // db_codes_[no].insert(db_codes_[no].end(), nth_code.begin(), nth_code.end());
-            db_codes_[no].insert(db_codes_[no].end(), rawdata.data() + id * D_, rawdata.data() + (id + 1) * D_);
-        }
-    }
     timer_insert_ivf.Stop();
     std::cerr << "Time of inserting rawdata to IVF index: " << timer_insert_ivf.GetTime() << " s" << std::endl;
 }
@@ -120,9 +161,9 @@ void IndexIVF<T>::LoadCqCodebook(std::string cq_codebook_path)
     std::string cq_suffix = "cq_";
 
     cq_ = std::make_unique<Quantizer::Quantizer<T>>(D_, 200'000, mc, kc, true);
+    cq_graph_.reset();
     cq_->Load(cq_codebook_path + cq_suffix);
 
-    centers_cq_ = cq_->get_centroids()[0];      // Because mc == 1
     std::cerr << "CQ codebook loaded.\n";
 }
 
@@ -130,31 +171,103 @@ template <typename T>
 void IndexIVF<T>::Populate(const std::vector<T>& rawdata)
 {
     assert(rawdata.size() / D_ == N_);
-    if (!is_trained_ || centers_cq_.empty()) {
+    if (!is_trained_ || cq_ == nullptr) {
         std::cerr << "Error. Train() must be called before running Populate(vecs=X).\n";
         throw;
     }
 
     if (verbose_) { std::cout << "Start to update posting lists" << std::endl; }
 
-    posting_lists_.clear();
-    posting_lists_.resize(kc);
-    db_codes_.clear();
-    db_codes_.resize(kc);
+    if (metric_ == METRIC_COSINE) {
+        InsertIvf(NormalizedCopy(rawdata.data(), N_, D_));
+    } else {
+        InsertIvf(rawdata);
+    }
+
+    if (verbose_) {
+        std::cout << N_ << " new vectors are added." << std::endl;
+    }
+}
+
+template <typename T>
+void IndexIVF<T>::Add(size_t n, const T* vecs, const idx_t* ids)
+{
+    if (!is_trained_ || cq_ == nullptr) {
+        std::cerr << "Error. Train() must be called before running Add(n, vecs).\n";
+        throw;
+    }
+    if (invlists_.nlist() == 0) {
+        invlists_ = InvertedLists<T>(nlist_, D_);
+    }
 
-    for (auto& posting_list : posting_lists_) {
-        posting_list.reserve(N_ / kc);  // Roughly malloc
+    std::vector<T> normalized;
+    if (metric_ == METRIC_COSINE) {
+        normalized = NormalizedCopy(vecs, n, D_);
+        vecs = normalized.data();
     }
-    for (auto& code : db_codes_) {
-        code.reserve(N_ / kc);  // Roughly malloc
+
+    std::vector<uint32_t> assign;
+    std::vector<idx_t> entry_ids;
+    std::vector<size_t> rows;
+    AssignEntries(vecs, n, ids, next_id_, assign, entry_ids, rows);
+    if (rows.empty()) {
+        invlists_.Add(assign.data(), n, vecs, entry_ids.data());
+    } else {
+        const auto& codes = GatherRows(vecs, D_, rows);
+        invlists_.Add(assign.data(), rows.size(), codes.data(), entry_ids.data());
     }
-    InsertIvf(rawdata);
+    next_id_ += n;
 
     if (verbose_) {
-        std::cout << N_ << " new vectors are added." << std::endl;
+        std::cout << n << " new vectors are added." << std::endl;
     }
 }
 
+template <typename T>
+void IndexIVF<T>::AssignEntries(const T* vecs, size_t n, const idx_t* ids, idx_t first_id,
+    std::vector<uint32_t>& assign, std::vector<idx_t>& entry_ids, std::vector<size_t>& rows) const
+{
+    if (spill_ == 1) {
+        assign.resize(n);
+        cq_->predict_cells(vecs, n, assign.data(), metric_);
+        rows.clear();
+        entry_ids.resize(n);
+        for (size_t i = 0; i < n; ++i) entry_ids[i] = ids ? ids[i] : first_id + i;
+        return;
+    }
+    cq_->spill_cells(vecs, n, spill_, spill_ratio_, assign, rows, metric_);
+    entry_ids.resize(rows.size());
+    for (size_t e = 0; e < rows.size(); ++e) {
+        entry_ids[e] = ids ? ids[rows[e]] : first_id + rows[e];
+    }
+}
+
+template <typename T>
+size_t IndexIVF<T>::Remove(size_t n, const idx_t* ids)
+{
+    std::lock_guard<std::mutex> update(guard_->update);
+    size_t nremoved = invlists_.Remove(ids, n);
+
+    if (verbose_) {
+        std::cout << nremoved << " vectors are removed." << std::endl;
+    }
+    return nremoved;
+}
+
+template <typename T>
+void IndexIVF<T>::Compact(float max_dead_fraction)
+{
+    std::lock_guard<std::mutex> update(guard_->update);
+    const size_t ndead = invlists_.ndead();
+    if (ndead == 0 || ndead <= max_dead_fraction * (invlists_.size() + ndead)) return;
+
+    // Searches go on over the current lists while the copy is made. The old lists are
+    // freed after the swap, once the lock is released
+    InvertedLists<T> compacted = invlists_.Compacted();
+    std::unique_lock<std::shared_mutex> swap(guard_->lists);
+    std::swap(invlists_, compacted);
+}
+
 template <typename T>
 void IndexIVF<T>::LoadIndex(std::string index_path)
 {
@@ -163,6 +276,14 @@ void IndexIVF<T>::LoadIndex(std::string index_path)
     }
 
     LoadCqCodebook(index_path);
+    if (std::ifstream(index_path + "cq_graph.bin").good()) {
+        cq_graph_ = std::make_unique<CentroidGraph>();
+        cq_graph_->Load(index_path + "cq_graph.bin", cq_->centroids(0));
+        if (cq_graph_->k() != kc || cq_graph_->d() != D_ || cq_graph_->metric() != metric_) {
+            std::cerr << "Error. The coarse graph does not match the coarse centers or the metric.\n";
+            throw;
+        }
+    }
 
     is_trained_ = true;
 }
@@ -175,11 +296,48 @@ void IndexIVF<T>::WriteIndex(std::string index_path)
     }
     std::string cq_suffix = "cq_";
     cq_->Write(index_path + cq_suffix);
+    // Without a graph, one left by an earlier index would be loaded with this one
+    if (cq_graph_ != nullptr) {
+        cq_graph_->Write(index_path + "cq_graph.bin");
+    } else {
+        std::remove((index_path + "cq_graph.bin").c_str());
+    }
+}
+
+template <typename T>
+void IndexIVF<T>::BuildCoarseGraph(size_t M, size_t ef_construction)
+{
+    if (cq_ == nullptr) {
+        std::cerr << "Coarse quantizer not initialized yet!" << std::endl;
+        throw;
+    }
+    if (mc != 1) {
+        std::cerr << "Error. The coarse graph needs mc == 1: the cells of a multi-index are searched by halves.\n";
+        throw;
+    }
+    Timer timer_graph;
+    timer_graph.Start();
+    cq_graph_ = std::make_unique<CentroidGraph>(cq_->centroids(0), kc, D_, metric_, M, ef_construction);
+    timer_graph.Stop();
+    std::cerr << "Time of building the coarse graph: " << timer_graph.GetTime() << " s" << std::endl;
+}
+
+template <typename T>
+void IndexIVF<T>::SearchLists(const T* query, size_t nprobe, SearchContext& ctx) const
+{
+    nprobe = std::min(nprobe, nlist_);
+    ctx.lists.resize(nprobe);
+    ctx.list_dists.resize(nprobe);
+    if (cq_graph_ != nullptr) {
+        cq_graph_->Search(query, nprobe, cq_ef_search_, ctx.lists.data(), ctx.list_dists.data(), ctx.graph);
+    } else {
+        cq_->search_cells(query, nprobe, ctx.lists.data(), ctx.list_dists.data(), ctx.cells, metric_);
+    }
 }
 
 template <typename T>
 void IndexIVF<T>::QueryBaseline(
-    const std::vector<T>& query,
+    const std::vector<T>& query_raw,
     std::vector<size_t>& nnid,
     std::vector<float>& dist,
     size_t& searched_cnt,
@@ -189,58 +347,72 @@ void IndexIVF<T>::QueryBaseline(
     int W
 ) 
 {
-    std::vector<std::pair<size_t, float>> scores_coarse(centers_cq_.size());
-    for (size_t no = 0; no < kc; ++no) {
-        scores_coarse[no] = {no, fvec_L2sqr(query.data(), centers_cq_[no].data(), D_)};
-    }
+    assert(query_raw.size() == D_);
+    SearchContext ctx;
+    std::vector<idx_t> ids(topk);
+    EarlyStop stop = early_stop_;
+    if (adaptive_ && stop.max_candidates == 0 && L > 0) stop.max_candidates = L;
+    SearchStats stats;
+    searched_cnt = Search(query_raw.data(), topk, W, ids.data(), dist.data(), ctx, stop, &stats);
+    std::copy_n(ids.begin(), topk, nnid.begin());
+    if (id >= 0 && (size_t)id < query_stats_.size()) query_stats_[id] = stats;
+}
 
-    W = std::min(W, (int)kc);
-    std::partial_sort(scores_coarse.begin(), scores_coarse.begin() + W, scores_coarse.end(),
-        [](const std::pair<size_t, float>& a, const std::pair<size_t, float>& b) {
-            return a.second < b.second;
+template <typename T>
+size_t IndexIVF<T>::Search(const T* query, size_t topk, size_t nprobe, idx_t* nnid, float* dist,
+    SearchContext& ctx, const EarlyStop& stop, SearchStats* stats) const
+{
+    // Compact may swap the lists in, but not while they are scanned
+    std::shared_lock<std::shared_mutex> scanning(guard_->lists);
+
+    if constexpr (std::is_same<T, float>::value) {
+        if (metric_ == METRIC_COSINE) {
+            ctx.query.assign(query, query + D_);
+            fvec_normalize_L2(ctx.query.data(), D_);
+            query = ctx.query.data();
         }
-    );
-
-    assert(query.size() == D_);
+    }
 
-    std::vector<std::pair<size_t, float>> scores;
-    scores.reserve(L);
-    size_t coarse_cnt = 0;
-    for (const auto& score_coarse : scores_coarse) {
-        size_t no = score_coarse.first;
-        size_t posting_lists_len = posting_lists_[no].size();
+    nprobe = std::min(nprobe, nlist_);
+    SearchLists(query, nprobe, ctx);
+
+    // Only the k nearest so far are kept, whatever the number of entries scanned
+    // A spilled vector can be met in several lists: its id is kept once
+    auto& collector = ctx.topk;
+    collector.Reset(topk, spill_ > 1);
+    size_t searched_cnt = 0;
+    ProbeMonitor monitor(stop, collector);
+    for (size_t i = 0; i < ctx.lists.size(); ++i) {
+        if (monitor.Stop(ctx.list_dists[i], searched_cnt)) break;
+        const auto list = invlists_.list(ctx.lists[i]);
+        size_t posting_lists_len = list.size;
+        const idx_t* ids = invlists_.ids(list);
+        const bool has_dead = list.ndead > 0;
 
         for (size_t idx = 0; idx < posting_lists_len; ++idx) {
-            const auto& n = posting_lists_[no][idx];
-            scores.emplace_back(n, fvec_L2sqr(query.data(), GetSingleCode(no, idx), D_));
+            if (has_dead && invlists_.is_dead(list, idx)) continue;
+            collector.Push(fvec_distance(metric_, query, GetSingleCode(list, idx), D_), ids[idx]);
+            searched_cnt++;
         }
+    }
 
-        coarse_cnt++;
-        if (coarse_cnt == W) {
-            searched_cnt = scores.size();
-            topk = std::min(topk, (int)searched_cnt);
-            std::partial_sort(scores.begin(), scores.begin() + topk, scores.end(),
-                [](const std::pair<size_t, float>& a, const std::pair<size_t, float>& b) {
-                    return a.second < b.second;
-                }
-            );
-            scores.resize(topk);
-            scores.shrink_to_fit();
-            for (size_t i = 0; i < scores.size(); ++i) {
-                const auto& [id, d] = scores[i];
-                nnid[i] = id;
-                dist[i] = d;
-            }
-            return;
-        }
+    if (stats) *stats = {monitor.nlist(), searched_cnt, monitor.reason()};
+
+    // Fewer than topk distinct ids may have been scanned: the slots left get no entry
+    size_t nfound = collector.Extract(nnid, dist);
+    std::fill(nnid + nfound, nnid + topk, -1);
+    std::fill(dist + nfound, dist + topk, std::numeric_limits<float>::infinity());
+    if (IsSimilarity(metric_)) {
+        for (size_t i = 0; i < topk; ++i) dist[i] = -dist[i];
     }
+    return searched_cnt;
 }
 
 template <typename T>
 const T*
-IndexIVF<T>::GetSingleCode(size_t list_no, size_t offset) const
+IndexIVF<T>::GetSingleCode(const typename InvertedLists<T>::ListRef& list, size_t offset) const
 {
-    return db_codes_[list_no].data() + offset * D_;
+    return invlists_.code(list, offset);
 }
 
 template<typename T>
@@ -1,15 +1,17 @@
 #include "index_ivfpq.hpp"
 
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <numeric>
 #include <unordered_set>
 
 using namespace toy;
 
-extern "C" {
-    void omp_init_lock(omp_lock_t *);
-    void omp_set_lock(omp_lock_t *);
-    void omp_unset_lock(omp_lock_t *);
-    void omp_destroy_lock(omp_lock_t *);
-}
+// Queries whose distance tables TopKId builds together: the rows of one panel kernel call
+static constexpr size_t DTABLE_BATCH = 8;
+// Memory for the distance tables of the queries TopKIdListMajor searches at once
+static constexpr size_t LIST_MAJOR_TABLE_BYTES = size_t(256) << 20;
 
 IVFPQConfig::IVFPQConfig(
     size_t N, size_t D, 
@@ -17,23 +19,64 @@ IVFPQConfig::IVFPQConfig(
     size_t kc, size_t kp, 
     size_t mc, size_t mp, 
     size_t dc, size_t dp, 
-    std::string index_path, std::string db_path
+    std::string index_path, std::string db_path,
+    MetricType metric,
+    CodeLayout layout,
+    TableType table,
+    bool by_residual,
+    size_t spill,
+    float spill_ratio
 ) : N_(N), D_(D), L_(L), 
     kc(kc), kp(kp), 
     mc(mc), mp(mp), 
     dc(dc), dp(dp), 
-    index_path(index_path), db_path(db_path)
+    index_path(index_path), db_path(db_path),
+    metric(metric), layout(layout), table(table), by_residual(by_residual),
+    spill(spill), spill_ratio(spill_ratio)
 {}
 
 template <typename T>
 IndexIVFPQ<T>::IndexIVFPQ(const IVFPQConfig& cfg, size_t nq, bool verbose)
     : N_(cfg.N_), D_(cfg.D_), L_(cfg.L_), nq(nq), 
-    kc(cfg.kc), kp(cfg.kp), mc(cfg.mc), mp(cfg.mp), dc(cfg.dc), dp(cfg.dp)
+    kc(cfg.kc), kp(cfg.kp), mc(cfg.mc), mp(cfg.mp), dc(cfg.dc), dp(cfg.dp), 
+    metric_(cfg.metric), by_residual_(cfg.by_residual),
+    spill_(std::max<size_t>(cfg.spill, 1)), spill_ratio_(cfg.spill_ratio), next_id_(0),
+    adaptive_(false), query_stats_(nq)
 {
     verbose_ = verbose;
-    assert(dc == D_ && mc == 1);
+    if ((mc != 1 && mc != 2) || dc * mc != D_) {
+        std::cerr << "Error. mc must be 1, or 2 for an inverted multi-index, with dc = D_ / mc.\n";
+        throw;
+    }
+    nlist_ = mc == 1 ? kc : kc * kc;
+    if (nlist_ > UINT32_MAX) {
+        std::cerr << "Error. kc^mc lists do not fit list ids of 32 bits.\n";
+        throw;
+    }
+
+    fast_scan_ = kp == 16;
+    table_ = fast_scan_ ? TABLE_FLOAT : cfg.table;
+    // The quantized tables are summed by pq8_accumulate, over blocks of 16 codes
+    block16_ = !fast_scan_ && (cfg.layout == CODE_LAYOUT_BLOCK_16 || table_ != TABLE_FLOAT);
+    code_size_ = fast_scan_ ? (mp + 1) / 2 : mp;
+    mp_fs_ = (mp + PQ4_M_ALIGN - 1) / PQ4_M_ALIGN * PQ4_M_ALIGN;
+    list_layout_ = fast_scan_ ? LIST_LAYOUT_PQ4_BLOCKS : block16_ ? LIST_LAYOUT_PQ8_BLOCKS : LIST_LAYOUT_ROW_MAJOR;
+
+    if (metric_ == METRIC_COSINE && !std::is_same<T, float>::value) {
+        std::cerr << "Error. METRIC_COSINE needs float vectors, use METRIC_INNER_PRODUCT on normalized data.\n";
+        throw;
+    }
+    if (by_residual_ && !std::is_same<T, float>::value) {
+        std::cerr << "Error. by_residual needs float vectors.\n";
+        throw;
+    }
+    if (by_residual_ && mp % mc != 0) {
+        std::cerr << "Error. by_residual needs the PQ sub-spaces in the halves of the multi-index: mp % mc == 0.\n";
+        throw;
+    }
 
     cq_ = nullptr;
+    cq_ef_search_ = 64;
     pq_ = nullptr;
 
     if (verbose_) {
@@ -67,15 +110,29 @@ void IndexIVFPQ<T>::Train(const std::vector<T>& rawdata, int seed, size_t nsampl
                 rawdata.begin() + id * D_, rawdata.begin() + (id + 1) * D_);
     }
 
+    if (metric_ == METRIC_COSINE) {
+        *traindata = NormalizedCopy(traindata->data(), nsamples, D_);
+    }
+
     cq_ = std::make_unique<Quantizer::Quantizer<T>>(D_, nsamples, mc, kc, true);
-    cq_->fit(*traindata, 12, seed);
-    centers_cq_ = cq_->get_centroids()[0];      // Because mc == 1
+    cq_graph_.reset();
+    cq_->fit(*traindata, 12, seed, "++");
     labels_cq_ = cq_->GetAssignments()[0];
+    if (mc == 2) {
+        // The cells of the multi-index
+        const auto& assign1 = cq_->GetAssignments()[1];
+        for (size_t i = 0; i < labels_cq_.size(); ++i) labels_cq_[i] = labels_cq_[i] * kc + assign1[i];
+    }
 
+    // With residuals, PQ is trained on what is left of the samples after their centroid
+    if (by_residual_) {
+        std::vector<uint32_t> assign(labels_cq_.begin(), labels_cq_.end());
+        *traindata = Residuals(traindata->data(), assign.data(), nsamples);
+    }
     pq_ = std::make_unique<Quantizer::Quantizer<T>>(D_, nsamples, mp, kp, true);
     pq_->fit(*traindata, 6, seed);
-    centers_pq_ = pq_->get_centroids();
     labels_pq_ = pq_->GetAssignments();
+    PrecomputeTable();
 
     is_trained_ = true;
 }
@@ -83,38 +140,23 @@ void IndexIVFPQ<T>::Train(const std::vector<T>& rawdata, int seed, size_t nsampl
 template <typename T> 
 void IndexIVFPQ<T>::InsertIvf(const std::vector<T>& rawdata)
 {
-    const auto& pqcodes = pq_->Encode(rawdata);
+    // Blocked assignment of all the vectors at once
+    std::vector<uint32_t> assign;
+    std::vector<idx_t> entry_ids;
+    std::vector<size_t> rows;
+    AssignEntries(rawdata.data(), N_, nullptr, 0, assign, entry_ids, rows);
 
-    std::vector<omp_lock_t> locks(kc);
-
-    for (int i = 0; i < kc; ++i) {
-        omp_init_lock(&locks[i]);
-    }
+    const auto& pqcodes = rows.empty() ? EncodePq(rawdata.data(), assign.data(), N_)
+                                       : EncodeEntries(rawdata.data(), N_, assign.data(), rows);
 
     std::cerr << "Start to insert pqcodes to IVFPQ index" << std::endl;
     Timer timer_insert_ivf;
     timer_insert_ivf.Start();
 
-    const auto rawdata_ptr = rawdata.data();
-    #pragma omp parallel for
-    for (size_t n = 0; n < N_; ++n) {
-        int id = cq_->predict_one(NthRawVector(rawdata_ptr, n), 0);
-        omp_set_lock(&locks[id]);
-        posting_lists_[id].emplace_back(n);
-        omp_unset_lock(&locks[id]);
-    }
-
-    for (int i = 0; i < kc; ++i) {
-        omp_destroy_lock(&locks[i]);
-    }
+    invlists_ = InvertedLists<uint8_t>(nlist_, code_size_, list_layout_, mp);
+    invlists_.Build(assign.data(), assign.size(), pqcodes.data(), entry_ids.data());
+    next_id_ = N_;
 
-    #pragma omp parallel for
-    for (size_t no = 0; no < kc; ++no) {
-        for (const auto& id : posting_lists_[no]) {
-            const auto& nth_code = pqcodes[id];
-            db_codes_[no].insert(db_codes_[no].end(), nth_code.begin(), nth_code.end());
-        }
-    }
     timer_insert_ivf.Stop();
     std::cerr << "Time of inserting pqcodes to IVFPQ index: " << timer_insert_ivf.GetTime() << " s" << std::endl;
 }
@@ -128,30 +170,35 @@ void IndexIVFPQ<T>::LoadFromBook(const std::vector<uint32_t>& book, std::string
         cluster_path += "/";
     }
 
-    size_t ncentroid = book.size();
-    posting_lists_.clear();
-    posting_lists_.resize(kc);
-    db_codes_.clear();
-    db_codes_.resize(kc);
-
     std::string prefix_vector = "pqcode_", prefix_id = "id_";
-    std::string suffix_vector = ".ui8vecs", suffix_id = ".uivecs";
-
+    std::string suffix_vector = ".ui8vecs", suffix_id = ".ulvecs", suffix_id32 = ".uivecs";
+
+    // The lists of the book are read one by one, then packed into the arena.
+    // The other lists are left empty, as are those of the book without files (written
+    // empty). Ids are 64-bit, files written before are 32-bit
+    std::vector<uint32_t> assign;
+    std::vector<idx_t> ids, list_ids;
+    std::vector<uint8_t> codes, list_codes;
     std::unordered_set<uint32_t> new_book_set(book.begin(), book.end());
-    for (size_t id = 0; id < kc; ++id) {
-        if (!posting_lists_[id].size()) continue;
-        if (new_book_set.count(id)) {
-            new_book_set.erase(id);
+    for (const auto& id : new_book_set) {
+        std::string id_name = cluster_path + prefix_id + std::to_string(id);
+        if (std::ifstream(id_name + suffix_id).good()) {
+            LoadFromFileBinary<idx_t>(list_ids, id_name + suffix_id);
+        } else if (std::ifstream(id_name + suffix_id32).good()) {
+            LoadFromFileBinary<uint32_t>(list_ids, id_name + suffix_id32);
         } else {
-            std::vector<uint32_t>().swap(posting_lists_[id]);
-            std::vector<uint8_t>().swap(db_codes_[id]);
+            continue;
         }
+        LoadFromFileBinary<uint8_t>(list_codes, cluster_path + prefix_vector + std::to_string(id) + suffix_vector);
+        assert(list_codes.size() == list_ids.size() * code_size_);
+        assign.insert(assign.end(), list_ids.size(), id);
+        ids.insert(ids.end(), list_ids.begin(), list_ids.end());
+        codes.insert(codes.end(), list_codes.begin(), list_codes.end());
     }
-
-    for (const auto& id : new_book_set) {
-        LoadFromFileBinary<uint32_t>(posting_lists_[id], cluster_path + prefix_id + std::to_string(id) + suffix_id);
-        LoadFromFileBinary<uint8_t>(db_codes_[id], cluster_path + prefix_vector + std::to_string(id) + suffix_vector);
-    }
+    invlists_ = InvertedLists<uint8_t>(nlist_, code_size_, list_layout_, mp);
+    invlists_.Build(assign.data(), assign.size(), codes.data(), ids.data());
+    next_id_ = 0;
+    for (idx_t id : ids) next_id_ = std::max(next_id_, id + 1);
 
     if (verbose_) {
         std::cout << N_ << " new vectors are added." << std::endl;
@@ -170,9 +217,10 @@ void IndexIVFPQ<T>::LoadCqCodebook(std::string cq_codebook_path)
     std::string cq_suffix = "cq_";
 
     cq_ = std::make_unique<Quantizer::Quantizer<T>>(D_, 200'000, mc, kc, true);
+    cq_graph_.reset();
     cq_->Load(cq_codebook_path + cq_suffix);
+    if (pq_ != nullptr) PrecomputeTable();
 
-    centers_cq_ = cq_->get_centroids()[0];      // Because mc == 1
     std::cerr << "CQ codebook loaded.\n";
 }
 
@@ -191,8 +239,8 @@ void IndexIVFPQ<T>::LoadPqCodebook(std::string pq_codebook_path)
     */
     pq_ = std::make_unique<Quantizer::Quantizer<T>>(D_, 200'000, mp, kp, true);
     pq_->Load(pq_codebook_path + pq_suffix);
+    if (cq_ != nullptr) PrecomputeTable();
 
-    centers_pq_ = pq_->get_centroids();
     std::cerr << "PQ codebook loaded.\n";
 }
 
@@ -209,29 +257,22 @@ void IndexIVFPQ<T>::TopWId(
         throw;
     }
     
-    topw.resize(queries.size(), std::vector<uint32_t>(w));
-
-    #pragma omp parallel for num_threads(num_threads)
-    for (size_t n = 0; n < queries.size(); ++n) {
-        const auto& query = queries[n];
-        assert(query.size() == D_);
-
-        std::vector<std::pair<size_t, float>> scores_coarse(centers_cq_.size());
-        for (size_t no = 0; no < kc; ++no) {
-            scores_coarse[no] = {no, fvec_L2sqr(query.data(), centers_cq_[no].data(), D_)};
-        }
-
-        std::partial_sort(scores_coarse.begin(), scores_coarse.begin() + w, scores_coarse.end(),
-            [](const std::pair<size_t, float>& a, const std::pair<size_t, float>& b) {
-                return a.second < b.second;
+    topw.resize(queries.size());
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        SearchContext ctx;
+        #pragma omp for
+        for (size_t n = 0; n < queries.size(); ++n) {
+            assert(queries[n].size() == D_);
+            std::vector<T> query_normalized;
+            if (metric_ == METRIC_COSINE) {
+                query_normalized = NormalizedCopy(queries[n].data(), 1, D_);
             }
-        );
+            const auto& query = metric_ == METRIC_COSINE ? query_normalized : queries[n];
 
-        scores_coarse.resize(w);
-        scores_coarse.shrink_to_fit();
-        for (size_t i = 0; i < w; ++i) {
-            size_t no = scores_coarse[i].first;
-            topw[n][i] = no;
+            SearchLists(query.data(), w, ctx);
+            topw[n] = ctx.lists;
         }
     }
 }
@@ -241,7 +282,7 @@ void IndexIVFPQ<T>::TopKId(
     int k, 
     const std::vector<std::vector<T>>& queries, 
     const std::vector<std::vector<uint32_t>>& topw, 
-    std::vector<std::vector<uint32_t>>& topk_id,
+    std::vector<std::vector<idx_t>>& topk_id,
     std::vector<std::vector<float>>& topk_dist,
     int num_threads
 )
@@ -251,43 +292,155 @@ void IndexIVFPQ<T>::TopKId(
         throw;
     }
 
+    std::shared_lock<std::shared_mutex> scanning(guard_->lists);
+
     topk_id.resize(queries.size());
     topk_dist.resize(queries.size());
+    query_stats_.resize(queries.size());
     
     size_t num_searched_cluster = 0;
     size_t num_searched_vector = 0;
 
-    #pragma omp parallel for\
-    reduction(+:num_searched_cluster, num_searched_vector) num_threads(num_threads)
-    for (size_t n = 0; n < queries.size(); ++n) {
-        const auto& query = queries[n];
-        // assert(query.size() == D_);
-        DistanceTable dtable = DTable(query);
+    // The tables of DTABLE_BATCH queries come from one product with the codebooks
+    const size_t nquery = queries.size();
+    #pragma omp parallel num_threads(num_threads) reduction(+:num_searched_cluster, num_searched_vector)
+    {
+        SearchContext ctx;
+        #pragma omp for schedule(dynamic)
+        for (size_t b = 0; b < nquery; b += DTABLE_BATCH) {
+            const size_t nbatch = std::min(DTABLE_BATCH, nquery - b);
+            std::vector<T> batch(nbatch * D_);
+            for (size_t i = 0; i < nbatch; ++i) {
+                assert(queries[b + i].size() == D_);
+                std::copy(queries[b + i].begin(), queries[b + i].end(), batch.begin() + i * D_);
+            }
+            if (metric_ == METRIC_COSINE) {
+                batch = NormalizedCopy(batch.data(), nbatch, D_);
+            }
+            const auto& dtables = DTables(batch.data(), nbatch);
+
+            for (size_t i = 0; i < nbatch; ++i) {
+                const size_t n = b + i;
+                const T* query = batch.data() + i * D_;
+                ctx.topk.Reset(k, spill_ > 1);
+                ProbeMonitor monitor(early_stop_, ctx.topk);
+                if (adaptive_) {
+                    // topw holds no distances: those of the lists, for distance_ratio
+                    ctx.list_dists.resize(topw[n].size());
+                    for (size_t j = 0; j < topw[n].size(); ++j) {
+                        ctx.list_dists[j] = CoarseDistance(query, topw[n][j]);
+                    }
+                }
+                size_t nscanned = ScanLists(query, dtables[i], topw[n].data(), topw[n].size(), ctx.topk, ctx,
+                    adaptive_ ? &monitor : nullptr, ctx.list_dists.data());
+                query_stats_[n] = {adaptive_ ? monitor.nlist() : topw[n].size(), nscanned, monitor.reason()};
+                num_searched_vector += nscanned;
+                num_searched_cluster += query_stats_[n].nlist;
+                topk_id[n].resize(ctx.topk.size());
+                topk_dist[n].resize(ctx.topk.size());
+                ctx.topk.Extract(topk_id[n].data(), topk_dist[n].data());
+                if (IsSimilarity(metric_)) {
+                    for (auto& d : topk_dist[n]) d = -d;
+                }
+            }
+        }
+    }
+    std::cerr << "num_searched_cluster: " << num_searched_cluster << '\n';
+    std::cerr << "num_searched_vector: " << num_searched_vector << '\n';
+}
 
-        std::vector<std::pair<uint32_t, float>> scores;
-        scores.reserve(L_);
-        for (const auto& no : topw[n]) {
-            // assert(no < 1000);
-            size_t posting_lists_len = posting_lists_[no].size();
-            num_searched_cluster++;
+template<typename T>
+void IndexIVFPQ<T>::TopKIdListMajor(
+    int k,
+    const std::vector<std::vector<T>>& queries,
+    const std::vector<std::vector<uint32_t>>& topw,
+    std::vector<std::vector<idx_t>>& topk_id,
+    std::vector<std::vector<float>>& topk_dist,
+    int num_threads
+)
+{
+    if (pq_ == nullptr || cq_ == nullptr) {
+        std::cerr << "Product quantizer not initialized yet!" << std::endl;
+        throw;
+    }
 
-            for (size_t idx = 0; idx < posting_lists_len; ++idx) {
-                const auto& n = posting_lists_[no][idx];
-                scores.emplace_back(n, ADist(dtable, no, idx));
-                num_searched_vector++;
+    std::shared_lock<std::shared_mutex> scanning(guard_->lists);
+
+    const size_t nquery = queries.size();
+    topk_id.assign(nquery, {});
+    topk_dist.assign(nquery, {});
+    size_t num_searched_cluster = 0;
+    size_t num_searched_vector = 0;
+
+    // The queries go by chunks, whose tables take at most LIST_MAJOR_TABLE_BYTES
+    const size_t chunk = std::max<size_t>(1, LIST_MAJOR_TABLE_BYTES / (mp * kp * sizeof(float)));
+    const int nt = num_threads > 0 ? num_threads : omp_get_max_threads();
+    for (size_t q0 = 0; q0 < nquery; q0 += chunk) {
+        const size_t nchunk = std::min(chunk, nquery - q0);
+        std::vector<T> batch(nchunk * D_);
+        for (size_t i = 0; i < nchunk; ++i) {
+            assert(queries[q0 + i].size() == D_);
+            std::copy(queries[q0 + i].begin(), queries[q0 + i].end(), batch.begin() + i * D_);
+        }
+        if (metric_ == METRIC_COSINE) {
+            batch = NormalizedCopy(batch.data(), nchunk, D_);
+        }
+        const auto& dtables = DTables(batch.data(), nchunk);
+        const auto& qtables = QuantizeTables(dtables);
+
+        // The (list, query) pairs, sorted: the queries of every list follow each other.
+        // Sorted rather than counted by list, as there may be 2^28 cells
+        std::vector<std::pair<uint32_t, uint32_t>> bucket;
+        for (size_t i = 0; i < nchunk; ++i) {
+            for (uint32_t no : topw[q0 + i]) bucket.emplace_back(no, i);
+        }
+        std::sort(bucket.begin(), bucket.end());
+        std::vector<size_t> offsets;
+        for (size_t b = 0; b < bucket.size(); ++b) {
+            if (b == 0 || bucket[b].first != bucket[b - 1].first) offsets.push_back(b);
+        }
+        offsets.push_back(bucket.size());
+
+        // The largest scans first, for the balance of the threads. order: the groups of bucket
+        std::vector<uint32_t> order(offsets.size() - 1);
+        std::iota(order.begin(), order.end(), 0);
+        auto work = [&](uint32_t g) {
+            return (offsets[g + 1] - offsets[g]) * invlists_.list_size(bucket[offsets[g]].first);
+        };
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return work(a) > work(b); });
+
+        // Every thread keeps the top k of each query over the lists it scans; a list
+        // is read once and stays in cache while all its queries scan it
+        std::vector<std::vector<TopK>> partial(nt, std::vector<TopK>(nchunk, TopK(k, spill_ > 1)));
+        #pragma omp parallel num_threads(nt) reduction(+:num_searched_cluster, num_searched_vector)
+        {
+            SearchContext ctx;
+            auto& heaps = partial[omp_get_thread_num()];
+            #pragma omp for schedule(dynamic)
+            for (size_t j = 0; j < order.size(); ++j) {
+                const uint32_t g = order[j];
+                const size_t n = offsets[g + 1] - offsets[g];
+                num_searched_vector += ScanListQueries(bucket[offsets[g]].first, bucket.data() + offsets[g], n,
+                    batch.data(), dtables, qtables, heaps, ctx);
+                num_searched_cluster += n;
             }
         }
-        size_t searched_cnt = std::min(scores.size(), (size_t)k);
-        std::partial_sort(scores.begin(), scores.begin() + searched_cnt, scores.end(),
-            [](const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b) {
-                return a.second < b.second;
+
+        #pragma omp parallel for num_threads(nt)
+        for (size_t i = 0; i < nchunk; ++i) {
+            TopK merged(k, spill_ > 1);
+            std::vector<std::pair<idx_t, float>> entries;
+            for (int t = 0; t < nt; ++t) {
+                partial[t][i].Extract(entries);
+                for (const auto& [id, d] : entries) merged.Push(d, id);
+            }
+            const size_t n = q0 + i;
+            topk_id[n].resize(merged.size());
+            topk_dist[n].resize(merged.size());
+            merged.Extract(topk_id[n].data(), topk_dist[n].data());
+            if (IsSimilarity(metric_)) {
+                for (auto& d : topk_dist[n]) d = -d;
             }
-        );
-        scores.resize(searched_cnt);
-        scores.shrink_to_fit();
-        for (const auto& [id, d] : scores) {
-            topk_id[n].emplace_back(id);
-            topk_dist[n].emplace_back(d);
         }
     }
     std::cerr << "num_searched_cluster: " << num_searched_cluster << '\n';
@@ -298,31 +451,101 @@ template<typename T>
 void IndexIVFPQ<T>::Populate(const std::vector<T>& rawdata)
 {
     assert(rawdata.size() / D_ == N_);
-    if (!is_trained_ || centers_cq_.empty()) {
+    if (!is_trained_ || cq_ == nullptr) {
         std::cerr << "Error. Train() must be called before running Populate(vecs=X).\n";
         throw;
     }
 
     if (verbose_) { std::cout << "Start to update posting lists" << std::endl; }
 
-    posting_lists_.clear();
-    posting_lists_.resize(kc);
-    db_codes_.clear();
-    db_codes_.resize(kc);
+    if (metric_ == METRIC_COSINE) {
+        InsertIvf(NormalizedCopy(rawdata.data(), N_, D_));
+    } else {
+        InsertIvf(rawdata);
+    }
+
+    if (verbose_) {
+        std::cout << N_ << " new vectors are added." << std::endl;
+    }
+}
 
-    for (auto& posting_list : posting_lists_) {
-        posting_list.reserve(N_ / kc);  // Roughly malloc
+template<typename T>
+void IndexIVFPQ<T>::Add(size_t n, const T* vecs, const idx_t* ids)
+{
+    if (!is_trained_ || cq_ == nullptr || pq_ == nullptr) {
+        std::cerr << "Error. Train() must be called before running Add(n, vecs).\n";
+        throw;
+    }
+    if (invlists_.nlist() == 0) {
+        invlists_ = InvertedLists<uint8_t>(nlist_, code_size_, list_layout_, mp);
     }
-    for (auto& code : db_codes_) {
-        code.reserve(N_ / kc);  // Roughly malloc
+
+    std::vector<T> normalized;
+    if (metric_ == METRIC_COSINE) {
+        normalized = NormalizedCopy(vecs, n, D_);
+        vecs = normalized.data();
     }
-    InsertIvf(rawdata);
+
+    std::vector<uint32_t> assign;
+    std::vector<idx_t> entry_ids;
+    std::vector<size_t> rows;
+    AssignEntries(vecs, n, ids, next_id_, assign, entry_ids, rows);
+    const auto& pqcodes = rows.empty() ? EncodePq(vecs, assign.data(), n)
+                                       : EncodeEntries(vecs, n, assign.data(), rows);
+
+    invlists_.Add(assign.data(), assign.size(), pqcodes.data(), entry_ids.data());
+    next_id_ += n;
 
     if (verbose_) {
-        std::cout << N_ << " new vectors are added." << std::endl;
+        std::cout << n << " new vectors are added." << std::endl;
     }
 }
 
+template<typename T>
+void IndexIVFPQ<T>::AssignEntries(const T* vecs, size_t n, const idx_t* ids, idx_t first_id,
+    std::vector<uint32_t>& assign, std::vector<idx_t>& entry_ids, std::vector<size_t>& rows) const
+{
+    if (spill_ == 1) {
+        assign.resize(n);
+        cq_->predict_cells(vecs, n, assign.data(), metric_);
+        rows.clear();
+        entry_ids.resize(n);
+        for (size_t i = 0; i < n; ++i) entry_ids[i] = ids ? ids[i] : first_id + i;
+        return;
+    }
+    cq_->spill_cells(vecs, n, spill_, spill_ratio_, assign, rows, metric_);
+    entry_ids.resize(rows.size());
+    for (size_t e = 0; e < rows.size(); ++e) {
+        entry_ids[e] = ids ? ids[rows[e]] : first_id + rows[e];
+    }
+}
+
+template<typename T>
+size_t IndexIVFPQ<T>::Remove(size_t n, const idx_t* ids)
+{
+    std::lock_guard<std::mutex> update(guard_->update);
+    size_t nremoved = invlists_.Remove(ids, n);
+
+    if (verbose_) {
+        std::cout << nremoved << " vectors are removed." << std::endl;
+    }
+    return nremoved;
+}
+
+template<typename T>
+void IndexIVFPQ<T>::Compact(float max_dead_fraction)
+{
+    std::lock_guard<std::mutex> update(guard_->update);
+    const size_t ndead = invlists_.ndead();
+    if (ndead == 0 || ndead <= max_dead_fraction * (invlists_.size() + ndead)) return;
+
+    // Searches go on over the current lists while the copy is made. The old lists are
+    // freed after the swap, once the lock is released
+    InvertedLists<uint8_t> compacted = invlists_.Compacted();
+    std::unique_lock<std::shared_mutex> swap(guard_->lists);
+    std::swap(invlists_, compacted);
+}
+
 template<typename T>
 void IndexIVFPQ<T>::LoadIndex(std::string index_path)
 {
@@ -331,6 +554,14 @@ void IndexIVFPQ<T>::LoadIndex(std::string index_path)
     }
 
     LoadCqCodebook(index_path);
+    if (std::ifstream(index_path + "cq_graph.bin").good()) {
+        cq_graph_ = std::make_unique<CentroidGraph>();
+        cq_graph_->Load(index_path + "cq_graph.bin", cq_->centroids(0));
+        if (cq_graph_->k() != kc || cq_graph_->d() != D_ || cq_graph_->metric() != metric_) {
+            std::cerr << "Error. The coarse graph does not match the coarse centers or the metric.\n";
+            throw;
+        }
+    }
     LoadPqCodebook(index_path);
 
     is_trained_ = true;
@@ -344,13 +575,50 @@ void IndexIVFPQ<T>::WriteIndex(std::string index_path)
     }
     std::string cq_suffix = "cq_", pq_suffix = "pq_";
     cq_->Write(index_path + cq_suffix);
+    // Without a graph, one left by an earlier index would be loaded with this one
+    if (cq_graph_ != nullptr) {
+        cq_graph_->Write(index_path + "cq_graph.bin");
+    } else {
+        std::remove((index_path + "cq_graph.bin").c_str());
+    }
     pq_->Write(index_path + pq_suffix);
 }
 
 
+template<typename T>
+void IndexIVFPQ<T>::BuildCoarseGraph(size_t M, size_t ef_construction)
+{
+    if (cq_ == nullptr) {
+        std::cerr << "Coarse quantizer not initialized yet!" << std::endl;
+        throw;
+    }
+    if (mc != 1) {
+        std::cerr << "Error. The coarse graph needs mc == 1: the cells of a multi-index are searched by halves.\n";
+        throw;
+    }
+    Timer timer_graph;
+    timer_graph.Start();
+    cq_graph_ = std::make_unique<CentroidGraph>(cq_->centroids(0), kc, D_, metric_, M, ef_construction);
+    timer_graph.Stop();
+    std::cerr << "Time of building the coarse graph: " << timer_graph.GetTime() << " s" << std::endl;
+}
+
+template<typename T>
+void IndexIVFPQ<T>::SearchLists(const T* query, size_t nprobe, SearchContext& ctx) const
+{
+    nprobe = std::min(nprobe, nlist_);
+    ctx.lists.resize(nprobe);
+    ctx.list_dists.resize(nprobe);
+    if (cq_graph_ != nullptr) {
+        cq_graph_->Search(query, nprobe, cq_ef_search_, ctx.lists.data(), ctx.list_dists.data(), ctx.graph);
+    } else {
+        cq_->search_cells(query, nprobe, ctx.lists.data(), ctx.list_dists.data(), ctx.cells, metric_);
+    }
+}
+
 template<typename T>
 void IndexIVFPQ<T>::QueryBaseline(
-    const std::vector<T>& query,
+    const std::vector<T>& query_raw,
     std::vector<size_t>& nnid,
     std::vector<float>& dist,
     size_t& searched_cnt,
@@ -360,58 +628,55 @@ void IndexIVFPQ<T>::QueryBaseline(
     int W
 )
 {
-    DistanceTable dtable = DTable(query);
-
-    std::vector<std::pair<size_t, float>> scores_coarse(centers_cq_.size());
-    for (size_t no = 0; no < kc; ++no) {
-        scores_coarse[no] = {no, fvec_L2sqr(query.data(), centers_cq_[no].data(), D_)};
-    }
-
-    W = std::min(W, (int)kc);
-    std::partial_sort(scores_coarse.begin(), scores_coarse.begin() + W, scores_coarse.end(),
-        [](const std::pair<size_t, float>& a, const std::pair<size_t, float>& b) {
-            return a.second < b.second;
-        }
-    );
-
-    // assert(query.size() == D_);
-
-    std::vector<std::pair<size_t, float>> scores;
-    scores.reserve(L);
-    size_t coarse_cnt = 0;
-    for (const auto& score_coarse : scores_coarse) {
-        size_t no = score_coarse.first;
-        size_t posting_lists_len = posting_lists_[no].size();
+    assert(query_raw.size() == D_);
+    SearchContext ctx;
+    std::vector<idx_t> ids(topk);
+    EarlyStop stop = early_stop_;
+    if (adaptive_ && stop.max_candidates == 0 && L > 0) stop.max_candidates = L;
+    SearchStats stats;
+    searched_cnt = Search(query_raw.data(), topk, W, ids.data(), dist.data(), ctx, stop, &stats);
+    std::copy_n(ids.begin(), topk, nnid.begin());
+    if (id >= 0 && (size_t)id < query_stats_.size()) query_stats_[id] = stats;
+}
 
-        for (size_t idx = 0; idx < posting_lists_len; ++idx) {
-            const auto& n = posting_lists_[no][idx];
-            scores.emplace_back(n, ADist(dtable, no, idx));
+template<typename T>
+size_t IndexIVFPQ<T>::Search(const T* query, size_t topk, size_t nprobe, idx_t* nnid, float* dist,
+    SearchContext& ctx, const EarlyStop& stop, SearchStats* stats) const
+{
+    // Compact may swap the lists in, but not while they are scanned
+    std::shared_lock<std::shared_mutex> scanning(guard_->lists);
+
+    if constexpr (std::is_same<T, float>::value) {
+        if (metric_ == METRIC_COSINE) {
+            ctx.query.assign(query, query + D_);
+            fvec_normalize_L2(ctx.query.data(), D_);
+            query = ctx.query.data();
         }
+    }
 
-        coarse_cnt++;
-        if (coarse_cnt == W) {
-            searched_cnt = scores.size();
-            topk = std::min(topk, (int)searched_cnt);
-            std::partial_sort(scores.begin(), scores.begin() + topk, scores.end(),
-                [](const std::pair<size_t, float>& a, const std::pair<size_t, float>& b) {
-                    return a.second < b.second;
-                }
-            );
-            scores.resize(topk);
-            scores.shrink_to_fit();
-            for (size_t i = 0; i < scores.size(); ++i) {
-                const auto& [id, d] = scores[i];
-                nnid[i] = id;
-                dist[i] = d;
-            }
-            return;
-        }
+    nprobe = std::min(nprobe, nlist_);
+    SearchLists(query, nprobe, ctx);
+
+    DTable(query, ctx.dtable);
+    // A spilled vector can be met in several lists: its id is kept once
+    ctx.topk.Reset(topk, spill_ > 1);
+    ProbeMonitor monitor(stop, ctx.topk);
+    size_t searched_cnt = ScanLists(query, ctx.dtable, ctx.lists.data(), nprobe, ctx.topk, ctx,
+        &monitor, ctx.list_dists.data());
+    if (stats) *stats = {monitor.nlist(), searched_cnt, monitor.reason()};
+    // Fewer than topk distinct ids may have been scanned: the slots left get no entry
+    size_t nfound = ctx.topk.Extract(nnid, dist);
+    std::fill(nnid + nfound, nnid + topk, -1);
+    std::fill(dist + nfound, dist + topk, std::numeric_limits<float>::infinity());
+    if (IsSimilarity(metric_)) {
+        for (size_t i = 0; i < topk; ++i) dist[i] = -dist[i];
     }
+    return searched_cnt;
 }
 
 template<typename T>
 void IndexIVFPQ<T>::QueryObs(
-    const std::vector<T>& query,
+    const std::vector<T>& query_raw,
     const std::vector<int>& gt,
     std::vector<size_t>& nnid,
     std::vector<float>& dist,
@@ -421,30 +686,47 @@ void IndexIVFPQ<T>::QueryObs(
     int id
 )
 {
-    std::vector<std::pair<size_t, float>> scores_coarse(centers_cq_.size());
-    DistanceTable dtable = DTable(query);
+    std::shared_lock<std::shared_mutex> scanning(guard_->lists);
+
+    std::vector<T> query_normalized;
+    if (metric_ == METRIC_COSINE) {
+        query_normalized = NormalizedCopy(query_raw.data(), 1, D_);
+    }
+    const std::vector<T>& query = metric_ == METRIC_COSINE ? query_normalized : query_raw;
+
+    // The lists without a record are empty
+    std::vector<std::pair<size_t, float>> scores_coarse;
+    DistanceTable dtable, list_table;
+    DTable(query.data(), dtable);
+    float coarse;
 
-    for (size_t no = 0; no < kc; ++no) {
-        scores_coarse[no] = {no, fvec_L2sqr(query.data(), centers_cq_[no].data(), D_)};
+    for (size_t no : invlists_.lists()) {
+        scores_coarse.emplace_back(no, CoarseDistance(query.data(), no));
     }
 
-    std::unordered_set<int> gt_set;
-    gt_set = std::unordered_set<int>(gt.begin(), gt.end());
+    std::unordered_set<idx_t> gt_set;
+    gt_set = std::unordered_set<idx_t>(gt.begin(), gt.end());
 
-    std::vector<std::pair<size_t, float>> scores;
-    scores.reserve(L);
+    TopK collector(topk, spill_ > 1);
+    searched_cnt = 0;
     int coarse_cnt = 0;
     printf("===== Query %d =====\n", id);
     for (const auto& score_coarse : scores_coarse) {
         size_t no = score_coarse.first;
-        size_t hit_count = 0, posting_lists_len = posting_lists_[no].size();
+        const auto list = invlists_.list(no);
+        size_t hit_count = 0, posting_lists_len = list.size;
+        const idx_t* ids = invlists_.ids(list);
+        const bool has_dead = list.ndead > 0;
+        const auto& table = ListTable(query.data(), dtable, no, list_table, coarse);
 
         for (size_t idx = 0; idx < posting_lists_len; ++idx) {
-            const auto& n = posting_lists_[no][idx];
+            if (has_dead && invlists_.is_dead(list, idx)) continue;
+            const auto& n = ids[idx];
             if (gt_set.count(n)) {
                 hit_count ++;
             }
-            scores.emplace_back(n, ADist(dtable, no, idx));
+            collector.Push(coarse + ADist(table, list, idx), n);
+            searched_cnt++;
         }
 
         std::cerr << std::fixed << std::setprecision(2) 
@@ -452,19 +734,12 @@ void IndexIVFPQ<T>::QueryObs(
 
         coarse_cnt++;
     }
-    searched_cnt = scores.size();
-    topk = std::min(topk, (int)searched_cnt);
-    std::partial_sort(scores.begin(), scores.begin() + topk, scores.end(),
-        [](const std::pair<size_t, float>& a, const std::pair<size_t, float>& b) {
-            return a.second < b.second;
-        }
-    );
-    scores.resize(topk);
-    scores.shrink_to_fit();
+    std::vector<std::pair<idx_t, float>> scores;
+    collector.Extract(scores);
     for (size_t i = 0; i < scores.size(); ++i) {
         const auto& [id, d] = scores[i];
         nnid[i] = id;
-        dist[i] = d;
+        dist[i] = IsSimilarity(metric_) ? -d : d;
     }
     return;
 }
@@ -502,15 +777,21 @@ void IndexIVFPQ<T>::WriteClusterVector()
     }
     std::string prefix = "pqcode_";
     std::string f_suffix = ".fvecs", ui8_suffix = ".ivecs";
-    std::vector<uint32_t> posting_lists_lens(kc);
-    for (size_t no = 0; no < kc; ++no) {
-        uint32_t posting_lists_len = posting_lists_[no].size();
+    // A file for every list with a record, the lengths of all of them
+    std::vector<uint32_t> posting_lists_lens(nlist_);
+    for (size_t no : invlists_.lists()) {
+        const auto list = invlists_.list(no);
+        uint32_t posting_lists_len = list.size;
         auto cluster_vector_name = dataset_name + prefix + std::to_string(no) + ui8_suffix;
-        WriteToFileBinary(db_codes_[no], {posting_lists_len, mp}, cluster_vector_name);
+        std::vector<uint8_t> codes(posting_lists_len * code_size_);
+        for (size_t idx = 0; idx < posting_lists_len; ++idx) {
+            invlists_.read_code(list, idx, codes.data() + idx * code_size_);
+        }
+        WriteToFileBinary(codes, {posting_lists_len, code_size_}, cluster_vector_name);
         posting_lists_lens[no] = posting_lists_len;
     }
 
-    WriteToFileBinary(posting_lists_lens, {1, kc}, dataset_name + "posting_lists_lens" + ui8_suffix);
+    WriteToFileBinary(posting_lists_lens, {1, nlist_}, dataset_name + "posting_lists_lens" + ui8_suffix);
 }
 
 template<typename T>
@@ -521,17 +802,22 @@ void IndexIVFPQ<T>::WriteClusterId()
         dataset_name += "/";
     }
     std::string prefix = "id_";
-    std::string f_suffix = ".fvecs", ui_suffix = ".uivecs";
-    for (size_t no = 0; no < kc; ++no) {
-        size_t posting_lists_len = posting_lists_[no].size();
-        auto cluster_id_name = dataset_name + prefix + std::to_string(no) + ui_suffix;
-        WriteToFileBinary(posting_lists_[no], {1, posting_lists_len}, cluster_id_name);
+    std::string f_suffix = ".fvecs", ul_suffix = ".ulvecs";
+    for (size_t no : invlists_.lists()) {
+        const auto list = invlists_.list(no);
+        size_t posting_lists_len = list.size;
+        auto cluster_id_name = dataset_name + prefix + std::to_string(no) + ul_suffix;
+        std::vector<idx_t> ids(invlists_.ids(list), invlists_.ids(list) + posting_lists_len);
+        WriteToFileBinary(ids, {1, posting_lists_len}, cluster_id_name);
     }
 }
 
 template<typename T>
 void IndexIVFPQ<T>::Finalize()
 {
+    // The lists are written without their dead entries
+    Compact();
+
     if (write_trainset_path_ != "") {
         WriteTrainset();
     }
@@ -552,19 +838,72 @@ void IndexIVFPQ<T>::ShowStatistics()
 }
 
 template<typename T>
-DistanceTable IndexIVFPQ<T>::DTable(const std::vector<T>& vec) const
+void IndexIVFPQ<T>::DTable(const T* vec, DistanceTable& dtable) const
 {
-    const auto& v = vec;
-    // Ds: Dimension of each sub-space
-    size_t Ds = centers_pq_[0][0].size();
-    // assert((size_t) v.size() == mp * Ds);
-    DistanceTable dtable(mp, kp);
-    for (size_t m = 0; m < mp; ++m) {
-        for (size_t ks = 0; ks < kp; ++ks) {
-            dtable.set_value(m, ks, fvec_L2sqr(&(v[m * Ds]), centers_pq_[m][ks].data(), Ds));
+    // With residuals, only the query term: -2 <x, r> for L2, -<x, r> for similarities
+    dtable.kp = kp;
+    dtable.data_.resize(mp * kp);
+    pq_->DistanceTables(vec, 1, dtable.data_.data(), by_residual_ ? METRIC_INNER_PRODUCT : metric_);
+    if (by_residual_ && metric_ == METRIC_L2) {
+        for (auto& t : dtable.data_) t *= 2;
+    }
+}
+
+template<typename T>
+std::vector<DistanceTable> IndexIVFPQ<T>::DTables(const T* vecs, size_t n) const
+{
+    // Same as DTable
+    std::vector<float> tables(n * mp * kp);
+    pq_->DistanceTables(vecs, n, tables.data(), by_residual_ ? METRIC_INNER_PRODUCT : metric_);
+    if (by_residual_ && metric_ == METRIC_L2) {
+        for (auto& t : tables) t *= 2;
+    }
+
+    std::vector<DistanceTable> dtables(n);
+    for (size_t i = 0; i < n; ++i) {
+        dtables[i].kp = kp;
+        dtables[i].data_.assign(tables.begin() + i * mp * kp, tables.begin() + (i + 1) * mp * kp);
+    }
+    return dtables;
+}
+
+template<typename T>
+void IndexIVFPQ<T>::PrecomputeTable()
+{
+    precomputed_.clear();
+    if (!by_residual_ || metric_ != METRIC_L2) return;
+
+    // The terms of a cell of the multi-index add up by halves: those of the center i of
+    // half h, for the msub PQ sub-spaces of the half, are at row h * kc + i
+    size_t Ds = pq_->sub_dim(), msub = mp / mc;
+    precomputed_.resize(mc * kc * msub * kp);
+    #pragma omp parallel for
+    for (size_t row = 0; row < mc * kc; ++row) {
+        const float* c = cq_->centroid(row / kc, row % kc);
+        for (size_t m = 0; m < msub; ++m) {
+            for (size_t ks = 0; ks < kp; ++ks) {
+                const float* r = pq_->centroid(row / kc * msub + m, ks);
+                precomputed_[(row * msub + m) * kp + ks] =
+                    fvec_inner_product(r, r, Ds) + 2 * fvec_inner_product(c + m * Ds, r, Ds);
+            }
         }
     }
-    return dtable;
+}
+
+template<typename T>
+std::vector<T> IndexIVFPQ<T>::Residuals(const T* vecs, const uint32_t* assign, size_t n) const
+{
+    std::vector<T> residuals(n * D_);
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t h = 0; h < mc; ++h) {
+            const float* c = cq_->centroid(h, cq_->cell_center(assign[i], h));
+            for (size_t j = h * dc; j < (h + 1) * dc; ++j) {
+                residuals[i * D_ + j] = vecs[i * D_ + j] - c[j - h * dc];
+            }
+        }
+    }
+    return residuals;
 }
 
 template<typename T>
@@ -670,10 +1009,19 @@ float IndexIVFPQ<T>::ADist(const DistanceTable& dtable, const std::vector<uint8_
 }
 
 template<typename T>
-float IndexIVFPQ<T>::ADist(const DistanceTable& dtable, size_t list_no, size_t offset) const
+float IndexIVFPQ<T>::ADist(const DistanceTable& dtable, const ListRef& list, size_t offset) const
 {
     float dist = 0;
-    auto code = db_codes_[list_no].data() + offset * mp;
+    // The blocked layouts are read in place
+    if (fast_scan_ || block16_) {
+        const uint8_t* block = invlists_.block(list, offset);
+        const size_t v = offset % invlists_.block_size();
+        for (size_t m = 0; m < mp; ++m) {
+            dist += dtable.get_value(m, fast_scan_ ? pq4_get_code(block, m, v) : pq8_get_code(block, m, v));
+        }
+        return dist;
+    }
+    auto code = invlists_.code(list, offset);
     for (size_t m = 0; m < mp; ++m) {
         uint8_t ks = code[m];
         dist += dtable.get_value(m, ks);
@@ -708,6 +1056,341 @@ float IndexIVFPQ<T>::ADist(const DistanceTable& dtable, size_t list_no, size_t o
     return dist;
 }
 
+template<typename T>
+std::vector<uint8_t> IndexIVFPQ<T>::EncodePq(const T* vecs, const uint32_t* assign, size_t n) const
+{
+    std::vector<T> residuals;
+    if (by_residual_) {
+        residuals = Residuals(vecs, assign, n);
+        vecs = residuals.data();
+    }
+    return fast_scan_ ? pq_->Encode4(vecs, n) : pq_->Encode(vecs, n);
+}
+
+template<typename T>
+std::vector<uint8_t> IndexIVFPQ<T>::EncodeEntries(const T* vecs, size_t n, const uint32_t* assign,
+    const std::vector<size_t>& rows) const
+{
+    // Without residuals, the code of a vector is the same in all its lists
+    if (!by_residual_) {
+        const auto& pqcodes = EncodePq(vecs, nullptr, n);
+        return GatherRows(pqcodes.data(), code_size_, rows);
+    }
+
+    // With residuals, it is not: the entries are encoded by chunks of their vectors
+    constexpr size_t chunk = 1 << 18;
+    std::vector<uint8_t> codes(rows.size() * code_size_);
+    for (size_t e0 = 0; e0 < rows.size(); e0 += chunk) {
+        std::vector<size_t> chunk_rows(rows.begin() + e0, rows.begin() + std::min(rows.size(), e0 + chunk));
+        const auto& entries = GatherRows(vecs, D_, chunk_rows);
+        const auto& pqcodes = EncodePq(entries.data(), assign + e0, chunk_rows.size());
+        std::copy(pqcodes.begin(), pqcodes.end(), codes.begin() + e0 * code_size_);
+    }
+    return codes;
+}
+
+template<typename T>
+template<typename Q>
+void IndexIVFPQ<T>::QuantizeTable(const DistanceTable& dtable, Q* table, float& bias, float& delta) const
+{
+    // Every table is shifted to start at 0. One step delta for all of them, so that
+    // their sums stay comparable; the widest table spans the whole range of Q
+    const size_t ksub = dtable.kp;
+    float span = 0;
+    bias = 0;
+    for (size_t m = 0; m < mp; ++m) {
+        const float* t = dtable.data_.data() + m * ksub;
+        const auto [mn, mx] = std::minmax_element(t, t + ksub);
+        bias += *mn;
+        span = std::max(span, *mx - *mn);
+    }
+    delta = span > 0 ? span / std::numeric_limits<Q>::max() : 1;
+
+    // Rounded by + 0.5 and truncation, as the entries are not negative
+    const float inv = 1 / delta;
+    for (size_t m = 0; m < mp; ++m) {
+        const float* t = dtable.data_.data() + m * ksub;
+        const float lo = *std::min_element(t, t + ksub);
+        for (size_t ks = 0; ks < ksub; ++ks) {
+            table[m * ksub + ks] = (Q)std::min((t[ks] - lo) * inv + 0.5f, (float)std::numeric_limits<Q>::max());
+        }
+    }
+}
+
+template<typename T>
+void IndexIVFPQ<T>::FastScanLut(const DistanceTable& dtable, uint8_t* lut, float& bias, float& delta) const
+{
+    // The sub-spaces past mp add 0
+    std::fill(lut + mp * 16, lut + mp_fs_ * 16, 0);
+    QuantizeTable(dtable, lut, bias, delta);
+}
+
+template<typename T>
+typename IndexIVFPQ<T>::QuantizedTables IndexIVFPQ<T>::QuantizeTables(const std::vector<DistanceTable>& dtables) const
+{
+    QuantizedTables qtables;
+    if (!fast_scan_ && table_ == TABLE_FLOAT) return qtables;
+
+    // Padded as in ScanLists, every table on 64 bytes
+    const size_t n = dtables.size();
+    qtables.bias.resize(n);
+    qtables.delta.resize(n);
+    if (fast_scan_) {
+        qtables.stride = mp_fs_ * 16;
+        qtables.lut.resize(n * qtables.stride);
+    } else if (table_ == TABLE_UINT8) {
+        qtables.stride = (mp * kp + 4 + 63) / 64 * 64;
+        qtables.lut.resize(n * qtables.stride);
+    } else {
+        qtables.stride = (mp * kp + 2 + 31) / 32 * 32;
+        qtables.table16.resize(n * qtables.stride);
+    }
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; ++i) {
+        if (fast_scan_) {
+            FastScanLut(dtables[i], qtables.lut.data() + i * qtables.stride, qtables.bias[i], qtables.delta[i]);
+        } else if (table_ == TABLE_UINT8) {
+            QuantizeTable(dtables[i], qtables.lut.data() + i * qtables.stride, qtables.bias[i], qtables.delta[i]);
+        } else {
+            QuantizeTable(dtables[i], qtables.table16.data() + i * qtables.stride, qtables.bias[i], qtables.delta[i]);
+        }
+    }
+    return qtables;
+}
+
+template<typename T>
+void IndexIVFPQ<T>::ListTerms(size_t list_no, DistanceTable& terms) const
+{
+    const size_t nterm = mp / mc * kp;
+    terms.kp = kp;
+    terms.data_.resize(mp * kp);
+    for (size_t h = 0; h < mc; ++h) {
+        const float* term = precomputed_.data() + (h * kc + cq_->cell_center(list_no, h)) * nterm;
+        std::copy_n(term, nterm, terms.data_.begin() + h * nterm);
+    }
+}
+
+template<typename T>
+void IndexIVFPQ<T>::FastScanList(const ListRef& list, const uint8_t* lut, std::vector<uint16_t>& acc) const
+{
+    size_t nblock = (list.size + PQ4_BLOCK_SIZE - 1) / PQ4_BLOCK_SIZE;
+    acc.resize(nblock * PQ4_BLOCK_SIZE);
+    pq4_accumulate(invlists_.codes(list), nblock, lut, mp_fs_, acc.data());
+}
+
+template<typename T>
+void IndexIVFPQ<T>::BlockScanList(const ListRef& list, const DistanceTable& dtable, std::vector<float>& dis) const
+{
+    size_t nblock = (list.size + PQ8_BLOCK_SIZE - 1) / PQ8_BLOCK_SIZE;
+    dis.resize(nblock * PQ8_BLOCK_SIZE);
+    pq8_accumulate(invlists_.codes(list), nblock, dtable.data_.data(), mp, kp, dis.data());
+}
+
+template<typename T>
+template<typename Q>
+void IndexIVFPQ<T>::QuantizedScanList(const ListRef& list, const Q* table, std::vector<uint32_t>& acc) const
+{
+    size_t nblock = (list.size + PQ8_BLOCK_SIZE - 1) / PQ8_BLOCK_SIZE;
+    acc.resize(nblock * PQ8_BLOCK_SIZE);
+    pq8_accumulate(invlists_.codes(list), nblock, table, mp, kp, acc.data());
+}
+
+template<typename T>
+float IndexIVFPQ<T>::CoarseDistance(const T* query, size_t list_no) const
+{
+    float dist = 0;
+    for (size_t h = 0; h < mc; ++h) {
+        dist += fvec_distance(metric_, query + h * dc, cq_->centroid(h, cq_->cell_center(list_no, h)), dc);
+    }
+    return dist;
+}
+
+template<typename T>
+const DistanceTable& IndexIVFPQ<T>::ListTable(const T* query, const DistanceTable& dtable, size_t list_no,
+    DistanceTable& list_table, float& coarse) const
+{
+    if (!by_residual_) {
+        coarse = 0;
+        return dtable;
+    }
+    coarse = CoarseDistance(query, list_no);
+    if (metric_ != METRIC_L2) return dtable;
+
+    // ||r||^2 + 2 <c, r> of the list, plus -2 <x, r> of the query
+    const size_t nterm = mp / mc * kp;
+    list_table.kp = kp;
+    list_table.data_.resize(mp * kp);
+    for (size_t h = 0; h < mc; ++h) {
+        const float* term = precomputed_.data() + (h * kc + cq_->cell_center(list_no, h)) * nterm;
+        for (size_t i = h * nterm; i < (h + 1) * nterm; ++i) {
+            list_table.data_[i] = dtable.data_[i] + term[i - h * nterm];
+        }
+    }
+    return list_table;
+}
+
+template<typename T>
+size_t IndexIVFPQ<T>::ScanLists(const T* query, const DistanceTable& dtable, const uint32_t* lists,
+    size_t n, TopK& topk, SearchContext& ctx, ProbeMonitor* monitor, const float* list_dists) const
+{
+    auto& list_table = ctx.list_table;
+    float coarse;
+    size_t nscanned = 0;
+
+    if (!fast_scan_ && table_ == TABLE_FLOAT) {
+        for (size_t i = 0; i < n; ++i) {
+            if (monitor && monitor->Stop(list_dists[i], nscanned)) break;
+            size_t no = lists[i];
+            const auto list = invlists_.list(no);
+            size_t posting_lists_len = list.size;
+            const idx_t* ids = invlists_.ids(list);
+            const bool has_dead = list.ndead > 0;
+            const auto& table = ListTable(query, dtable, no, list_table, coarse);
+
+            if (block16_) {
+                BlockScanList(list, table, ctx.dis);
+            }
+            for (size_t idx = 0; idx < posting_lists_len; ++idx) {
+                if (has_dead && invlists_.is_dead(list, idx)) continue;
+                topk.Push(coarse + (block16_ ? ctx.dis[idx] : ADist(table, list, idx)), ids[idx]);
+                nscanned++;
+            }
+        }
+        return nscanned;
+    }
+
+    // Quantized tables, made once, or for every list with residuals. The uint8 / uint16
+    // ones are padded, as pq8_accumulate reads 4 bytes at every entry
+    float bias, delta;
+    if (fast_scan_) {
+        ctx.lut.resize(mp_fs_ * 16);
+    } else if (table_ == TABLE_UINT8) {
+        ctx.lut.resize(mp * kp + 4);
+    } else {
+        ctx.table16.resize(mp * kp + 2);
+    }
+
+    // Each sum is within mp / 2 steps of its distance. An entry whose lower bound is past
+    // the k-th rescored distance so far is not among the k nearest. The others are rescored
+    // with the float table of their list
+    for (size_t i = 0; i < n; ++i) {
+        if (monitor && monitor->Stop(list_dists[i], nscanned)) break;
+        size_t no = lists[i];
+        const auto list = invlists_.list(no);
+        size_t posting_lists_len = list.size;
+        const idx_t* ids = invlists_.ids(list);
+        const bool has_dead = list.ndead > 0;
+        const auto& table = ListTable(query, dtable, no, list_table, coarse);
+
+        // A table of its own costs more to quantize than a list of fewer than kp entries
+        // to scan with the float table
+        if (!fast_scan_ && &table != &dtable && posting_lists_len < kp) {
+            BlockScanList(list, table, ctx.dis);
+            for (size_t idx = 0; idx < posting_lists_len; ++idx) {
+                if (has_dead && invlists_.is_dead(list, idx)) continue;
+                topk.Push(coarse + ctx.dis[idx], ids[idx]);
+                nscanned++;
+            }
+            continue;
+        }
+        if (i == 0 || &table != &dtable) {
+            if (fast_scan_) {
+                FastScanLut(table, ctx.lut.data(), bias, delta);
+            } else if (table_ == TABLE_UINT8) {
+                QuantizeTable(table, ctx.lut.data(), bias, delta);
+            } else {
+                QuantizeTable(table, ctx.table16.data(), bias, delta);
+            }
+        }
+        if (fast_scan_) {
+            FastScanList(list, ctx.lut.data(), ctx.acc16);
+        } else if (table_ == TABLE_UINT8) {
+            QuantizedScanList(list, ctx.lut.data(), ctx.acc);
+        } else {
+            QuantizedScanList(list, ctx.table16.data(), ctx.acc);
+        }
+
+        const float base = coarse + bias, err = delta * (mp / 2 + 1);
+        for (size_t idx = 0; idx < posting_lists_len; ++idx) {
+            if (has_dead && invlists_.is_dead(list, idx)) continue;
+            nscanned++;
+            float d = base + delta * (fast_scan_ ? ctx.acc16[idx] : ctx.acc[idx]);
+            if (d - err > topk.threshold()) continue;
+            topk.Push(coarse + ADist(table, list, idx), ids[idx]);
+        }
+    }
+    return nscanned;
+}
+
+template<typename T>
+size_t IndexIVFPQ<T>::ScanListQueries(size_t list_no, const std::pair<uint32_t, uint32_t>* pairs, size_t n,
+    const T* batch, const std::vector<DistanceTable>& dtables, const QuantizedTables& qtables,
+    std::vector<TopK>& heaps, SearchContext& ctx) const
+{
+    const auto list = invlists_.list(list_no);
+    const idx_t* ids = invlists_.ids(list);
+    const bool has_dead = list.ndead > 0;
+    float coarse;
+
+    if (!fast_scan_ && table_ == TABLE_FLOAT) {
+        for (size_t j = 0; j < n; ++j) {
+            const size_t i = pairs[j].second;
+            const auto& table = ListTable(batch + i * D_, dtables[i], list_no, ctx.list_table, coarse);
+            if (block16_) {
+                BlockScanList(list, table, ctx.dis);
+            }
+            for (size_t idx = 0; idx < list.size; ++idx) {
+                if (has_dead && invlists_.is_dead(list, idx)) continue;
+                heaps[i].Push(coarse + (block16_ ? ctx.dis[idx] : ADist(table, list, idx)), ids[idx]);
+            }
+        }
+        return n * (list.size - list.ndead);
+    }
+
+    // By residual with METRIC_L2, the table of the list for a query is that of the query
+    // plus the terms of the list. The entries are bounded with the quantized table of the
+    // query plus the sums of the terms, made once for all the queries, and the table of
+    // the list is only made for a query once one of them is rescored
+    const bool with_terms = by_residual_ && metric_ == METRIC_L2;
+    if (with_terms) {
+        ListTerms(list_no, ctx.list_terms);
+        if (fast_scan_) {
+            ctx.term_sums.resize(list.size);
+            for (size_t idx = 0; idx < list.size; ++idx) ctx.term_sums[idx] = ADist(ctx.list_terms, list, idx);
+        } else {
+            BlockScanList(list, ctx.list_terms, ctx.term_sums);
+        }
+    }
+
+    for (size_t j = 0; j < n; ++j) {
+        const size_t i = pairs[j].second;
+        const T* query = batch + i * D_;
+        if (fast_scan_) {
+            FastScanList(list, qtables.lut.data() + i * qtables.stride, ctx.acc16);
+        } else if (table_ == TABLE_UINT8) {
+            QuantizedScanList(list, qtables.lut.data() + i * qtables.stride, ctx.acc);
+        } else {
+            QuantizedScanList(list, qtables.table16.data() + i * qtables.stride, ctx.acc);
+        }
+
+        // As in ScanLists, and the terms within the one step of slack of err
+        coarse = by_residual_ ? CoarseDistance(query, list_no) : 0;
+        const DistanceTable* table = with_terms ? nullptr : &dtables[i];
+        const float base = coarse + qtables.bias[i], delta = qtables.delta[i], err = delta * (mp / 2 + 1);
+        auto& topk = heaps[i];
+        for (size_t idx = 0; idx < list.size; ++idx) {
+            if (has_dead && invlists_.is_dead(list, idx)) continue;
+            float d = base + delta * (fast_scan_ ? ctx.acc16[idx] : ctx.acc[idx]) + (with_terms ? ctx.term_sums[idx] : 0);
+            if (d - err > topk.threshold()) continue;
+            if (table == nullptr) {
+                table = &ListTable(query, dtables[i], list_no, ctx.list_table, coarse);
+            }
+            topk.Push(coarse + ADist(*table, list, idx), ids[idx]);
+        }
+    }
+    return n * (list.size - list.ndead);
+}
+
 template<typename T>
 const T*
 IndexIVFPQ<T>::NthRawVector(const T* long_code_ptr, size_t n) const
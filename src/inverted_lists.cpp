@@ -0,0 +1,284 @@
+#include "inverted_lists.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <numeric>
+#include <unordered_set>
+#include <omp.h>
+
+using namespace toy;
+
+template <typename C>
+InvertedLists<C>::InvertedLists(size_t nlist, size_t code_size, ListLayout layout, size_t M)
+    : nlist_(nlist), code_size_(code_size), layout_(layout), M_(M), offsets_(1, 0)
+{
+    if (layout_ != LIST_LAYOUT_ROW_MAJOR && !std::is_same<C, uint8_t>::value) {
+        std::cerr << "Error. The blocked layouts hold uint8_t PQ codes.\n";
+        throw;
+    }
+    if (layout_ == LIST_LAYOUT_PQ8_BLOCKS) {
+        assert(code_size_ == M_);
+        block_size_ = PQ8_BLOCK_SIZE;
+        block_code_size_ = M_ * PQ8_BLOCK_SIZE;
+    } else if (layout_ == LIST_LAYOUT_PQ4_BLOCKS) {
+        assert(code_size_ == (M_ + 1) / 2);
+        block_size_ = PQ4_BLOCK_SIZE;
+        block_code_size_ = (M_ + PQ4_M_ALIGN - 1) / PQ4_M_ALIGN * PQ4_M_ALIGN * 16;
+    } else {
+        block_size_ = 1;
+        block_code_size_ = code_size_;
+    }
+}
+
+template <typename C>
+void InvertedLists<C>::WriteCode(size_t slot, const C* code)
+{
+    C* block = block_at(slot);
+    const size_t v = slot % block_size_;
+    if constexpr (std::is_same<C, uint8_t>::value) {
+        if (layout_ == LIST_LAYOUT_PQ8_BLOCKS) {
+            for (size_t m = 0; m < M_; ++m) pq8_set_code(block, m, v, code[m]);
+            return;
+        }
+        if (layout_ == LIST_LAYOUT_PQ4_BLOCKS) {
+            // A byte holds the codes of two entries, which two chunks of Add may write
+            // at once: its nibbles are cleared and set atomically
+            const int shift = v / 16 * 4;
+            for (size_t m = 0; m < M_; ++m) {
+                std::atomic_ref<uint8_t> byte(block[m * 16 + v % 16]);
+                byte.fetch_and(~(0x0f << shift), std::memory_order_relaxed);
+                byte.fetch_or(((code[m / 2] >> (m % 2 * 4)) & 0x0f) << shift, std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+    std::copy_n(code, code_size_, block);
+}
+
+template <typename C>
+void InvertedLists<C>::CopyCode(const AlignedVector<C>& from, size_t src, size_t dst)
+{
+    const C* src_block = from.data() + src / block_size_ * block_code_size_;
+    C* dst_block = block_at(dst);
+    const size_t u = src % block_size_, v = dst % block_size_;
+    if constexpr (std::is_same<C, uint8_t>::value) {
+        if (layout_ == LIST_LAYOUT_PQ8_BLOCKS) {
+            for (size_t m = 0; m < M_; ++m) pq8_set_code(dst_block, m, v, pq8_get_code(src_block, m, u));
+            return;
+        }
+        if (layout_ == LIST_LAYOUT_PQ4_BLOCKS) {
+            for (size_t m = 0; m < M_; ++m) pq4_set_code(dst_block, m, v, pq4_get_code(src_block, m, u));
+            return;
+        }
+    }
+    std::copy_n(src_block, code_size_, dst_block);
+}
+
+template <typename C>
+void InvertedLists<C>::read_code(const ListRef& list, size_t offset, C* code) const
+{
+    const size_t slot = list.first + offset;
+    const C* block = block_at(slot);
+    const size_t v = slot % block_size_;
+    if constexpr (std::is_same<C, uint8_t>::value) {
+        if (layout_ == LIST_LAYOUT_PQ8_BLOCKS) {
+            for (size_t m = 0; m < M_; ++m) code[m] = pq8_get_code(block, m, v);
+            return;
+        }
+        if (layout_ == LIST_LAYOUT_PQ4_BLOCKS) {
+            std::fill(code, code + code_size_, 0);
+            for (size_t m = 0; m < M_; ++m) code[m / 2] |= pq4_get_code(block, m, v) << (m % 2 * 4);
+            return;
+        }
+    }
+    std::copy_n(block, code_size_, code);
+}
+
+template <typename C>
+void InvertedLists<C>::Reserve(const Counts& counts)
+{
+    bool fits = true;
+    for (size_t i = 0; i < counts.size() && fits; ++i) {
+        const size_t r = Find(counts[i].first);
+        fits = r < lists_.size() && lists_[r] == counts[i].first
+            && sizes_[r] + counts[i].second <= offsets_[r + 1] - offsets_[r];
+    }
+    if (fits) return;
+
+    // Lists that already hold entries are being appended to, so every list gets
+    // a quarter of its size as room, and the next Adds mostly write in place
+    *this = Relaid(counts, nstored_ > 0);
+}
+
+template <typename C>
+InvertedLists<C> InvertedLists<C>::Relaid(const Counts& counts, bool slack) const
+{
+    // The records and the lists of counts, merged in order. from[r]: the record new
+    // record r comes from, or none (the number of records)
+    const size_t nrecord = lists_.size();
+    InvertedLists<C> out(nlist_, code_size_, layout_, M_);
+    std::vector<uint32_t>& lists = out.lists_;
+    std::vector<size_t> from;
+    std::vector<size_t>& offsets = out.offsets_;
+    std::vector<size_t>& sizes = out.sizes_;
+    for (size_t r = 0, i = 0; r < nrecord || i < counts.size();) {
+        const uint32_t l = i == counts.size() || (r < nrecord && lists_[r] < counts[i].first)
+            ? lists_[r] : counts[i].first;
+        const size_t old = r < nrecord && lists_[r] == l ? r++ : nrecord;
+        const size_t count = i < counts.size() && counts[i].first == l ? counts[i++].second : 0;
+        const size_t live = old < nrecord ? sizes_[old] - dead_counts_[old] : 0;
+        const size_t need = live + count;
+        if (need == 0) continue;
+        lists.push_back(l);
+        from.push_back(old);
+        sizes.push_back(live);
+        offsets.push_back(offsets.back() + Room(need + (slack ? need / 4 : 0)));
+    }
+
+    // The lists start on a block in both arenas: without dead entries, a list is
+    // copied block by block
+    out.ids_.resize(offsets.back());
+    out.codes_.resize(offsets.back() / block_size_ * block_code_size_);
+    out.dead_counts_.assign(lists.size(), 0);
+    out.dead_.assign((offsets.back() + 63) / 64, 0);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t r = 0; r < lists.size(); ++r) {
+        const size_t old = from[r];
+        if (old == nrecord) continue;
+        const size_t src0 = offsets_[old], dst0 = offsets[r];
+        if (dead_counts_[old] == 0) {
+            std::copy_n(ids_.begin() + src0, sizes_[old], out.ids_.begin() + dst0);
+            std::copy_n(codes_.begin() + src0 / block_size_ * block_code_size_,
+                Room(sizes_[old]) / block_size_ * block_code_size_, out.codes_.begin() + dst0 / block_size_ * block_code_size_);
+            continue;
+        }
+        size_t dst = dst0;
+        for (size_t j = 0; j < sizes_[old]; ++j) {
+            size_t src = src0 + j;
+            if ((dead_[src >> 6] >> (src & 63)) & 1) continue;
+            out.ids_[dst] = ids_[src];
+            out.CopyCode(codes_, src, dst);
+            dst++;
+        }
+    }
+    out.nstored_ = nstored_ - ndead_;
+    return out;
+}
+
+template <typename C>
+void InvertedLists<C>::Add(const uint32_t* assign, size_t n, const C* codes, const idx_t* ids)
+{
+    // The entries go by chunks of INVLISTS_ADD_CHUNK, whatever the number of threads.
+    // order: the entries of every chunk sorted by list, stably. runs[c]: the lists chunk c
+    // touches and its entries in each, (list, count), then (list, first slot)
+    const size_t nchunk = (n + INVLISTS_ADD_CHUNK - 1) / INVLISTS_ADD_CHUNK;
+    std::vector<size_t> order(n);
+    std::vector<std::vector<std::pair<uint32_t, size_t>>> runs(nchunk);
+
+    // Pass 1: the runs of every chunk
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < nchunk; ++c) {
+        const size_t begin = c * INVLISTS_ADD_CHUNK, end = std::min(n, begin + INVLISTS_ADD_CHUNK);
+        std::iota(order.begin() + begin, order.begin() + end, begin);
+        std::stable_sort(order.begin() + begin, order.begin() + end,
+            [&](size_t a, size_t b) { return assign[a] < assign[b]; });
+        for (size_t i = begin; i < end; ++i) {
+            const uint32_t l = assign[order[i]];
+            assert(l < nlist_);
+            if (runs[c].empty() || runs[c].back().first != l) runs[c].emplace_back(l, 0);
+            runs[c].back().second++;
+        }
+    }
+
+    // The counts of the lists touched, from the runs, so that nothing here goes by nlist
+    Counts counts;
+    for (const auto& chunk_runs : runs) counts.insert(counts.end(), chunk_runs.begin(), chunk_runs.end());
+    std::sort(counts.begin(), counts.end());
+    size_t ncount = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (ncount > 0 && counts[ncount - 1].first == counts[i].first) {
+            counts[ncount - 1].second += counts[i].second;
+        } else {
+            counts[ncount++] = counts[i];
+        }
+    }
+    counts.resize(ncount);
+    Reserve(counts);
+
+    // Slots after the end of every list, chunk by chunk, so that the new entries of a
+    // list keep their order. Every list touched has a record now
+    std::vector<size_t> pos(lists_.size());
+    for (size_t r = 0; r < lists_.size(); ++r) pos[r] = offsets_[r] + sizes_[r];
+    for (auto& chunk_runs : runs) {
+        for (auto& [l, count] : chunk_runs) {
+            const size_t r = Find(l);
+            size_t first = pos[r];
+            pos[r] += count;
+            count = first;
+        }
+    }
+    for (size_t r = 0; r < lists_.size(); ++r) sizes_[r] = pos[r] - offsets_[r];
+
+    // Pass 2: every chunk copies its entries into its own slots, without locks
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < nchunk; ++c) {
+        size_t i = c * INVLISTS_ADD_CHUNK;
+        const size_t end = std::min(n, i + INVLISTS_ADD_CHUNK);
+        for (const auto& [l, first] : runs[c]) {
+            for (size_t slot = first; i < end && assign[order[i]] == l; ++i, ++slot) {
+                const size_t e = order[i];
+                ids_[slot] = ids[e];
+                WriteCode(slot, codes + e * code_size_);
+            }
+        }
+    }
+    nstored_ += n;
+}
+
+template <typename C>
+void InvertedLists<C>::Build(const uint32_t* assign, size_t n, const C* codes, const idx_t* ids)
+{
+    *this = InvertedLists<C>(nlist_, code_size_, layout_, M_);
+    Add(assign, n, codes, ids);
+}
+
+template <typename C>
+size_t InvertedLists<C>::Remove(const idx_t* ids, size_t n)
+{
+    std::unordered_set<idx_t> to_remove(ids, ids + n);
+    size_t nremoved = 0;
+
+    // Lists are split between the threads. Two lists may share a word of the bitmap,
+    // so bits are set atomically. Scans read the counts meanwhile: a list's count is
+    // added once, when its bits are set, and the total once at the end
+    #pragma omp parallel for schedule(dynamic) reduction(+:nremoved)
+    for (size_t r = 0; r < lists_.size(); ++r) {
+        const ListRef list{offsets_[r], sizes_[r], dead_counts_[r]};
+        const idx_t* list_ids = ids_.data() + list.first;
+        size_t nmarked = 0;
+        for (size_t j = 0; j < list.size; ++j) {
+            if (is_dead(list, j) || !to_remove.count(list_ids[j])) continue;
+            size_t slot = list.first + j;
+            uint64_t bit = uint64_t(1) << (slot & 63);
+            std::atomic_ref<uint64_t>(dead_[slot >> 6]).fetch_or(bit, std::memory_order_relaxed);
+            nmarked++;
+        }
+        if (nmarked > 0) {
+            std::atomic_ref<size_t>(dead_counts_[r]).fetch_add(nmarked, std::memory_order_relaxed);
+        }
+        nremoved += nmarked;
+    }
+    std::atomic_ref<size_t>(ndead_).fetch_add(nremoved, std::memory_order_relaxed);
+    return nremoved;
+}
+
+template <typename C>
+InvertedLists<C> InvertedLists<C>::Compacted() const
+{
+    return Relaid({}, true);
+}
+
+template class toy::InvertedLists<uint8_t>;
+template class toy::InvertedLists<float>;
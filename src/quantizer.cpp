@@ -1,8 +1,10 @@
 #include "quantizer.hpp"
 #include "kmeans.hpp"
+#include "centroid_search.hpp"
 #include "binary_io.hpp"
 #include "util.hpp"
 #include <algorithm>
+#include <cmath>
 #include <tuple>
 namespace Quantizer {
 
@@ -18,18 +20,8 @@ Quantizer<T>::Quantizer(size_t D, size_t N, size_t M, size_t K, bool verbose)
     assert(D_ % M_ == 0);
     Ds_ = D_ / M_;
 
-    if (M_ > 1 && K_ > 256) {
-        std::cerr << "Error. K_ is too large. "
-                  << "Currently, we only support PQ code with K_ <= 256 "
-                  << "so that each subspace is represented by uint8_t (8 bit)"
-                  << std::endl;
-        throw;
-    }
-
-    centers_.clear();
-    centers_.resize(M_, 
-                    std::vector<std::vector<float>>(K_, 
-                    std::vector<float>(Ds_)));
+    centers_.assign(M_ * K_ * Ds_, 0.0f);
+    UpdateCenterCache();
     assignments_.clear();
     assignments_.resize(M_, std::vector<int>(N_));
     assignments_.shrink_to_fit(); // If the previous fit malloced a long assignment array, shrink it.
@@ -37,16 +29,145 @@ Quantizer<T>::Quantizer(size_t D, size_t N, size_t M, size_t K, bool verbose)
 /**
  * @param vec:  shape = Ds_
  * @param m:    m-th subspace
+ * @param metric: METRIC_L2 picks the closest center, a similarity the one with the largest inner product
+*/
+template <typename T>
+uint32_t Quantizer<T>::predict_one(const T* vec, uint32_t m, MetricType metric)
+{
+    uint32_t label;
+    predict(vec, 1, m, &label, metric);
+    return label;
+}
+
+/**
+ * @param vecs:   n vectors of Ds_, contiguous
+ * @param labels: n ids of the closest center in the m-th subspace
 */
 template <typename T>
-uint32_t Quantizer<T>::predict_one(const T* vec, uint32_t m)
+void Quantizer<T>::predict(const T* vecs, size_t n, uint32_t m, uint32_t* labels, MetricType metric)
+{
+    NearestCenters(vecs, n, Ds_, panels_[m], labels, nullptr, metric);
+}
+
+/**
+ * @param vecs:   n vectors of Ds_, contiguous
+ * @param labels, dists: n x w, the w closest centers of each vector in the m-th subspace, closest first
+*/
+template <typename T>
+void Quantizer<T>::search(const T* vecs, size_t n, uint32_t m, size_t w, 
+                          uint32_t* labels, float* dists, MetricType metric)
+{
+    TopWCenters(vecs, n, Ds_, panels_[m], w, labels, dists, metric);
+}
+
+template <typename T>
+void Quantizer<T>::predict_cells(const T* vecs, size_t n, uint32_t* labels, MetricType metric) const
+{
+    assert(M_ <= 2);
+    NearestCenters(vecs, n, D_, panels_[0], labels, nullptr, metric);
+    if (M_ == 1) return;
+
+    std::vector<uint32_t> labels1(n);
+    NearestCenters(vecs + Ds_, n, D_, panels_[1], labels1.data(), nullptr, metric);
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; ++i) {
+        labels[i] = labels[i] * K_ + labels1[i];
+    }
+}
+
+template <typename T>
+void Quantizer<T>::search_cells(const T* vec, size_t w, uint32_t* labels, float* dists,
+                                MultiSequenceScratch& scratch, MetricType metric) const
+{
+    assert(M_ <= 2);
+    if (M_ == 1) {
+        TopWCenters(vec, 1, D_, panels_[0], w, labels, dists, metric);
+        return;
+    }
+
+    // A cell in the top w has both of its centers in the top w of their half
+    const size_t L = std::min(w, K_);
+    w = std::min(w, L * L);
+    scratch.labels.resize(2 * L);
+    scratch.dists.resize(2 * L);
+    scratch.pairs.resize(w);
+    for (size_t m = 0; m < 2; ++m) {
+        TopWCenters(vec + m * Ds_, 1, D_, panels_[m], L,
+                    scratch.labels.data() + m * L, scratch.dists.data() + m * L, metric);
+    }
+    MultiSequence(scratch.dists.data(), scratch.dists.data() + L, L, w, scratch.pairs.data(), dists, scratch);
+    for (size_t i = 0; i < w; ++i) {
+        labels[i] = scratch.labels[scratch.pairs[i] / L] * K_ + scratch.labels[L + scratch.pairs[i] % L];
+    }
+}
+
+template <typename T>
+void Quantizer<T>::search_cells(const T* vecs, size_t n, size_t w, uint32_t* labels, float* dists,
+                                MetricType metric) const
 {
-    std::pair<uint32_t, float> nearest_one = NearestCenter(vec, centers_[m]);
-    return nearest_one.first;
+    assert(w <= ncells());
+    if (M_ == 1) {
+        TopWCenters(vecs, n, D_, panels_[0], w, labels, dists, metric);
+        return;
+    }
+
+    #pragma omp parallel
+    {
+        MultiSequenceScratch scratch;
+        #pragma omp for schedule(dynamic, 64)
+        for (size_t i = 0; i < n; ++i) {
+            search_cells(vecs + i * D_, w, labels + i * w, dists + i * w, scratch, metric);
+        }
+    }
 }
 
 template <typename T>
-void Quantizer<T>::fit(const std::vector<T>& traindata, int iter, int seed) 
+void Quantizer<T>::spill_cells(const T* vecs, size_t n, size_t r, float ratio, std::vector<uint32_t>& cells,
+                               std::vector<size_t>& rows, MetricType metric) const
+{
+    r = std::max<size_t>(1, std::min(r, ncells()));
+    cells.clear();
+    rows.clear();
+    cells.reserve(n);
+    rows.reserve(n);
+
+    // By chunks, so the candidates take r entries of a chunk, not of n
+    constexpr size_t chunk = 1 << 16;
+    std::vector<uint32_t> labels(std::min(n, chunk) * r);
+    std::vector<float> dists(labels.size());
+    for (size_t i0 = 0; i0 < n; i0 += chunk) {
+        const size_t m = std::min(chunk, n - i0);
+        search_cells(vecs + i0 * D_, m, r, labels.data(), dists.data(), metric);
+        for (size_t i = 0; i < m; ++i) {
+            const float* d = dists.data() + i * r;
+            const float bound = d[0] + (ratio - 1) * std::abs(d[0]);
+            for (size_t j = 0; j < r && (j == 0 || d[j] <= bound); ++j) {
+                cells.push_back(labels[i * r + j]);
+                rows.push_back(i0 + i);
+            }
+        }
+    }
+}
+
+template <typename T>
+void Quantizer<T>::DistanceTables(const T* vecs, size_t n, float* tables, MetricType metric) const
+{
+    for (size_t m = 0; m < M_; ++m) {
+        CenterDistances(vecs + m * Ds_, n, D_, panels_[m], tables + m * K_, M_ * K_, metric);
+    }
+}
+
+template <typename T>
+void Quantizer<T>::UpdateCenterCache()
+{
+    panels_.clear();
+    for (size_t m = 0; m < M_; ++m) {
+        panels_.emplace_back(centroids(m), K_, Ds_);
+    }
+}
+
+template <typename T>
+void Quantizer<T>::fit(const std::vector<T>& traindata, int iter, int seed, const std::string& minit) 
 {
     assert(N_ == traindata.size() / D_);
     assert(K_ < N_ && "the number of training vector should be more than K_");
@@ -54,54 +175,89 @@ void Quantizer<T>::fit(const std::vector<T>& traindata, int iter, int seed)
     // srand(seed);
     if (verbose_) {
         printf("N_: %zu, M_: %zu, K_: %zu\n", N_, M_, K_);
-        std::cout << "iter: " << iter << ", seed: " << seed << std::endl;
+        std::cout << "iter: " << iter << ", seed: " << seed << ", minit: " << minit << std::endl;
     }
 
-    auto traindata_trim = traindata;
-    size_t Nt = traindata_trim.size() / D_;
-    std::vector<std::vector<T>> train_vecs(Nt, std::vector<T>(D_));
-
-    #pragma omp parallel for
-    for (size_t n = 0; n < Nt; ++n) {
-        std::copy(traindata_trim.begin() + n * D_, traindata_trim.begin() + (n + 1) * D_, 
-                    train_vecs[n].begin());
-    }
+    size_t Nt = traindata.size() / D_;
 
     // Perform k-means iterations for each subspace
-    for (int m = 0; m < M_; ++m) {
+    for (size_t m = 0; m < M_; ++m) {
         if (verbose_) {
             std::cout << "Training the subspace: " << m << " / " << M_ << std::endl;
         }
-        std::vector<std::vector<T>> vecs_sub(Nt, std::vector<T>(Ds_, 0.0));
+        std::vector<T> vecs_sub(Nt * Ds_);
         #pragma omp parallel for
-        for (int i = 0; i < Nt; ++i) {
-            std::copy(train_vecs[i].begin() + m * Ds_, train_vecs[i].begin() + (m + 1) * Ds_, 
-                        vecs_sub[i].begin());
+        for (size_t i = 0; i < Nt; ++i) {
+            std::copy_n(traindata.begin() + i * D_ + m * Ds_, Ds_, vecs_sub.begin() + i * Ds_);
         }
-        std::vector<std::vector<float>> centroids;
-        std::vector<int> labels;
-        std::tie(centroids, labels) = KMeans<T>(vecs_sub, K_, iter, "points");
+        std::vector<float> centroids;
+        std::vector<uint32_t> labels;
+        std::tie(centroids, labels) = KMeans<T>(vecs_sub.data(), Nt, Ds_, K_, iter, minit, seed + m);
         
-        for (int k = 0; k < K_; ++k) {
-            std::copy(centroids[k].begin(), centroids[k].end(), centers_[m][k].begin());
-        }
+        std::copy(centroids.begin(), centroids.end(), centers_.begin() + m * K_ * Ds_);
         std::copy(labels.begin(), labels.end(), assignments_[m].begin());
     }
+    UpdateCenterCache();
 }
 
 template <typename T>
-const std::vector<std::vector<int>>&
-Quantizer<T>::GetAssignments() {return assignments_;}
+void Quantizer<T>::fit(const BatchReader<T>& reader, size_t batch_size, size_t nbatch, int seed, const std::string& minit)
+{
+    assert(batch_size >= K_ && "a batch should hold at least K_ vectors");
+
+    if (verbose_) {
+        printf("M_: %zu, K_: %zu, batch_size: %zu, nbatch: %zu\n", M_, K_, batch_size, nbatch);
+        std::cout << "seed: " << seed << ", minit: " << minit << std::endl;
+    }
+
+    std::vector<MiniBatchKMeans<T>> kmeans;
+    for (size_t m = 0; m < M_; ++m) {
+        kmeans.emplace_back(Ds_, K_, minit, seed + m);
+    }
+
+    std::vector<T> batch(batch_size * D_);
+    std::vector<T> vecs_sub(batch_size * Ds_);
+    for (size_t b = 0; b < nbatch; ++b) {
+        size_t n = reader(batch.data(), batch_size);
+        if (n == 0) break;
+        if (verbose_ && b % 100 == 0) {
+            std::cout << "Training on batch: " << b << " / " << nbatch << std::endl;
+        }
+        // Every subspace is updated with the batch, so the stream is read only once
+        for (size_t m = 0; m < M_; ++m) {
+            #pragma omp parallel for
+            for (size_t i = 0; i < n; ++i) {
+                std::copy_n(batch.begin() + i * D_ + m * Ds_, Ds_, vecs_sub.begin() + i * Ds_);
+            }
+            kmeans[m].Step(vecs_sub.data(), n);
+        }
+    }
+    if (kmeans[0].seen() == 0) {
+        std::cerr << "Error. The training stream of Quantizer::fit is empty." << std::endl;
+        throw;
+    }
+    if (verbose_) {
+        std::cout << kmeans[0].seen() << " vectors are used for training." << std::endl;
+    }
+
+    for (size_t m = 0; m < M_; ++m) {
+        const auto& centroids = kmeans[m].centroids();
+        std::copy(centroids.begin(), centroids.end(), centers_.begin() + m * K_ * Ds_);
+    }
+    // Streamed vectors are not kept, so there is nothing to assign
+    assignments_.assign(M_, std::vector<int>());
+    UpdateCenterCache();
+}
 
 template <typename T>
-const std::vector<std::vector<std::vector<float>>>&
-Quantizer<T>::get_centroids() {return centers_;}
+const std::vector<std::vector<int>>&
+Quantizer<T>::GetAssignments() {return assignments_;}
 
 template <typename T>
-void Quantizer<T>::SetCentroids(const std::vector<std::vector<std::vector<float>>>& centers_new)
+void Quantizer<T>::SetCentroids(const float* centers_new)
 {
-    assert(centers_new.size() == M_);
-    centers_ = centers_new;
+    std::copy(centers_new, centers_new + M_ * K_ * Ds_, centers_.begin());
+    UpdateCenterCache();
 }
 
 template <typename T>
@@ -113,7 +269,8 @@ void Quantizer<T>::Load(std::string quantizer_path)
     // std::vector<int> flat_assign;
     LoadFromFileBinary<float>(flat_center, quantizer_path + center_suffix);
     // LoadFromFileBinary(flat_assign, quantizer_path + assign_suffix);
-    this->centers_ = nest(flat_center, std::vector<size_t>{M_, K_, Ds_});
+    assert(flat_center.size() == M_ * K_ * Ds_);
+    SetCentroids(flat_center.data());
     // this->assignments_ = nest(flat_assign, std::vector<size_t>{M_, K_, Ds_});
     // LoadFromFileBinary(assignments_, quantizer_path + assign_suffix);
 }
@@ -124,7 +281,7 @@ void Quantizer<T>::Write(std::string quantizer_path)
     std::string center_suffix = "centers.fvecs";
     std::string assign_suffix = "assignments.ivecs";
 
-    auto flat_center = flatten(this->centers_);
+    std::vector<float> flat_center(centers_.begin(), centers_.end());
     // auto flat_assign = flatten(this->assignments_);
     WriteToFileBinary(flat_center, {1, M_ * K_ * Ds_}, quantizer_path + center_suffix);
     // WriteToFileBinary(assignments_, quantizer_path + assign_suffix);
@@ -136,57 +293,73 @@ Quantizer<T>::Encode(const std::vector<std::vector<T>>& rawdata)
 {
     size_t N = rawdata.size();
     assert(D_ == rawdata[0].size());
+    assert(K_ <= 256);
 
     std::vector<std::vector<uint8_t>> codes(N, std::vector<uint8_t>(M_, 0));
 
-    for (size_t m = 0; m < M_; ++m) {
-        if (verbose_) {
-            std::cout << "Encoding the subspace: " << m << " / " << M_ << std::endl;
-        }
-        std::vector<std::vector<T>> vecs_sub(N, std::vector<T>(Ds_));
-
-        #pragma omp parallel for
-        for (size_t i = 0; i < N; ++i) {
-            std::copy_n(rawdata[i].begin() + m * Ds_, Ds_, vecs_sub[i].begin());
-        }
-
-        #pragma omp parallel for
-        for (size_t i = 0; i < N; ++i) {
-            auto [min_idx, min_dist] = NearestCenter<T>(vecs_sub[i].data(), centers_[m]);
-            codes[i][m] = (uint8_t)min_idx;
+    #pragma omp parallel for
+    for (size_t i = 0; i < N; ++i) {
+        for (size_t m = 0; m < M_; ++m) {
+            codes[i][m] = (uint8_t)predict_one(rawdata[i].data() + m * Ds_, m);
         }
     }
     return codes;
 }
 
 template <typename T>
-std::vector<std::vector<uint8_t>> 
+std::vector<uint8_t> 
 Quantizer<T>::Encode(const std::vector<T>& rawdata) 
 {
-    size_t N = rawdata.size() / D_;
+    return Encode(rawdata.data(), rawdata.size() / D_);
+}
 
-    std::vector<std::vector<uint8_t>> codes(N, std::vector<uint8_t>(M_, 0));
+template <typename T>
+std::vector<uint8_t> 
+Quantizer<T>::Encode(const T* x, size_t N) 
+{
+    if (K_ > 256) {
+        std::cerr << "Error. K_ is too large. "
+                  << "Currently, we only support PQ code with K_ <= 256 "
+                  << "so that each subspace is represented by uint8_t (8 bit)"
+                  << std::endl;
+        throw;
+    }
+    std::vector<uint8_t> codes(N * M_, 0);
+    std::vector<uint32_t> labels(N);
 
     for (size_t m = 0; m < M_; ++m) {
         if (N > 1 && verbose_) {
             std::cout << "Encoding the subspace: " << m << " / " << M_ << std::endl;
         }
-        std::vector<std::vector<T>> vecs_sub(N, std::vector<T>(Ds_));
+        // Sub-vectors are read in place, with a stride of D_
+        NearestCenters(x + m * Ds_, N, D_, panels_[m], labels.data(), nullptr);
 
         #pragma omp parallel for
         for (size_t i = 0; i < N; ++i) {
-            std::copy_n(rawdata.begin() + i * D_ + m * Ds_, Ds_, vecs_sub[i].begin());
-        }
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < N; ++i) {
-            auto [min_idx, min_dist] = NearestCenter<T>(vecs_sub[i].data(), centers_[m]);
-            codes[i][m] = (uint8_t)min_idx;
+            codes[i * M_ + m] = (uint8_t)labels[i];
         }
     }
     return codes;
 }
 
+template <typename T>
+std::vector<uint8_t> 
+Quantizer<T>::Encode4(const T* x, size_t N) 
+{
+    assert(K_ <= 16);
+    const size_t code_size = (M_ + 1) / 2;
+    const auto& codes = Encode(x, N);
+
+    std::vector<uint8_t> packed(N * code_size, 0);
+    #pragma omp parallel for
+    for (size_t i = 0; i < N; ++i) {
+        for (size_t m = 0; m < M_; ++m) {
+            packed[i * code_size + m / 2] |= codes[i * M_ + m] << (m % 2 * 4);
+        }
+    }
+    return packed;
+}
+
 template <typename T>
 std::vector<T> 
 Quantizer<T>::NthVector(const std::vector<T>& long_code, size_t n)
@@ -0,0 +1,157 @@
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <unordered_set>
+
+#include "centroid_graph.hpp"
+#include "centroid_search.hpp"
+#include "index_ivf.hpp"
+#include "index_ivfpq.hpp"
+#include "util.hpp"
+#include "test_data.hpp"
+
+
+size_t D = 32;              // dimension of the vectors to index
+size_t nb = 50'000;         // size of the database we plan to index
+size_t nq = 500;            // size of the query we plan to search
+int ncentroids = 1024;
+int nprobe = 16;
+int k = 10;
+
+// Clustered vectors: n around ncluster random centers of their own
+std::vector<float> Clustered(size_t n, size_t ncluster, std::mt19937& rng)
+{
+    return ClusteredData(D, ncluster, 2, rng).Draw(n);
+}
+
+// Top-w centers of the graph against the exact ones of TopWCenters
+bool CheckGraph(std::mt19937& rng)
+{
+    size_t kc = 8192, w = 16;
+    const auto& centers = Clustered(kc, 256, rng);
+    const auto& query = Clustered(nq, 256, rng);
+
+    // One query at a time, as Search does
+    std::vector<uint32_t> exact(nq * w);
+    Timer timer_exact;
+    timer_exact.Start();
+    CenterPanels panels(centers.data(), kc, D);
+    for (size_t q = 0; q < nq; ++q) {
+        TopWCenters(query.data() + q * D, 1, D, panels, w, exact.data() + q * w, nullptr);
+    }
+    timer_exact.Stop();
+
+    CentroidGraph graph(centers.data(), kc, D, METRIC_L2);
+    bool ok = true;
+    GraphSearchScratch scratch;
+    std::vector<uint32_t> labels(nq * w);
+    for (size_t ef : {16, 64, 256}) {
+        Timer timer_graph;
+        timer_graph.Start();
+        for (size_t q = 0; q < nq; ++q) {
+            graph.Search(query.data() + q * D, w, ef, labels.data() + q * w, nullptr, scratch);
+        }
+        timer_graph.Stop();
+        size_t n_ok = 0;
+        for (size_t q = 0; q < nq; ++q) {
+            std::unordered_set<uint32_t> S(exact.begin() + q * w, exact.begin() + (q + 1) * w);
+            for (size_t i = 0; i < w; ++i) n_ok += S.count(labels[q * w + i]);
+        }
+        double recall = (double)n_ok / (nq * w);
+        printf("Graph over %zu centers, ef %zu: %.3f s (exact %.3f s), Recall@%zu: %.4f\n",
+            kc, ef, timer_graph.GetTime(), timer_exact.GetTime(), w, recall);
+        if (ef == 256) ok = recall > 0.95 && ok;
+    }
+
+    // Written and read back, the same graph
+    std::string path = (std::filesystem::temp_directory_path() / "toy_centroid_graph.bin").string();
+    graph.Write(path);
+    CentroidGraph loaded;
+    loaded.Load(path, centers.data());
+    std::remove(path.c_str());
+    std::vector<uint32_t> labels_loaded(nq * w);
+    for (size_t q = 0; q < nq; ++q) {
+        loaded.Search(query.data() + q * D, w, 256, labels_loaded.data() + q * w, nullptr, scratch);
+    }
+    printf("Same results after Load: %s\n", labels == labels_loaded ? "yes" : "no");
+    return ok && labels == labels_loaded;
+}
+
+// Search over the lists of the graph against the exact lists
+template <typename Index>
+std::vector<std::vector<float>> Evaluate(const Index& index, const std::vector<float>& query)
+{
+    std::vector<std::vector<float>> dist(nq, std::vector<float>(k));
+    std::vector<toy::idx_t> nnid(k);
+    toy::SearchContext ctx;
+    for (size_t q = 0; q < nq; ++q) {
+        index.Search(query.data() + q * D, k, nprobe, nnid.data(), dist[q].data(), ctx);
+    }
+    return dist;
+}
+
+size_t NumSame(const std::vector<std::vector<float>>& a, const std::vector<std::vector<float>>& b)
+{
+    size_t n_same = 0;
+    for (size_t q = 0; q < nq; ++q) n_same += a[q] == b[q];
+    return n_same;
+}
+
+int main() {
+    std::mt19937 rng;
+    bool ok = CheckGraph(rng);
+
+    const auto& database = Clustered(nb, 1000, rng);
+    const auto& query = Clustered(nq, 1000, rng);
+    std::string index_path = (std::filesystem::temp_directory_path() / "toy_coarse_graph").string();
+    std::filesystem::create_directories(index_path);
+
+    for (MetricType metric : {METRIC_L2, METRIC_COSINE}) {
+        toy::IVFConfig cfg(nb, D, nb, ncentroids, 1, D, "", "", metric);
+        toy::IndexIVF<float> index(cfg, nq, false);
+        index.Train(database, 123, nb);
+        index.Populate(database);
+        const auto& dist = Evaluate(index, query);
+
+        index.BuildCoarseGraph();
+        index.SetCoarseEfSearch(128);
+        const auto& dist_graph = Evaluate(index, query);
+        size_t n_same = NumSame(dist, dist_graph);
+        printf("IVF metric %d with the coarse graph: %zu / %zu queries as the exact lists\n", metric, n_same, nq);
+        ok = n_same >= nq * 9 / 10 && ok;
+
+        // The graph is written with the index and loaded back with it
+        index.WriteIndex(index_path);
+        toy::IndexIVF<float> index_loaded(cfg, nq, false);
+        index_loaded.LoadIndex(index_path);
+        index_loaded.SetCoarseEfSearch(128);
+        index_loaded.Populate(database);
+        const auto& dist_loaded = Evaluate(index_loaded, query);
+        printf("Same results after LoadIndex: %s\n", dist_loaded == dist_graph ? "yes" : "no");
+        ok = dist_loaded == dist_graph && ok;
+    }
+
+    // TopWId of IVFPQ
+    toy::IVFPQConfig cfg(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "");
+    toy::IndexIVFPQ<float> index(cfg, nq, false);
+    index.Train(database, 123, nb);
+    std::vector<std::vector<float>> queries(nq);
+    for (size_t q = 0; q < nq; ++q) queries[q].assign(query.begin() + q * D, query.begin() + (q + 1) * D);
+    std::vector<std::vector<uint32_t>> topw, topw_graph;
+    index.TopWId(nprobe, queries, topw, 1);
+    index.BuildCoarseGraph();
+    index.SetCoarseEfSearch(128);
+    index.TopWId(nprobe, queries, topw_graph, 1);
+    size_t n_ok = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        std::unordered_set<uint32_t> S(topw[q].begin(), topw[q].end());
+        for (uint32_t no : topw_graph[q]) n_ok += S.count(no);
+    }
+    double recall = (double)n_ok / (nq * nprobe);
+    printf("IVFPQ TopWId with the coarse graph, Recall@%d: %.4f\n", nprobe, recall);
+    ok = recall > 0.95 && ok;
+
+    std::filesystem::remove_all(index_path);
+    return ok ? 0 : 1;
+}
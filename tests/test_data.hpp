@@ -0,0 +1,80 @@
+#ifndef TESTS_TEST_DATA_HPP
+#define TESTS_TEST_DATA_HPP
+
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "distance.hpp"
+
+// Data sets of the tests: random vectors around random centers, and their exact neighbors
+
+
+/**
+ * Vectors clustered around ncluster random centers, whose coordinates are scale * N(0, 1).
+ * The centers are drawn from rng at construction, and the vectors from rng as they are
+ * asked for, so a test gets the same data from the same seed
+*/
+class ClusteredData {
+public:
+    ClusteredData(size_t d, size_t ncluster, float scale, std::mt19937& rng)
+        : d_(d), ncluster_(ncluster), rng_(rng), centers_(ncluster * d)
+    {
+        for (auto& c : centers_) c = scale * normal_(rng_);
+    }
+
+    /**
+     * n vectors, each a random center plus noise * N(0, 1) on every coordinate.
+     * Given a range, every vector is then scaled by a factor drawn uniformly in it,
+     * so that the norms vary
+    */
+    std::vector<float> Draw(size_t n, float noise = 1, float min_scale = 1, float max_scale = 1)
+    {
+        std::uniform_real_distribution<float> scale(min_scale, max_scale);
+        std::vector<float> x(n * d_);
+        for (size_t i = 0; i < n; ++i) {
+            size_t c = rng_() % ncluster_;
+            float s = min_scale < max_scale ? scale(rng_) : 1;
+            for (size_t j = 0; j < d_; ++j) {
+                x[i * d_ + j] = s * (centers_[c * d_ + j] + noise * normal_(rng_));
+            }
+        }
+        return x;
+    }
+
+private:
+    size_t d_, ncluster_;
+    std::mt19937& rng_;
+    std::normal_distribution<float> normal_;
+    std::vector<float> centers_;
+};
+
+/**
+ * The k nearest vectors of base to every query under metric, nearest first, by brute force.
+ * With METRIC_COSINE, both sides are normalized first
+ * @param base, query: vectors of dimension d
+*/
+inline std::vector<std::vector<size_t>> GroundTruth(const std::vector<float>& base,
+    const std::vector<float>& query, size_t d, size_t k, MetricType metric = METRIC_L2)
+{
+    const size_t nb = base.size() / d, nq = query.size() / d;
+    const auto& vecs = metric == METRIC_COSINE ? NormalizedCopy(base.data(), nb, d) : base;
+    std::vector<std::vector<size_t>> gt(nq);
+
+    #pragma omp parallel for
+    for (size_t q = 0; q < nq; ++q) {
+        std::vector<float> qv(query.begin() + q * d, query.begin() + (q + 1) * d);
+        if (metric == METRIC_COSINE) fvec_normalize_L2(qv.data(), d);
+
+        std::vector<std::pair<float, size_t>> scores(nb);
+        for (size_t i = 0; i < nb; ++i) {
+            scores[i] = {fvec_distance(metric, qv.data(), vecs.data() + i * d, d), i};
+        }
+        std::partial_sort(scores.begin(), scores.begin() + k, scores.end());
+        for (size_t i = 0; i < k; ++i) gt[q].emplace_back(scores[i].second);
+    }
+    return gt;
+}
+
+#endif
@@ -0,0 +1,186 @@
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "distance.hpp"
+
+
+// Odd sizes, so that every kernel runs its tails after 16 / 32 / 64 lanes
+const size_t dims[] = {1, 15, 17, 31, 33, 63, 65, 127, 129};
+const char* levels[] = {"sse", "avx", "avx2", "avx512", "avx512_vnni"};
+
+std::mt19937 rng(123);
+
+// Bytes near 0 and near 255, so that the squares and their sums overflow 16 bits
+std::vector<uint8_t> RandomBytes(size_t n, bool high)
+{
+    std::uniform_int_distribution<int> u(0, 7);
+    std::vector<uint8_t> x(n);
+    for (auto& v : x) v = high ? 255 - u(rng) : u(rng);
+    return x;
+}
+
+std::vector<float> RandomFloats(size_t n)
+{
+    std::uniform_real_distribution<float> u(-2.f, 2.f);
+    std::vector<float> x(n);
+    for (auto& v : x) v = u(rng);
+    return x;
+}
+
+template<typename Tx, typename Ty>
+double L2sqrRef(const Tx *x, const Ty *y, size_t d)
+{
+    double res = 0;
+    for (size_t i = 0; i < d; i++) res += ((double)x[i] - y[i]) * ((double)x[i] - y[i]);
+    return res;
+}
+
+template<typename Tx, typename Ty>
+double InnerProductRef(const Tx *x, const Ty *y, size_t d)
+{
+    double res = 0;
+    for (size_t i = 0; i < d; i++) res += (double)x[i] * y[i];
+    return res;
+}
+
+// Float sums are compared up to their rounding, integer ones exactly
+bool Close(double got, double expected, double scale, double tol)
+{
+    return std::fabs(got - expected) <= tol * scale;
+}
+
+template<typename Tx, typename Ty>
+bool CheckPair(const Tx *x, const Ty *y, size_t d, double tol)
+{
+    double l2 = L2sqrRef(x, y, d), ip = InnerProductRef(x, y, d);
+    double ip_scale = InnerProductRef(x, x, d) + InnerProductRef(y, y, d);
+    return Close(fvec_L2sqr(x, y, d), l2, l2, tol)
+        && Close(fvec_inner_product(x, y, d), ip, ip_scale, tol);
+}
+
+bool CheckDistances()
+{
+    bool ok = true;
+    for (size_t d : dims) {
+        std::vector<float> xf = RandomFloats(d), yf = RandomFloats(d);
+        ok = CheckPair(xf.data(), yf.data(), d, 1e-5) && ok;
+        for (bool high_x : {false, true}) {
+            for (bool high_y : {false, true}) {
+                std::vector<uint8_t> x = RandomBytes(d, high_x), y = RandomBytes(d, high_y);
+                std::vector<float> y32(y.begin(), y.end());
+                y32[0] += 0.25f;
+                ok = CheckPair(x.data(), y.data(), d, 0) && ok;
+                ok = CheckPair(x.data(), y32.data(), d, 1e-5) && ok;
+            }
+        }
+    }
+    return ok;
+}
+
+bool CheckPanel()
+{
+    bool ok = true;
+    for (size_t d : dims) {
+        for (size_t nx = 1; nx <= 8; nx++) {
+            std::vector<float> x = RandomFloats(nx * (d + 1)), panel = RandomFloats(16 * d);
+            std::vector<float> out(nx * 16);
+            fvec_inner_product_panel_16(x.data(), d + 1, nx, panel.data(), d, out.data());
+            for (size_t r = 0; r < nx; r++) {
+                for (size_t c = 0; c < 16; c++) {
+                    double ip = 0, scale = 0;
+                    for (size_t j = 0; j < d; j++) {
+                        ip += (double)x[r * (d + 1) + j] * panel[j * 16 + c];
+                        scale += std::fabs((double)x[r * (d + 1) + j] * panel[j * 16 + c]);
+                    }
+                    ok = ok && Close(out[r * 16 + c], ip, scale, 1e-5);
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+bool CheckPQ()
+{
+    const size_t nblock = 3, ksub = 256;
+    bool ok = true;
+    std::uniform_int_distribution<int> byte(0, 255);
+
+    for (size_t M : {4, 8, 12, 32}) {
+        std::vector<uint8_t> blocks4(nblock * M * 16), lut(M * 16);
+        for (auto& v : blocks4) v = byte(rng);
+        for (auto& v : lut) v = 255 - byte(rng) % 8;
+        std::vector<uint16_t> out4(nblock * PQ4_BLOCK_SIZE);
+        pq4_accumulate(blocks4.data(), nblock, lut.data(), M, out4.data());
+        for (size_t b = 0; b < nblock; b++) {
+            for (size_t v = 0; v < PQ4_BLOCK_SIZE; v++) {
+                uint32_t sum = 0;
+                for (size_t m = 0; m < M; m++) {
+                    sum += lut[m * 16 + pq4_get_code(blocks4.data() + b * M * 16, m, v)];
+                }
+                ok = ok && out4[b * PQ4_BLOCK_SIZE + v] == sum;
+            }
+        }
+    }
+
+    for (size_t M : {1, 7, 8, 16, 33}) {
+        std::vector<uint8_t> blocks8(nblock * M * PQ8_BLOCK_SIZE);
+        for (auto& v : blocks8) v = byte(rng);
+        std::vector<float> table = RandomFloats(M * ksub);
+        // The quantized tables are read 4 bytes past their end
+        std::vector<uint8_t> table8(M * ksub + 4);
+        std::vector<uint16_t> table16(M * ksub + 2);
+        for (size_t i = 0; i < M * ksub; i++) {
+            table8[i] = 255 - byte(rng) % 8;
+            table16[i] = 65535 - byte(rng);
+        }
+        std::vector<float> out(nblock * PQ8_BLOCK_SIZE);
+        std::vector<uint32_t> out8(nblock * PQ8_BLOCK_SIZE), out16(nblock * PQ8_BLOCK_SIZE);
+        pq8_accumulate(blocks8.data(), nblock, table.data(), M, ksub, out.data());
+        pq8_accumulate(blocks8.data(), nblock, table8.data(), M, ksub, out8.data());
+        pq8_accumulate(blocks8.data(), nblock, table16.data(), M, ksub, out16.data());
+        for (size_t b = 0; b < nblock; b++) {
+            for (size_t v = 0; v < PQ8_BLOCK_SIZE; v++) {
+                double sum = 0, scale = 0;
+                uint32_t sum8 = 0, sum16 = 0;
+                for (size_t m = 0; m < M; m++) {
+                    size_t e = m * ksub + pq8_get_code(blocks8.data() + b * M * PQ8_BLOCK_SIZE, m, v);
+                    sum += table[e];
+                    scale += std::fabs(table[e]);
+                    sum8 += table8[e];
+                    sum16 += table16[e];
+                }
+                size_t i = b * PQ8_BLOCK_SIZE + v;
+                ok = ok && Close(out[i], sum, scale, 1e-5) && out8[i] == sum8 && out16[i] == sum16;
+            }
+        }
+    }
+    return ok;
+}
+
+int main()
+{
+    printf("Load time kernels: %s\n", g_simd_architecture.c_str());
+
+    bool ok = true;
+    for (const char* level : levels) {
+        std::string bound = BindSimdKernels(level);
+        // The host lacks this level: the lower one it falls back to is checked on its own
+        if (bound != level) {
+            printf("%s: not supported, skipped\n", level);
+            continue;
+        }
+        bool ok_dist = CheckDistances();
+        bool ok_panel = CheckPanel();
+        bool ok_pq = CheckPQ();
+        printf("%s distances: %s\n", level, ok_dist ? "yes" : "no");
+        printf("%s inner product panel: %s\n", level, ok_panel ? "yes" : "no");
+        printf("%s PQ accumulate: %s\n", level, ok_pq ? "yes" : "no");
+        ok = ok && ok_dist && ok_panel && ok_pq;
+    }
+    BindSimdKernels(nullptr);
+
+    return ok ? 0 : 1;
+}
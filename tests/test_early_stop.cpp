@@ -0,0 +1,121 @@
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <unordered_set>
+
+#include "index_ivf.hpp"
+#include "index_ivfpq.hpp"
+#include "util.hpp"
+#include "test_data.hpp"
+
+
+size_t D = 32;              // dimension of the vectors to index
+size_t nb = 100'000;        // size of the database we plan to index
+size_t nq = 500;            // size of the query we plan to search
+int ncentroids = 1024;
+int nprobe = 64;
+int k = 10;
+
+struct Result {
+    double recall = 0, nlist = 0;
+    size_t nstop[4] = {};       // queries by StopReason
+};
+
+template <typename Index>
+Result Evaluate(const Index& index, const std::vector<float>& query, const std::vector<std::vector<size_t>>& gt,
+    size_t w, const toy::EarlyStop& stop, const char* name)
+{
+    Result result;
+    std::vector<toy::idx_t> nnid(k);
+    std::vector<float> dist(k);
+    toy::SearchContext ctx;
+    size_t n_ok = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        toy::SearchStats stats;
+        index.Search(query.data() + q * D, k, w, nnid.data(), dist.data(), ctx, stop, &stats);
+        std::unordered_set<size_t> S(gt[q].begin(), gt[q].end());
+        for (int i = 0; i < k; ++i) n_ok += S.count(nnid[i]);
+        result.nlist += stats.nlist;
+        result.nstop[stats.reason]++;
+    }
+    result.recall = (double)n_ok / (nq * k);
+    result.nlist /= nq;
+    printf("%s: Recall@%d %.4f, %.1f lists, stopped by nprobe %zu, distance %zu, budget %zu, convergence %zu\n",
+        name, k, result.recall, result.nlist, result.nstop[toy::STOP_NPROBE], result.nstop[toy::STOP_DISTANCE],
+        result.nstop[toy::STOP_BUDGET], result.nstop[toy::STOP_CONVERGED]);
+    return result;
+}
+
+int main() {
+    std::mt19937 rng;
+    // Many small clusters: the neighbors of some queries are spread over many lists
+    ClusteredData data(D, 20000, 1, rng);
+    const auto& database = data.Draw(nb, 0.5f);
+    const auto& query = data.Draw(nq, 0.5f);
+    const auto& gt = GroundTruth(database, query, D, k);
+
+    toy::IVFConfig cfg(nb, D, nb, ncentroids, 1, D, "", "");
+    toy::IndexIVF<float> index(cfg, nq, false);
+    index.Train(database, 123, nb);
+    index.Populate(database);
+
+    // The adaptive searches stop earlier than nprobe, with a better recall than a fixed
+    // nprobe of as many lists on average
+    bool ok = true;
+    Evaluate(index, query, gt, nprobe, toy::EarlyStop(), "IVF, nprobe 64");
+    for (const auto& stop : {toy::EarlyStop{1.5f, 0, 0}, toy::EarlyStop{0, 0, 16}}) {
+        const auto& adaptive = Evaluate(index, query, gt, nprobe, stop,
+            stop.patience > 0 ? "IVF, nprobe 64, patience 16" : "IVF, nprobe 64, distance ratio 1.5");
+        const size_t w = std::ceil(adaptive.nlist);
+        char name[64];
+        snprintf(name, sizeof(name), "IVF, nprobe %zu", w);
+        const auto& fixed = Evaluate(index, query, gt, w, toy::EarlyStop(), name);
+        ok = adaptive.nlist < nprobe && adaptive.recall > fixed.recall && ok;
+    }
+
+    // QueryBaseline: the budget is L, and the stats are kept by query
+    size_t L = 2000;
+    index.SetEarlyStop(toy::EarlyStop());
+    std::vector<size_t> nnid(k);
+    std::vector<float> dist(k);
+    size_t n_bad = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        size_t searched_cnt;
+        index.QueryBaseline(std::vector<float>(query.begin() + q * D, query.begin() + (q + 1) * D),
+            nnid, dist, searched_cnt, k, L, q, nprobe);
+        const auto& stats = index.QueryStats()[q];
+        n_bad += stats.ncandidates != searched_cnt || stats.reason != toy::STOP_BUDGET
+            || searched_cnt < L || stats.nlist == 0;
+    }
+    printf("QueryBaseline with a budget of %zu: %zu / %zu queries off\n", L, n_bad, nq);
+    ok = n_bad == 0 && ok;
+
+    // TopKId stops on the lists of topw as Search does on its own
+    toy::IVFPQConfig cfg_pq(nb, D, nb, ncentroids, 256, 1, 16, D, D / 16, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true);
+    toy::IndexIVFPQ<float> index_pq(cfg_pq, nq, false);
+    index_pq.Train(database, 123, nb);
+    index_pq.Populate(database);
+    toy::EarlyStop stop{2.0f, 0, 16};
+    std::vector<std::vector<float>> queries(nq);
+    for (size_t q = 0; q < nq; ++q) queries[q].assign(query.begin() + q * D, query.begin() + (q + 1) * D);
+    std::vector<std::vector<uint32_t>> topw;
+    std::vector<std::vector<toy::idx_t>> topk_id;
+    std::vector<std::vector<float>> topk_dist;
+    index_pq.SetEarlyStop(stop);
+    index_pq.TopWId(nprobe, queries, topw, 1);
+    index_pq.TopKId(k, queries, topw, topk_id, topk_dist, 1);
+    toy::SearchContext ctx;
+    std::vector<toy::idx_t> ids(k);
+    size_t n_same = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        toy::SearchStats stats;
+        index_pq.Search(query.data() + q * D, k, nprobe, ids.data(), dist.data(), ctx, stop, &stats);
+        const auto& stats_topk = index_pq.QueryStats()[q];
+        n_same += dist == topk_dist[q] && stats.nlist == stats_topk.nlist && stats.reason == stats_topk.reason;
+    }
+    printf("IVFPQ TopKId: %zu / %zu queries as Search\n", n_same, nq);
+    ok = n_same == nq && ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <iostream>
+
+#include "index_ivf.hpp"
+#include "index_ivfpq.hpp"
+#include "util.hpp"
+
+
+size_t D = 32;              // dimension of the vectors to index
+size_t nb = 100'000;        // size of the database we plan to index
+size_t nq = 200;            // size of the query we plan to search
+size_t nadd = 10;           // the database is added in nadd batches
+int ncentroids = 256;
+int nprobe = 8;
+int k = 10;
+
+// User keys past 2^32
+const toy::idx_t key_base = toy::idx_t(1) << 40;
+
+// Results of index against those of index_add, whose ids are id_offset larger
+template <typename Index>
+bool SameResults(Index& index, Index& index_add, const std::vector<float>& query, toy::idx_t id_offset)
+{
+    size_t n_ok = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        std::vector<float> vq(query.begin() + q * D, query.begin() + (q + 1) * D);
+        std::vector<size_t> nnid(k), nnid_add(k);
+        std::vector<float> dist(k), dist_add(k);
+        size_t searched_cnt, searched_cnt_add;
+        index.QueryBaseline(vq, nnid, dist, searched_cnt, k, nb, q, nprobe);
+        index_add.QueryBaseline(vq, nnid_add, dist_add, searched_cnt_add, k, nb, q, nprobe);
+        bool ok = searched_cnt == searched_cnt_add;
+        for (int i = 0; i < k; ++i) {
+            ok = ok && dist[i] == dist_add[i] && (toy::idx_t)nnid_add[i] == id_offset + (toy::idx_t)nnid[i];
+        }
+        n_ok += ok;
+    }
+    printf("%zu / %zu queries have the same results\n", n_ok, nq);
+    return n_ok == nq;
+}
+
+// index streamed in nadd batches, appended to the lists in place, then with every 10th
+// vector removed, only marked dead, then every 4th of the rest, after which the lists are
+// compacted: the same results as Populate, then as an index of only the vectors left
+template <typename Index, typename Config>
+bool AddRemove(const Config& cfg, const std::vector<float>& database, const std::vector<toy::idx_t>& keys,
+    const std::vector<float>& query, const char* name)
+{
+    Index index(cfg, nq, false), index_add(cfg, nq, false);
+    index.Train(database, 123, nb);
+    index_add.Train(database, 123, nb);
+    index.Populate(database);
+    for (size_t b = 0; b < nadd; ++b) {
+        size_t begin = b * nb / nadd, end = (b + 1) * nb / nadd;
+        index_add.Add(end - begin, database.data() + begin * D, keys.data() + begin);
+    }
+    printf("%s: ", name);
+    bool ok = SameResults(index, index_add, query, key_base);
+
+    std::vector<toy::idx_t> removed, removed_more;
+    for (size_t i = 0; i < nb; ++i) {
+        if (i % 10 == 0) {
+            removed.push_back(keys[i]);
+        } else if (i % 4 == 0) {
+            removed_more.push_back(keys[i]);
+        }
+    }
+    auto Kept = [&](size_t every) {
+        std::vector<float> kept;
+        std::vector<toy::idx_t> kept_keys;
+        for (size_t i = 0; i < nb; ++i) {
+            if (i % 10 == 0 || i % every == 0) continue;
+            kept.insert(kept.end(), database.begin() + i * D, database.begin() + (i + 1) * D);
+            kept_keys.push_back(keys[i]);
+        }
+        Index index_kept(cfg, nq, false);
+        index_kept.Train(database, 123, nb);
+        index_kept.Add(kept_keys.size(), kept.data(), kept_keys.data());
+        return index_kept;
+    };
+    ok = index_add.Remove(removed.size(), removed.data()) == removed.size() && ok;
+    auto index_kept = Kept(nb);
+    printf("%s after Remove, tombstones: ", name);
+    ok = SameResults(index_kept, index_add, query, 0) && ok;
+    // Searches go on while the rest is removed and the lists compacted: they only
+    // ever find vectors of the database
+    bool ok_concurrent = true;
+    std::atomic<bool> done = false;
+    #pragma omp parallel sections num_threads(2)
+    {
+        #pragma omp section
+        {
+            ok = index_add.Remove(removed_more.size(), removed_more.data()) == removed_more.size() && ok;
+            index_add.Compact(toy::INVLISTS_MAX_DEAD_FRACTION);
+            done = true;
+        }
+        #pragma omp section
+        {
+            toy::SearchContext ctx;
+            std::vector<toy::idx_t> nnid(k);
+            std::vector<float> dist(k);
+            for (size_t q = 0; !done; q = (q + 1) % nq) {
+                index_add.Search(query.data() + q * D, k, nprobe, nnid.data(), dist.data(), ctx);
+                for (toy::idx_t id : nnid) {
+                    ok_concurrent = ok_concurrent && id >= key_base && id < key_base + (toy::idx_t)nb;
+                }
+            }
+        }
+    }
+    printf("%s searches during Remove and Compact: %s\n", name, ok_concurrent ? "yes" : "no");
+    ok = ok_concurrent && ok;
+    index_kept = Kept(4);
+    printf("%s after Remove, compacted: ", name);
+    ok = SameResults(index_kept, index_add, query, 0) && ok;
+    return ok;
+}
+
+int main() {
+    std::mt19937 rng;
+    std::normal_distribution<float> normal;
+
+    std::vector<float> database(nb * D), query(nq * D);
+    for (auto& x : database) x = normal(rng);
+    for (auto& x : query) x = normal(rng);
+
+    std::vector<toy::idx_t> keys(nb);
+    for (size_t i = 0; i < nb; ++i) keys[i] = key_base + i;
+
+    toy::IVFConfig cfg(nb, D, nb, ncentroids, 1, D, "", "");
+    bool ok = AddRemove<toy::IndexIVF<float>>(cfg, database, keys, query, "IVF");
+
+    toy::IVFPQConfig cfg_pq(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "");
+    ok = AddRemove<toy::IndexIVFPQ<float>>(cfg_pq, database, keys, query, "IVFPQ") && ok;
+
+    // The blocked layouts, whose blocks are filled and moved in the lists
+    toy::IVFPQConfig cfg_block(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_BLOCK_16);
+    ok = AddRemove<toy::IndexIVFPQ<float>>(cfg_block, database, keys, query, "IVFPQ, blocks of 16") && ok;
+    toy::IVFPQConfig cfg_fs(nb, D, nb, ncentroids, 16, 1, 16, D, D / 16, "", "");
+    ok = AddRemove<toy::IndexIVFPQ<float>>(cfg_fs, database, keys, query, "IVFPQ, fast scan") && ok;
+
+    return ok ? 0 : 1;
+}
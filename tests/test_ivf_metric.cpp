@@ -0,0 +1,102 @@
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <iostream>
+#include <numeric>
+#include <unordered_set>
+
+#include "index_ivf.hpp"
+#include "index_ivfpq.hpp"
+#include "util.hpp"
+#include "test_data.hpp"
+
+
+size_t D = 64;              // dimension of the vectors to index
+size_t nb = 100'000;        // size of the database we plan to index
+size_t nq = 1'000;          // size of the query we plan to search
+size_t mp = 16;
+int ncentroids = 256;
+int nprobe = 16;
+int k = 10;
+
+// Recall of the search; misordered counts the results out of order
+template <typename Index>
+double Evaluate(Index& index, const std::vector<float>& query, const std::vector<std::vector<size_t>>& gt,
+    MetricType metric, const char* name, int w, int& n_misordered)
+{
+    std::vector<std::vector<toy::idx_t>> nnid(nq, std::vector<toy::idx_t>(k));
+    std::vector<std::vector<float>> dist(nq, std::vector<float>(k));
+    toy::SearchContext ctx;
+    Timer timer_query;
+    timer_query.Start();
+    for (size_t q = 0; q < nq; ++q) {
+        index.Search(query.data() + q * D, k, w, nnid[q].data(), dist[q].data(), ctx);
+    }
+    timer_query.Stop();
+
+    int n_ok = 0;
+    n_misordered = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        std::unordered_set<size_t> S(gt[q].begin(), gt[q].end());
+        for (int i = 0; i < k; ++i) {
+            if (S.count(nnid[q][i])) n_ok++;
+            // L2 distances grow, similarities shrink
+            if (i > 0 && (IsSimilarity(metric) ? dist[q][i] > dist[q][i - 1] : dist[q][i] < dist[q][i - 1])) {
+                n_misordered++;
+            }
+        }
+    }
+    double recall = (double)n_ok / (nq * k);
+    printf("%s metric %d, nprobe %d: %.3f s, Recall@%d: %.4f, misordered: %d\n",
+        name, metric, w, timer_query.GetTime(), k, recall, n_misordered);
+    return recall;
+}
+
+int main() {
+    std::mt19937 rng;
+    // Clustered data with varying norms, so that L2, IP and cosine rankings differ
+    ClusteredData data(D, 100, 3, rng);
+    const auto& database = data.Draw(nb, 1, 0.5f, 2.0f);
+    const auto& query = data.Draw(nq);
+
+    // Results in order for every index; the exact IVF finds all the neighbors once it probes all the lists
+    bool ok = true;
+    int n_misordered;
+    for (MetricType metric : {METRIC_L2, METRIC_INNER_PRODUCT, METRIC_COSINE}) {
+        const auto& gt = GroundTruth(database, query, D, k, metric);
+
+        toy::IVFConfig cfg(nb, D, nb, ncentroids, 1, D, "", "", metric);
+        toy::IndexIVF<float> index(cfg, nq, false);
+        index.Train(database, 123, nb);
+        index.Populate(database);
+        Evaluate(index, query, gt, metric, "IVF", nprobe, n_misordered);
+        ok = n_misordered == 0 && ok;
+        double recall = Evaluate(index, query, gt, metric, "IVF", ncentroids, n_misordered);
+        ok = recall == 1.0 && n_misordered == 0 && ok;
+
+        toy::IVFPQConfig cfg_pq(nb, D, nb, ncentroids, 256, 1, mp, D, D / mp, "", "", metric);
+        toy::IndexIVFPQ<float> index_pq(cfg_pq, nq, false);
+        index_pq.Train(database, 123, nb);
+        index_pq.Populate(database);
+        double recall_pq = Evaluate(index_pq, query, gt, metric, "IVFPQ", nprobe, n_misordered);
+        ok = n_misordered == 0 && ok;
+
+        // Residuals to the coarse centroids, with the same code size and with half of it:
+        // more accurate than the plain codes at the same size, and no worse at half of it
+        for (size_t mp_res : {mp, mp / 2}) {
+            toy::IVFPQConfig cfg_res(nb, D, nb, ncentroids, 256, 1, mp_res, D, D / mp_res, "", "", metric,
+                toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true);
+            toy::IndexIVFPQ<float> index_res(cfg_res, nq, false);
+            index_res.Train(database, 123, nb);
+            index_res.Populate(database);
+            double recall_res = Evaluate(index_res, query, gt, metric,
+                mp_res == mp ? "IVFPQ by residual" : "IVFPQ by residual, mp / 2", nprobe, n_misordered);
+            bool ok_recall = mp_res == mp ? recall_res > recall_pq : recall_res >= recall_pq;
+            printf("Recall by residual %s the plain IVFPQ's: %s\n", mp_res == mp ? "above" : "at least",
+                ok_recall ? "yes" : "no");
+            ok = ok_recall && n_misordered == 0 && ok;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
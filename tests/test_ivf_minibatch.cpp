@@ -0,0 +1,119 @@
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <iostream>
+#include <numeric>
+#include <unordered_set>
+#include <unistd.h>
+
+#include "binary_io.hpp"
+#include "index_ivf.hpp"
+#include "kmeans.hpp"
+#include "util.hpp"
+#include "test_data.hpp"
+
+
+size_t D = 64;              // dimension of the vectors to index
+size_t nb = 200'000;        // size of the database we plan to index
+size_t nq = 1'000;          // size of the query we plan to search
+size_t batch_size = 20'000; // vectors held in memory by the streamed training
+size_t nbatch = 35;         // more than the 3 epochs the file is read for
+size_t nepoch = 3;
+int ncentroids = 1024;
+int nprobe = 2;
+int k = 10;
+
+// Recall@k of index against the exact neighbors
+template <typename Index>
+double Recall(Index& index, const std::vector<float>& query, const std::vector<std::vector<size_t>>& gt)
+{
+    std::vector<std::vector<size_t>> nnid(nq, std::vector<size_t>(k));
+    std::vector<std::vector<float>> dist(nq, std::vector<float>(k));
+    for (size_t q = 0; q < nq; ++q) {
+        size_t searched_cnt;
+        index.QueryBaseline(
+            std::vector<float>(query.begin() + q * D, query.begin() + (q + 1) * D),
+            nnid[q], dist[q], searched_cnt,
+            k, nb, q, nprobe
+        );
+    }
+    int n_ok = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        std::unordered_set<size_t> S(gt[q].begin(), gt[q].end());
+        for (int i = 0; i < k; ++i) {
+            if (S.count(nnid[q][i])) n_ok++;
+        }
+    }
+    return (double)n_ok / (nq * k);
+}
+
+int main() {
+    std::mt19937 rng;
+    ClusteredData data(D, 500, 2, rng);
+    const auto& database = data.Draw(nb);
+    const auto& query = data.Draw(nq);
+
+    // A file of its own, so that runs at the same time do not share it
+    std::string base_path = std::filesystem::temp_directory_path() / "toy_minibatch_XXXXXX";
+    int fd = mkstemp(base_path.data());
+    if (fd < 0) {
+        std::cerr << "Error. Cannot create a file in " << std::filesystem::temp_directory_path() << std::endl;
+        return 1;
+    }
+    close(fd);
+    WriteToFileBinary(database, {nb, D}, base_path);
+
+    const auto& gt = GroundTruth(database, query, D, k);
+
+    toy::IVFConfig cfg(nb, D, nb, ncentroids, 1, D, "", "");
+
+    Timer timer_train;
+    timer_train.Start();
+    toy::IndexIVF<float> index(cfg, nq, false);
+    index.Train(database, 123, nb);
+    timer_train.Stop();
+    index.Populate(database);
+    double recall = Recall(index, query, gt);
+    printf("Lloyd on %zu vectors: train %.2f s, Recall@%d: %.4f\n",
+        nb, timer_train.GetTime(), k, recall);
+
+    // The training set is only read from the file, batch_size vectors at a time,
+    // for nepoch epochs at most
+    VecsFileReader<float, float> reader(base_path, true);
+    size_t nleft = nepoch * nb;
+    auto stream = [&](float* buf, size_t n) {
+        size_t nread = reader.Read(buf, std::min(n, nleft));
+        nleft -= nread;
+        return nread;
+    };
+    timer_train.Reset();
+    timer_train.Start();
+    toy::IndexIVF<float> index_mb(cfg, nq, false);
+    index_mb.Train(stream, 123, batch_size, nbatch);
+    timer_train.Stop();
+    index_mb.Populate(database);
+    double recall_mb = Recall(index_mb, query, gt);
+    printf("Mini-batch on %zu epochs by %zu vectors: train %.2f s, Recall@%d: %.4f\n",
+        nepoch, batch_size, timer_train.GetTime(), k, recall_mb);
+    bool ok = recall_mb >= 0.95 * recall;
+    printf("Mini-batch recall at least 0.95x Lloyd's: %s\n", ok ? "yes" : "no");
+
+    // The same stream drives MiniBatchKMeans as the index does: it stops at the end of
+    // the epochs, short of nbatch batches
+    reader.Rewind();
+    nleft = nepoch * nb;
+    MiniBatchKMeans<float> kmeans(D, ncentroids, "++", 123);
+    std::vector<float> batch(batch_size * D);
+    for (size_t b = 0; b < nbatch; ++b) {
+        size_t n = stream(batch.data(), batch_size);
+        if (n == 0) break;
+        kmeans.Step(batch.data(), n);
+    }
+    bool ok_seen = kmeans.seen() == std::min(nbatch * batch_size, nepoch * nb);
+    printf("Vectors seen by MiniBatchKMeans %zu: %s\n", kmeans.seen(), ok_seen ? "yes" : "no");
+    ok = ok_seen && ok;
+
+    std::remove(base_path.c_str());
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <iostream>
+#include <unordered_set>
+
+#include "index_ivfpq.hpp"
+#include "util.hpp"
+#include "test_data.hpp"
+
+
+size_t D = 64;              // dimension of the vectors to index
+size_t nb = 200'000;        // size of the database we plan to index
+size_t nq = 1'000;          // size of the query we plan to search
+int ncentroids = 256;
+int nprobe = 16;
+int k = 10;
+
+// pq4_accumulate against a plain loop over the block layout
+bool CheckKernel4()
+{
+    std::mt19937 rng(1);
+    size_t M = 16, nblock = 100;
+    std::vector<uint8_t> blocks(nblock * M * 16), lut(M * 16);
+    for (auto& x : blocks) x = rng();
+    for (auto& x : lut) x = rng();
+
+    std::vector<uint16_t> out(nblock * PQ4_BLOCK_SIZE);
+    pq4_accumulate(blocks.data(), nblock, lut.data(), M, out.data());
+
+    size_t n_bad = 0;
+    for (size_t b = 0; b < nblock; ++b) {
+        for (size_t v = 0; v < PQ4_BLOCK_SIZE; ++v) {
+            uint16_t sum = 0;
+            for (size_t m = 0; m < M; ++m) {
+                uint8_t byte = blocks[b * M * 16 + m * 16 + v % 16];
+                sum += lut[m * 16 + (v < 16 ? byte & 0x0f : byte >> 4)];
+            }
+            n_bad += out[b * PQ4_BLOCK_SIZE + v] != sum;
+        }
+    }
+    printf("pq4_accumulate (%s): %zu / %zu sums differ\n", g_simd_architecture.c_str(), n_bad, out.size());
+    return n_bad == 0;
+}
+
+// pq8_accumulate against a plain loop over the block layout. The tests are built with
+// -Ofast, which may reorder the sums of the loop, so they only have to be close
+bool CheckKernel8()
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform;
+    size_t M = 8, ksub = 256, nblock = 100;
+    std::vector<uint8_t> blocks(nblock * M * PQ8_BLOCK_SIZE);
+    std::vector<float> table(M * ksub);
+    for (auto& x : blocks) x = rng();
+    for (auto& x : table) x = uniform(rng);
+
+    std::vector<float> out(nblock * PQ8_BLOCK_SIZE);
+    pq8_accumulate(blocks.data(), nblock, table.data(), M, ksub, out.data());
+
+    size_t n_bad = 0;
+    for (size_t b = 0; b < nblock; ++b) {
+        for (size_t v = 0; v < PQ8_BLOCK_SIZE; ++v) {
+            float sum = 0;
+            for (size_t m = 0; m < M; ++m) {
+                sum += table[m * ksub + blocks[(b * M + m) * PQ8_BLOCK_SIZE + v]];
+            }
+            n_bad += std::abs(out[b * PQ8_BLOCK_SIZE + v] - sum) > 1e-5f * sum;
+        }
+    }
+    printf("pq8_accumulate (%s): %zu / %zu sums differ\n", g_simd_architecture.c_str(), n_bad, out.size());
+    return n_bad == 0;
+}
+
+// pq8_accumulate on quantized tables, exact. The table is padded for the gathers
+template <typename Q>
+bool CheckKernel8Quantized()
+{
+    std::mt19937 rng(1);
+    size_t M = 8, ksub = 256, nblock = 100;
+    std::vector<uint8_t> blocks(nblock * M * PQ8_BLOCK_SIZE);
+    std::vector<Q> table(M * ksub + 4);
+    for (auto& x : blocks) x = rng();
+    for (auto& x : table) x = rng();
+
+    std::vector<uint32_t> out(nblock * PQ8_BLOCK_SIZE);
+    pq8_accumulate(blocks.data(), nblock, table.data(), M, ksub, out.data());
+
+    size_t n_bad = 0;
+    for (size_t b = 0; b < nblock; ++b) {
+        for (size_t v = 0; v < PQ8_BLOCK_SIZE; ++v) {
+            uint32_t sum = 0;
+            for (size_t m = 0; m < M; ++m) {
+                sum += table[m * ksub + blocks[(b * M + m) * PQ8_BLOCK_SIZE + v]];
+            }
+            n_bad += out[b * PQ8_BLOCK_SIZE + v] != sum;
+        }
+    }
+    printf("pq8_accumulate uint%zu (%s): %zu / %zu sums differ\n", sizeof(Q) * 8,
+        g_simd_architecture.c_str(), n_bad, out.size());
+    return n_bad == 0;
+}
+
+// Returns the distances found, to compare layouts and tables. Entries with the same
+// codes tie, so the ids may come in another order
+template <typename Index>
+std::vector<std::vector<float>> Evaluate(Index& index, const std::vector<float>& query,
+    const std::vector<std::vector<size_t>>& gt, const char* name)
+{
+    std::vector<std::vector<toy::idx_t>> nnid(nq, std::vector<toy::idx_t>(k));
+    std::vector<std::vector<float>> dist(nq, std::vector<float>(k));
+    toy::SearchContext ctx;
+    Timer timer_query;
+    timer_query.Start();
+    for (size_t q = 0; q < nq; ++q) {
+        index.Search(query.data() + q * D, k, nprobe, nnid[q].data(), dist[q].data(), ctx);
+    }
+    timer_query.Stop();
+
+    int n_ok = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        std::unordered_set<size_t> S(gt[q].begin(), gt[q].end());
+        for (int i = 0; i < k; ++i) {
+            if (S.count(nnid[q][i])) n_ok++;
+        }
+    }
+    printf("%s: %.3f s, Recall@%d: %.4f\n", name, timer_query.GetTime(), k, (double)n_ok / (nq * k));
+    return dist;
+}
+
+int main() {
+    bool ok = CheckKernel4();
+    ok = CheckKernel8() && ok;
+    ok = CheckKernel8Quantized<uint8_t>() && ok;
+    ok = CheckKernel8Quantized<uint16_t>() && ok;
+
+    std::mt19937 rng;
+    ClusteredData data(D, 1000, 2, rng);
+    const auto& database = data.Draw(nb);
+    const auto& query = data.Draw(nq);
+    const auto& gt = GroundTruth(database, query, D, k);
+
+    // Both codes take 8 bytes: 8 sub-spaces of 8 bits, or 16 of 4 bits
+    toy::IVFPQConfig cfg(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "");
+    toy::IndexIVFPQ<float> index(cfg, nq, false);
+    index.Train(database, 123, nb);
+    index.Populate(database);
+    const auto& dist = Evaluate(index, query, gt, "PQ 8x8 bits");
+
+    // The batch search builds the tables of several queries at once
+    std::vector<std::vector<float>> queries(nq);
+    for (size_t q = 0; q < nq; ++q) queries[q].assign(query.begin() + q * D, query.begin() + (q + 1) * D);
+    std::vector<std::vector<uint32_t>> topw;
+    std::vector<std::vector<toy::idx_t>> topk_id;
+    std::vector<std::vector<float>> topk_dist;
+    index.TopWId(nprobe, queries, topw, 1);
+    index.TopKId(k, queries, topw, topk_id, topk_dist, 1);
+    printf("Same results with TopKId: %s\n", topk_dist == dist ? "yes" : "no");
+    ok = topk_dist == dist && ok;
+
+    // List by list, each list scanned once for all its queries
+    std::vector<std::vector<toy::idx_t>> topk_id_lm;
+    std::vector<std::vector<float>> topk_dist_lm;
+    index.TopKIdListMajor(k, queries, topw, topk_id_lm, topk_dist_lm, 2);
+    printf("Same results with TopKIdListMajor: %s\n", topk_dist_lm == dist ? "yes" : "no");
+    ok = topk_dist_lm == dist && ok;
+
+    // Same codes, scanned 16 at a time
+    toy::IVFPQConfig cfg_block(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_BLOCK_16);
+    toy::IndexIVFPQ<float> index_block(cfg_block, nq, false);
+    index_block.Train(database, 123, nb);
+    index_block.Populate(database);
+    const auto& dist_block = Evaluate(index_block, query, gt, "PQ 8x8 bits, blocks of 16");
+    printf("Same results with blocks of 16: %s\n", dist == dist_block ? "yes" : "no");
+    ok = dist == dist_block && ok;
+
+    // Quantized tables, rescored: the same results as the float tables
+    const std::pair<toy::CodeLayout, toy::TableType> quantized[] = {
+        {toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_UINT8},
+        {toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_UINT16},
+        {toy::CODE_LAYOUT_BLOCK_16, toy::TABLE_UINT8},
+        {toy::CODE_LAYOUT_BLOCK_16, toy::TABLE_UINT16},
+    };
+    for (const auto& [layout, table] : quantized) {
+        toy::IVFPQConfig cfg_q(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "",
+            METRIC_L2, layout, table);
+        toy::IndexIVFPQ<float> index_q(cfg_q, nq, false);
+        index_q.Train(database, 123, nb);
+        index_q.Populate(database);
+        std::string name = std::string("PQ 8x8 bits, ") + (table == toy::TABLE_UINT8 ? "uint8" : "uint16")
+            + " tables" + (layout == toy::CODE_LAYOUT_BLOCK_16 ? ", blocks of 16" : "");
+        const auto& dist_q = Evaluate(index_q, query, gt, name.c_str());
+        printf("Same results with %s: %s\n", name.c_str(), dist == dist_q ? "yes" : "no");
+        ok = dist == dist_q && ok;
+        // The quantized tables of a query are made once, for all its lists
+        index_q.TopKIdListMajor(k, queries, topw, topk_id_lm, topk_dist_lm, 2);
+        printf("Same results with TopKIdListMajor: %s\n", topk_dist_lm == dist ? "yes" : "no");
+        ok = topk_dist_lm == dist && ok;
+    }
+
+    // By residual, the quantized tables are made for every list
+    toy::IVFPQConfig cfg_res(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true);
+    toy::IndexIVFPQ<float> index_res(cfg_res, nq, false);
+    index_res.Train(database, 123, nb);
+    index_res.Populate(database);
+    const auto& dist_res = Evaluate(index_res, query, gt, "PQ 8x8 bits by residual");
+    toy::IVFPQConfig cfg_res_q(nb, D, nb, ncentroids, 256, 1, 8, D, D / 8, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_BLOCK_16, toy::TABLE_UINT8, true);
+    toy::IndexIVFPQ<float> index_res_q(cfg_res_q, nq, false);
+    index_res_q.Train(database, 123, nb);
+    index_res_q.Populate(database);
+    const auto& dist_res_q = Evaluate(index_res_q, query, gt, "PQ 8x8 bits by residual, uint8 tables, blocks of 16");
+    printf("Same results with uint8 tables by residual: %s\n", dist_res == dist_res_q ? "yes" : "no");
+    ok = dist_res == dist_res_q && ok;
+    index_res_q.TopKIdListMajor(k, queries, topw, topk_id_lm, topk_dist_lm, 2);
+    printf("Same results with TopKIdListMajor by residual: %s\n", topk_dist_lm == dist_res ? "yes" : "no");
+    ok = topk_dist_lm == dist_res && ok;
+
+    toy::IVFPQConfig cfg_fs(nb, D, nb, ncentroids, 16, 1, 16, D, D / 16, "", "");
+    toy::IndexIVFPQ<float> index_fs(cfg_fs, nq, false);
+    index_fs.Train(database, 123, nb);
+    index_fs.Populate(database);
+    const auto& dist_fs = Evaluate(index_fs, query, gt, "PQ 16x4 bits, fast scan");
+    index_fs.TopKIdListMajor(k, queries, topw, topk_id_lm, topk_dist_lm, 2);
+    printf("Same results with TopKIdListMajor: %s\n", topk_dist_lm == dist_fs ? "yes" : "no");
+    ok = topk_dist_lm == dist_fs && ok;
+
+    toy::IVFPQConfig cfg_fs_res(nb, D, nb, ncentroids, 16, 1, 16, D, D / 16, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true);
+    toy::IndexIVFPQ<float> index_fs_res(cfg_fs_res, nq, false);
+    index_fs_res.Train(database, 123, nb);
+    index_fs_res.Populate(database);
+    const auto& dist_fs_res = Evaluate(index_fs_res, query, gt, "PQ 16x4 bits by residual, fast scan");
+    index_fs_res.TopKIdListMajor(k, queries, topw, topk_id_lm, topk_dist_lm, 2);
+    printf("Same results with TopKIdListMajor by residual: %s\n", topk_dist_lm == dist_fs_res ? "yes" : "no");
+    ok = topk_dist_lm == dist_fs_res && ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "kmeans.hpp"
+
+
+size_t D = 32;              // dimension of the observations
+size_t N = 50'000;          // observations
+int k = KMEANS_BOUNDS_MIN_K;    // the smallest k that KMeans assigns with YinyangBounds
+int iter = 6;
+
+// Labels a and b of x differ only if both centroids are equally close, up to rounding
+bool Tie(const float* x, const float* centroids, uint32_t a, uint32_t b)
+{
+    float da = fvec_L2sqr(x, centroids + a * D, D), db = fvec_L2sqr(x, centroids + b * D, D);
+    return std::fabs(da - db) <= 1e-5f * std::max(da, db);
+}
+
+// Every centroid with observations at their mean, computed one cluster at a time
+bool SameMeans(const std::vector<float>& obs, const std::vector<uint32_t>& labels,
+    const std::vector<float>& before, const std::vector<float>& after, const std::vector<size_t>& sizes)
+{
+    bool ok = true;
+    for (int c = 0; c < k; ++c) {
+        std::vector<double> mean(D, 0);
+        size_t size = 0;
+        for (size_t i = 0; i < N; ++i) {
+            if (labels[i] != (uint32_t)c) continue;
+            for (size_t j = 0; j < D; ++j) mean[j] += obs[i * D + j];
+            size++;
+        }
+        ok = ok && sizes[c] == size;
+        for (size_t j = 0; j < D; ++j) {
+            // A centroid without observations is kept
+            double expected = size == 0 ? before[c * D + j] : mean[j] / size;
+            ok = ok && std::fabs(after[c * D + j] - expected) <= 1e-4 * (1 + std::fabs(expected));
+        }
+    }
+    return ok;
+}
+
+int main() {
+    std::mt19937 rng;
+    std::normal_distribution<float> normal;
+
+    std::vector<float> obs(N * D);
+    for (auto& x : obs) x = normal(rng);
+
+    // The iterations of KMeans, with both assignments on the same centroids
+    std::default_random_engine rd(123);
+    std::vector<float> centroids(k * D), prev;
+    InitCentroids(obs.data(), N, D, k, "points", centroids.data(), rd);
+    YinyangBounds<float> bounds;
+    std::vector<uint32_t> labels(N), labels_ref(N);
+    bool ok_labels = true, ok_means = true;
+    size_t nties = 0;
+    for (int it = 0; it < iter; ++it) {
+        CenterPanels panels(centroids.data(), k, D);
+        if (it == 0) {
+            bounds.Init(obs.data(), N, D, centroids.data(), panels, labels.data(), rd);
+        } else {
+            bounds.Assign(obs.data(), N, D, centroids.data(), prev.data(), labels.data());
+        }
+        NearestCenters(obs.data(), N, D, panels, labels_ref.data(), nullptr);
+        for (size_t i = 0; i < N; ++i) {
+            if (labels[i] == labels_ref[i]) continue;
+            bool tie = Tie(obs.data() + i * D, centroids.data(), labels[i], labels_ref[i]);
+            ok_labels = ok_labels && tie;
+            nties += tie;
+        }
+
+        prev = centroids;
+        std::vector<size_t> sizes = UpdateCentroids(obs.data(), N, D, labels.data(), k, centroids.data());
+        ok_means = SameMeans(obs, labels, prev, centroids, sizes) && ok_means;
+        SplitEmptyClusters(N, D, k, sizes, centroids.data(), rd);
+    }
+    printf("YinyangBounds labels as NearestCenters over %d iterations (%zu ties): %s\n",
+        iter, nties, ok_labels ? "yes" : "no");
+    printf("UpdateCentroids as the mean of every cluster: %s\n", ok_means ? "yes" : "no");
+
+    // Centroids sent far away get no observation: their clusters are split from others
+    std::vector<float> centroids_empty(k * D);
+    InitCentroids(obs.data(), N, D, k, "points", centroids_empty.data(), rd);
+    int nempty = k / 8;
+    for (int c = 0; c < nempty; ++c) {
+        for (size_t j = 0; j < D; ++j) centroids_empty[c * D + j] = 1e4f;
+    }
+    NearestCenters(obs.data(), N, D, CenterPanels(centroids_empty.data(), k, D), labels.data(), nullptr);
+    std::vector<size_t> sizes = UpdateCentroids(obs.data(), N, D, labels.data(), k, centroids_empty.data());
+    const std::vector<size_t> sizes_before = sizes;
+    size_t nempty_before = std::count(sizes.begin(), sizes.end(), 0);
+    SplitEmptyClusters(N, D, k, sizes, centroids_empty.data(), rd);
+    bool ok_split = nempty_before >= (size_t)nempty && std::count(sizes.begin(), sizes.end(), 0) == 0
+        && std::accumulate(sizes.begin(), sizes.end(), size_t(0)) == N;
+    // The empty centroids now sit among the observations, each apart from all the others,
+    // so that the next assignment can split the clusters they were copied from
+    for (int ci = 0; ci < k; ++ci) {
+        if (sizes_before[ci] != 0) continue;
+        for (int cj = 0; cj < k; ++cj) {
+            if (cj == ci) continue;
+            ok_split = ok_split && fvec_L2sqr(centroids_empty.data() + ci * D, centroids_empty.data() + cj * D, D) > 0;
+        }
+        ok_split = ok_split && std::fabs(centroids_empty[ci * D]) < 1e3f;
+    }
+    printf("SplitEmptyClusters leaves no empty cluster (%zu were): %s\n", nempty_before, ok_split ? "yes" : "no");
+
+    bool ok = ok_labels && ok_means && ok_split;
+    return ok ? 0 : 1;
+}
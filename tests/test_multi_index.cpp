@@ -0,0 +1,166 @@
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <unordered_set>
+
+#include "centroid_search.hpp"
+#include "index_ivf.hpp"
+#include "index_ivfpq.hpp"
+#include "quantizer.hpp"
+#include "util.hpp"
+#include "test_data.hpp"
+
+
+size_t D = 32;              // dimension of the vectors to index
+size_t nb = 100'000;        // size of the database we plan to index
+size_t nq = 200;            // size of the query we plan to search
+int ncentroids = 64;        // per half: 4096 cells
+int nprobe = 64;
+int k = 10;
+
+// MultiSequence against all the L * L sums, sorted
+bool CheckMultiSequence()
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform;
+    size_t L = 50, w = 500;
+    std::vector<float> d0(L), d1(L);
+    for (auto& x : d0) x = uniform(rng);
+    for (auto& x : d1) x = uniform(rng);
+    std::sort(d0.begin(), d0.end());
+    std::sort(d1.begin(), d1.end());
+
+    std::vector<float> sums;
+    for (float x0 : d0) {
+        for (float x1 : d1) sums.push_back(x0 + x1);
+    }
+    std::sort(sums.begin(), sums.end());
+
+    MultiSequenceScratch scratch;
+    std::vector<uint32_t> pairs(w);
+    std::vector<float> dists(w);
+    MultiSequence(d0.data(), d1.data(), L, w, pairs.data(), dists.data(), scratch);
+    size_t n_bad = 0;
+    std::unordered_set<uint32_t> seen;
+    for (size_t i = 0; i < w; ++i) {
+        n_bad += dists[i] != sums[i] || dists[i] != d0[pairs[i] / L] + d1[pairs[i] % L] || !seen.insert(pairs[i]).second;
+    }
+    printf("MultiSequence: %zu / %zu pairs differ\n", n_bad, w);
+    return n_bad == 0;
+}
+
+// search_cells against the distances to all the cells
+bool CheckSearchCells(const std::vector<float>& database, const std::vector<float>& query)
+{
+    Quantizer::Quantizer<float> cq(D, nb, 2, ncentroids);
+    cq.fit(database, 6, 123, "++");
+
+    MultiSequenceScratch scratch;
+    std::vector<uint32_t> labels(nprobe);
+    std::vector<float> dists(nprobe);
+    size_t n_bad = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        const float* x = query.data() + q * D;
+        std::vector<float> all(cq.ncells());
+        for (size_t cell = 0; cell < cq.ncells(); ++cell) {
+            all[cell] = fvec_L2sqr(x, cq.centroid(0, cq.cell_center(cell, 0)), D / 2)
+                + fvec_L2sqr(x + D / 2, cq.centroid(1, cq.cell_center(cell, 1)), D / 2);
+        }
+        cq.search_cells(x, nprobe, labels.data(), dists.data(), scratch);
+        std::partial_sort(all.begin(), all.begin() + nprobe, all.end());
+        for (int i = 0; i < nprobe; ++i) {
+            n_bad += std::abs(dists[i] - all[i]) > 1e-4f * (1 + all[i]);
+        }
+    }
+    printf("search_cells: %zu / %zu distances differ\n", n_bad, nq * nprobe);
+    return n_bad == 0;
+}
+
+template <typename Index>
+std::vector<std::vector<float>> Evaluate(const Index& index, const std::vector<float>& query,
+    const std::vector<std::vector<size_t>>& gt, const char* name)
+{
+    std::vector<std::vector<float>> dist(nq, std::vector<float>(k));
+    std::vector<toy::idx_t> nnid(k);
+    toy::SearchContext ctx;
+    int n_ok = 0;
+    Timer timer_query;
+    timer_query.Start();
+    for (size_t q = 0; q < nq; ++q) {
+        index.Search(query.data() + q * D, k, nprobe, nnid.data(), dist[q].data(), ctx);
+        std::unordered_set<size_t> S(gt[q].begin(), gt[q].end());
+        for (int i = 0; i < k; ++i) n_ok += S.count(nnid[i]);
+    }
+    timer_query.Stop();
+    printf("%s: %.3f s, Recall@%d: %.4f\n", name, timer_query.GetTime(), k, (double)n_ok / (nq * k));
+    return dist;
+}
+
+int main() {
+    bool ok = CheckMultiSequence();
+
+    std::mt19937 rng;
+    ClusteredData data(D, 1000, 2, rng);
+    const auto& database = data.Draw(nb);
+    const auto& query = data.Draw(nq);
+    const auto& gt = GroundTruth(database, query, D, k);
+
+    ok = CheckSearchCells(database, query) && ok;
+
+    // The exact vectors of the cells
+    toy::IVFConfig cfg(nb, D, nb, ncentroids, 2, D / 2, "", "");
+    toy::IndexIVF<float> index(cfg, nq, false);
+    index.Train(database, 123, nb);
+    index.Populate(database);
+    Evaluate(index, query, gt, "IVF, multi-index");
+
+    // By residual, the tables of a cell add up from those of its two centers. Quantized
+    // and rescored, the same results as the float tables
+    toy::IVFPQConfig cfg_pq(nb, D, nb, ncentroids, 256, 2, 8, D / 2, D / 8, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true);
+    toy::IndexIVFPQ<float> index_pq(cfg_pq, nq, false);
+    index_pq.Train(database, 123, nb);
+    index_pq.Populate(database);
+    const auto& dist = Evaluate(index_pq, query, gt, "IVFPQ by residual, multi-index");
+
+    toy::IVFPQConfig cfg_q(nb, D, nb, ncentroids, 256, 2, 8, D / 2, D / 8, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_BLOCK_16, toy::TABLE_UINT8, true);
+    toy::IndexIVFPQ<float> index_q(cfg_q, nq, false);
+    index_q.Train(database, 123, nb);
+    index_q.Populate(database);
+    const auto& dist_q = Evaluate(index_q, query, gt, "IVFPQ by residual, multi-index, uint8 tables, blocks of 16");
+    printf("Same results with uint8 tables: %s\n", dist == dist_q ? "yes" : "no");
+    ok = dist == dist_q && ok;
+
+    // The batch search, on the cells of TopWId
+    std::vector<std::vector<float>> queries(nq);
+    for (size_t q = 0; q < nq; ++q) queries[q].assign(query.begin() + q * D, query.begin() + (q + 1) * D);
+    std::vector<std::vector<uint32_t>> topw;
+    std::vector<std::vector<toy::idx_t>> topk_id;
+    std::vector<std::vector<float>> topk_dist;
+    index_pq.TopWId(nprobe, queries, topw, 1);
+    index_pq.TopKId(k, queries, topw, topk_id, topk_dist, 1);
+    printf("Same results with TopKId: %s\n", topk_dist == dist ? "yes" : "no");
+    ok = topk_dist == dist && ok;
+
+    // 2^14 x 2^14 cells, mostly empty: the lists take room for the cells in use only.
+    // A vector of the database is in the nearest cell to it, so it is its own nearest
+    size_t nb_big = 20'000, kc_big = 1 << 14;
+    std::vector<float> database_big(database.begin(), database.begin() + nb_big * D);
+    toy::IVFConfig cfg_big(nb_big, D, nb_big, kc_big, 2, D / 2, "", "");
+    toy::IndexIVF<float> index_big(cfg_big, nq, false);
+    index_big.Train(database_big, 123, nb_big);
+    index_big.Populate(database_big);
+    std::vector<toy::idx_t> nnid(1);
+    std::vector<float> d(1);
+    toy::SearchContext ctx;
+    size_t n_found = 0, n_check = 1000;
+    for (size_t i = 0; i < n_check; ++i) {
+        index_big.Search(database_big.data() + i * D, 1, 1, nnid.data(), d.data(), ctx);
+        n_found += nnid[0] == (toy::idx_t)i;
+    }
+    printf("IVF, multi-index of %zu cells: %zu / %zu vectors found\n", kc_big * kc_big, n_found, n_check);
+    ok = n_found == n_check && ok;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+
+#include "index_ivf.hpp"
+#include "index_ivfpq.hpp"
+#include "util.hpp"
+
+
+size_t D = 32;              // dimension of the vectors to index
+size_t nb = 50'000;         // size of the database we plan to index
+size_t nq = 200;            // size of the query we plan to search
+int ncentroids = 128;
+int nprobe = 8;
+int k = 10;
+
+// Heap allocations made while counting is on
+static bool counting = false;
+static size_t nalloc = 0;
+
+void* operator new(size_t size)
+{
+    if (counting) nalloc++;
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    if (counting) nalloc++;
+    void* p = std::aligned_alloc((size_t)align, (size + (size_t)align - 1) / (size_t)align * (size_t)align);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+// Search with one context against QueryBaseline, then the allocations of a second pass
+template <typename Index>
+bool Check(Index& index, const std::vector<float>& query, const std::string& name)
+{
+    toy::SearchContext ctx;
+    std::vector<toy::idx_t> nnid(k);
+    std::vector<float> dist(k);
+    size_t n_same = 0;
+    for (size_t q = 0; q < nq; ++q) {
+        size_t searched_cnt = index.Search(query.data() + q * D, k, nprobe, nnid.data(), dist.data(), ctx);
+
+        std::vector<size_t> nnid_baseline(k);
+        std::vector<float> dist_baseline(k);
+        size_t searched_cnt_baseline;
+        index.QueryBaseline(std::vector<float>(query.begin() + q * D, query.begin() + (q + 1) * D),
+            nnid_baseline, dist_baseline, searched_cnt_baseline, k, nb, q, nprobe);
+        bool same = searched_cnt == searched_cnt_baseline && dist == dist_baseline;
+        for (int i = 0; i < k; ++i) same = same && (size_t)nnid[i] == nnid_baseline[i];
+        n_same += same;
+    }
+
+    nalloc = 0;
+    counting = true;
+    for (size_t q = 0; q < nq; ++q) {
+        index.Search(query.data() + q * D, k, nprobe, nnid.data(), dist.data(), ctx);
+    }
+    counting = false;
+
+    printf("%s: %zu / %zu queries as QueryBaseline, %zu allocations\n", name.c_str(), n_same, nq, nalloc);
+    return n_same == nq && nalloc == 0;
+}
+
+int main() {
+    std::mt19937 rng;
+    std::normal_distribution<float> normal;
+
+    std::vector<float> database(nb * D), query(nq * D);
+    for (auto& x : database) x = normal(rng);
+    for (auto& x : query) x = normal(rng);
+
+    bool ok = true;
+    for (MetricType metric : {METRIC_L2, METRIC_COSINE}) {
+        toy::IVFConfig cfg(nb, D, nb, ncentroids, 1, D, "", "", metric);
+        toy::IndexIVF<float> index(cfg, nq, false);
+        index.Train(database, 123, nb);
+        index.Populate(database);
+        ok = Check(index, query, "IVF metric " + std::to_string(metric)) && ok;
+        index.BuildCoarseGraph();
+        ok = Check(index, query, "IVF metric " + std::to_string(metric) + ", coarse graph") && ok;
+    }
+
+    // Inverted multi-index, 16 x 16 cells
+    toy::IVFConfig cfg_mi(nb, D, nb, 16, 2, D / 2, "", "");
+    toy::IndexIVF<float> index_mi(cfg_mi, nq, false);
+    index_mi.Train(database, 123, nb);
+    index_mi.Populate(database);
+    ok = Check(index_mi, query, "IVF, multi-index") && ok;
+
+    struct PqCase { size_t kp, mp; toy::CodeLayout layout; toy::TableType table; bool by_residual; const char* name; };
+    const PqCase cases[] = {
+        {256, 8, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, false, "IVFPQ"},
+        {256, 8, toy::CODE_LAYOUT_BLOCK_16, toy::TABLE_UINT8, false, "IVFPQ, uint8 tables, blocks of 16"},
+        {256, 8, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_UINT16, true, "IVFPQ by residual, uint16 tables"},
+        {16, 16, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true, "IVFPQ by residual, fast scan"},
+    };
+    for (const auto& c : cases) {
+        toy::IVFPQConfig cfg(nb, D, nb, ncentroids, c.kp, 1, c.mp, D, D / c.mp, "", "",
+            METRIC_L2, c.layout, c.table, c.by_residual);
+        toy::IndexIVFPQ<float> index(cfg, nq, false);
+        index.Train(database, 123, nb);
+        index.Populate(database);
+        ok = Check(index, query, c.name) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <unordered_set>
+
+#include "index_ivf.hpp"
+#include "index_ivfpq.hpp"
+#include "util.hpp"
+#include "test_data.hpp"
+
+
+size_t D = 32;              // dimension of the vectors to index
+size_t nb = 100'000;        // size of the database we plan to index
+size_t nq = 500;            // size of the query we plan to search
+int ncentroids = 1024;
+int nprobe = 8;
+int k = 10;
+
+// Recall of the search, and whether every query got k distinct ids
+template <typename Index>
+double Evaluate(const Index& index, const std::vector<float>& query,
+    const std::vector<std::vector<size_t>>& gt, bool& unique, std::vector<std::vector<float>>* dist = nullptr)
+{
+    std::vector<toy::idx_t> nnid(k);
+    std::vector<float> d(k);
+    toy::SearchContext ctx;
+    size_t n_ok = 0;
+    unique = true;
+    for (size_t q = 0; q < nq; ++q) {
+        index.Search(query.data() + q * D, k, nprobe, nnid.data(), d.data(), ctx);
+        std::unordered_set<size_t> S(gt[q].begin(), gt[q].end());
+        for (int i = 0; i < k; ++i) n_ok += S.count(nnid[i]);
+        unique = unique && std::unordered_set<toy::idx_t>(nnid.begin(), nnid.end()).size() == (size_t)k;
+        if (dist) dist->push_back(d);
+    }
+    return (double)n_ok / (nq * k);
+}
+
+// Entries stored for the nb vectors: all of them are removed
+template <typename Index>
+size_t NumEntries(Index& index)
+{
+    std::vector<toy::idx_t> ids(nb);
+    std::iota(ids.begin(), ids.end(), 0);
+    return index.Remove(nb, ids.data());
+}
+
+int main() {
+    std::mt19937 rng;
+    // Many small clusters, so that the neighbors of a query are often across a list border
+    ClusteredData data(D, 20000, 1, rng);
+    const auto& database = data.Draw(nb, 0.5f);
+    const auto& query = data.Draw(nq, 0.5f);
+    const auto& gt = GroundTruth(database, query, D, k);
+
+    // Exact vectors: with the spilled entries, more of the neighbors in the nprobe lists
+    bool ok = true, unique;
+    toy::IVFConfig cfg(nb, D, nb, ncentroids, 1, D, "", "");
+    toy::IndexIVF<float> index(cfg, nq, false);
+    index.Train(database, 123, nb);
+    index.Populate(database);
+    double recall = Evaluate(index, query, gt, unique);
+    printf("IVF, nprobe %d: Recall@%d %.4f, %zu entries\n", nprobe, k, recall, NumEntries(index));
+
+    toy::IVFConfig cfg_spill(nb, D, nb, ncentroids, 1, D, "", "", METRIC_L2, 4, 1.2f);
+    toy::IndexIVF<float> index_spill(cfg_spill, nq, false);
+    index_spill.Train(database, 123, nb);
+    index_spill.Populate(database);
+    std::vector<std::vector<float>> dist;
+    double recall_spill = Evaluate(index_spill, query, gt, unique, &dist);
+    size_t nentries = NumEntries(index_spill);
+    printf("IVF with spill 4, nprobe %d: Recall@%d %.4f, %zu entries, distinct ids: %s\n",
+        nprobe, k, recall_spill, nentries, unique ? "yes" : "no");
+    ok = recall_spill > recall + 0.02 && nentries > nb && unique && ok;
+
+    // All the vectors are removed: the slots of the results hold no entry
+    std::vector<toy::idx_t> nnid(k, 0);
+    std::vector<float> d(k, 0);
+    toy::SearchContext ctx;
+    index_spill.Search(query.data(), k, nprobe, nnid.data(), d.data(), ctx);
+    bool empty = true;
+    for (int i = 0; i < k; ++i) empty = empty && nnid[i] == -1 && d[i] == std::numeric_limits<float>::infinity();
+    printf("No result once all removed: %s\n", empty ? "yes" : "no");
+    ok = empty && ok;
+
+    // Added in two parts, with the ids of their rows, the same lists as Populate
+    toy::IndexIVF<float> index_add(cfg_spill, nq, false);
+    index_add.Train(database, 123, nb);
+    index_add.Add(nb / 2, database.data());
+    std::vector<toy::idx_t> ids(nb - nb / 2);
+    std::iota(ids.begin(), ids.end(), nb / 2);
+    index_add.Add(nb - nb / 2, database.data() + nb / 2 * D, ids.data());
+    std::vector<std::vector<float>> dist_add;
+    Evaluate(index_add, query, gt, unique, &dist_add);
+    printf("Same results with Add: %s\n", dist_add == dist ? "yes" : "no");
+    ok = dist_add == dist && ok;
+
+    // PQ codes by residual: a spilled vector has a code per list
+    toy::IVFPQConfig cfg_pq(nb, D, nb, ncentroids, 256, 1, 16, D, D / 16, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true);
+    toy::IndexIVFPQ<float> index_pq(cfg_pq, nq, false);
+    index_pq.Train(database, 123, nb);
+    index_pq.Populate(database);
+    recall = Evaluate(index_pq, query, gt, unique);
+    printf("IVFPQ by residual, nprobe %d: Recall@%d %.4f, %zu entries\n", nprobe, k, recall, NumEntries(index_pq));
+
+    toy::IVFPQConfig cfg_pq_spill(nb, D, nb, ncentroids, 256, 1, 16, D, D / 16, "", "",
+        METRIC_L2, toy::CODE_LAYOUT_ROW_MAJOR, toy::TABLE_FLOAT, true, 4, 1.2f);
+    toy::IndexIVFPQ<float> index_pq_spill(cfg_pq_spill, nq, false);
+    index_pq_spill.Train(database, 123, nb);
+    index_pq_spill.Populate(database);
+    std::vector<std::vector<float>> dist_pq;
+    recall_spill = Evaluate(index_pq_spill, query, gt, unique, &dist_pq);
+    printf("IVFPQ by residual with spill 4, nprobe %d: Recall@%d %.4f, distinct ids: %s\n",
+        nprobe, k, recall_spill, unique ? "yes" : "no");
+    ok = recall_spill > recall + 0.02 && unique && ok;
+
+    // The batch searches merge the top k of the lists without duplicates too
+    std::vector<std::vector<float>> queries(nq);
+    for (size_t q = 0; q < nq; ++q) queries[q].assign(query.begin() + q * D, query.begin() + (q + 1) * D);
+    std::vector<std::vector<uint32_t>> topw;
+    std::vector<std::vector<toy::idx_t>> topk_id;
+    std::vector<std::vector<float>> topk_dist, topk_dist_lm;
+    index_pq_spill.TopWId(nprobe, queries, topw, 1);
+    index_pq_spill.TopKId(k, queries, topw, topk_id, topk_dist, 1);
+    index_pq_spill.TopKIdListMajor(k, queries, topw, topk_id, topk_dist_lm, 4);
+    printf("Same results with TopKId: %s, TopKIdListMajor: %s\n",
+        topk_dist == dist_pq ? "yes" : "no", topk_dist_lm == dist_pq ? "yes" : "no");
+    ok = topk_dist == dist_pq && topk_dist_lm == dist_pq && ok;
+
+    return ok ? 0 : 1;
+}